@@ -16,11 +16,21 @@
  */
  
 #include "digitizer.hh"
+#include "backend.hh"
+#include "output.hh"
+#include "pipeline.hh"
+#include "eventbuilder.hh"
+#include "rawfile.hh"
+#include "metrics.hh"
+#include "trace.hh"
 
 #include <iostream>
 #include <fstream>
-
-#include <unistd.h>
+#include <sstream>
+#include <memory>
+#include <chrono>
+#include <thread>
+#include <csignal>
 
 #include <H5Cpp.h>
 
@@ -28,6 +38,78 @@ using namespace H5;
 
 using namespace std;
 
+// Reads every board straight to basename[.boardN].raw without decoding
+void RecordRaw(RunConfig &run, vector<int> &boards, vector<Backend*> &dgtzs, vector<Settings> &settings, const string &basename) {
+    vector<unique_ptr<RawRecorder>> recorders;
+    for (size_t b = 0; b < boards.size(); b++) {
+        string fname = basename;
+        if (boards[b] >= 0) fname += ".board" + to_string(boards[b]);
+        fname += ".raw";
+        cout << "Dumping raw transfers to " << fname << endl;
+        
+        size_t events = 0; // what the channels' quotas add up to
+        for (size_t i = 0; i < settings[b].chans.size(); i++) {
+            if (settings[b].chans[i].enabled) events += settings[b].chans[i].events > 0 ? settings[b].chans[i].events : run.events;
+        }
+        recorders.push_back(unique_ptr<RawRecorder>(new RawRecorder(*dgtzs[b], settings[b], boards[b], fname, run, events)));
+    }
+    
+    cout << "Starting raw acquisition..." << endl;
+    
+    for (size_t b = 0; b < boards.size(); b++) {
+        recorders[b]->start();
+    }
+    for (size_t b = 0; b < boards.size(); b++) {
+        recorders[b]->finish();
+    }
+    for (size_t b = 0; b < boards.size(); b++) {
+        if (boards[b] >= 0) cout << "Board " << boards[b] << " ";
+        recorders[b]->report(cout);
+    }
+}
+
+// Closes the Output of a finished cycle and prints its summary in one piece, recording any failure in error
+void FinishOutput(Output *output, const string &fname, string &error) {
+    TraceThread("finish");
+    const uint64_t begin = now_ns();
+    try {
+        output->close();
+    } catch (runtime_error &e) {
+        error = fname + ": " + e.what();
+        return;
+    }
+    TraceEvent("finish",begin,now_ns());
+    ostringstream summary;
+    summary << "Finished " << fname << endl;
+    for (size_t i = 0; i < output->size(); i++) {
+        summary << "\t" << output->group(i) << ": " << output->written(i) << " events";
+        if (output->histogram(i)) summary << ", " << output->histogrammed(i) << " histogrammed";
+        summary << endl;
+    }
+    output->report(summary);
+    cout << summary.str() << flush;
+}
+
+// Set by SIGINT or SIGTERM, which end the run after the transfers being read
+static volatile sig_atomic_t interrupted = 0;
+
+void Interrupt(int sig) {
+    interrupted = 1;
+    signal(sig,SIG_DFL); // a second one kills
+}
+
+// Makes sure arena can hold the write buffers of an Output, and empties it
+Arena* ReserveArena(unique_ptr<Arena> &arena, size_t storage, const RunConfig &run) {
+    if (!arena || arena->capacity() < storage) {
+        cout << "Reserving " << storage/1e6 << " MB of write buffers..." << endl;
+        arena.reset(); // unmap the old one first
+        arena.reset(new Arena(storage, run.hugepages));
+        if (arena->pages() != run.hugepages) cout << "Write buffers use " << arena->pages() << " pages" << endl;
+    }
+    arena->reset();
+    return arena.get();
+}
+
 int main(int argc, char **argv) {
 
     if (argc != 2) {
@@ -38,68 +120,114 @@ int main(int argc, char **argv) {
     cout << "Parsing settings..." << endl;
     
     map<string,json::Value> db = ReadDB(argv[1]);
-    json::Value run = db["RUN[]"];
+    RunConfig run;
+    RunConfigFromDB(db,run);
+    if (run.outfile.empty()) throw runtime_error("RUN needs an outfile");
+    EventConfig eventconfig;
+    EventConfigFromDB(db,eventconfig);
+    
+    Exception::dontPrint();
     
-    const int ngrabs = run["events"].cast<int>();
-    const string outfile = run["outfile"].cast<string>();
-    const int transfer_wait = run["transfer_wait"].cast<int>();
-    const int linknum = run["link_num"].cast<int>();
-    const int baseaddr = run["base_address"].cast<int>();
-    int nrepeat;
-    if (run.isMember("repeat_times")) {
-        nrepeat = run["repeat_times"].cast<int>();
-    } else {
-        nrepeat = 0;
+    const string trace_file = run.trace_file; // a sequence point cannot change it
+    if (!trace_file.empty()) {
+        cout << "Tracing to " << trace_file << endl;
+        TraceStart(run.trace_events);
+        TraceThread("main");
     }
     
+    vector<int> boards = BoardsFromDB(db);
     
-    for (int cycle = nrepeat ? 0 : -1; cycle < nrepeat; cycle++) {
+    // a scan runs one point per cycle, each with its own settings
+    vector<json::Value> points = SequenceFromDB(db);
+    const bool sequence = !points.empty();
+    if (sequence) cout << "Scanning " << points.size() << " sequence points" << endl;
     
-        cout << "Opening digitizer..." << endl;
-
-        int handle; // CAENDigitizerSDK digitizer identifier
-        SAFE(CAEN_DGTZ_OpenDigitizer(CAEN_DGTZ_USB, linknum, 0, baseaddr, &handle));
-        SAFE(CAEN_DGTZ_SWStopAcquisition(handle));
-        SAFE(CAEN_DGTZ_Reset(handle));
+    // rotating splits the one cycle into outfile.0.h5, outfile.1.h5, ...
+    const bool rotating = run.rotate_mb > 0 || run.rotate_s > 0;
+    if ((run.continuous || rotating) && (sequence || run.repeat_times > 0 || run.raw)) throw runtime_error("continuous and rotate_* need a single HDF5 cycle (no SEQUENCE, repeat_times or raw)");
+    if (rotating && eventconfig.enabled) throw runtime_error("Cannot rotate files while building events");
+    if (run.continuous) cout << "Running until interrupted" << (run.duration_s > 0 ? " or " + to_string(run.duration_s) + " s" : "") << endl;
+    if (!run.raw) {
+        signal(SIGINT,Interrupt);
+        signal(SIGTERM,Interrupt);
+    }
+    
+    cout << "Opening and programming " << boards.size() << " digitizer(s)..." << endl;
+    
+    // kept open and programmed for every cycle; starting a board clears its old data
+    vector<Backend*> dgtzs;
+    vector<Settings> settings;
+    OpenBoards(db,boards,dgtzs,settings);
+    vector<unique_ptr<Backend>> owner(dgtzs.begin(),dgtzs.end());
+    
+    for (size_t b = 0; b < boards.size(); b++) {
+        if (boards[b] >= 0) cout << "Board " << boards[b] << ":" << endl;
+        PrintInfo(settings[b]);
+    }
+    
+    // write buffers for two files, so one can fill while the other is finished
+    unique_ptr<Arena> arenas[2];
+    int files = 0;
+    unique_ptr<Output> finishing;
+    std::thread finisher;
+    string finish_error;
+    
+    // follows the Output of the cycle acquiring
+    StatusLine status(run.status_interval, run.stats_file);
+    
+    chrono::steady_clock::time_point stopped;
+    double dead_total = 0.0, dead_max = 0.0;
+    int gaps = 0;
+    
+    const int cycles = sequence ? points.size() : run.repeat_times;
+    for (int cycle = cycles ? 0 : -1; cycle < cycles && !interrupted; cycle++) {
         
-        Settings settings;
-        InitSettings(handle,settings);
-        SettingsFromDB(db,settings);
+        string fname = run.outfile;
+        if (sequence) {
+            map<string,json::Value> pointdb = OverrideDB(db, points[cycle]);
+            RunConfigFromDB(pointdb,run);
+            EventConfigFromDB(pointdb,eventconfig);
+            
+            chrono::steady_clock::time_point start = chrono::steady_clock::now();
+            const uint64_t begin = now_ns();
+            ProgramBoards(pointdb,boards,dgtzs,settings,run.full_apply);
+            TraceEvent("program",begin,now_ns());
+            const double elapsed = chrono::duration<double>(chrono::steady_clock::now()-start).count();
+            
+            const string label = points[cycle].isMember("label") ? points[cycle]["label"].cast<string>() : to_string(cycle);
+            cout << "Sequence point " << cycle << " (" << label << "): reprogrammed in " << elapsed*1e3 << " ms" << endl;
+            fname = run.outfile + "." + label;
+        } else if (run.repeat_times > 0) {
+            fname += "." + to_string(cycle);
+        } else if (rotating) {
+            fname += ".0";
+        }
         
-        cout << "Programming digitizer..." << endl;
+        if (run.raw) {
+            RecordRaw(run, boards, dgtzs, settings, fname);
+            continue;
+        }
         
-        ApplySettings(handle,settings);
+        fname += ".h5"; 
         
-        cout << "Allocating readout buffers..." << endl;
+        cout << "Saving data to " << fname << endl;
         
-        uint32_t size; 
-        char *readout = NULL; // readout buffer (must init to NULL)
-        uint32_t nevents[MAX_DPP_PSD_CHANNEL_SIZE]; // events read per channel
-        CAEN_DGTZ_DPP_PSD_Event_t *events[16]; // event buffer per channel
-        CAEN_DGTZ_DPP_PSD_Waveforms_t *waveform = NULL; // waveform buffer
+        // a sequence point may need more than the last cycle that used this arena
+        const size_t storage = Output::storageBytes(settings, run);
+        unique_ptr<Output> output(new Output(fname, settings, boards, run, eventconfig, ReserveArena(arenas[files++ % 2], storage, run)));
         
-        // ugh this syntax
-        SAFE(CAEN_DGTZ_MallocReadoutBuffer(handle, &readout, &size));
-        SAFE(CAEN_DGTZ_MallocDPPEvents(handle, (void**)events, &size));
-        SAFE(CAEN_DGTZ_MallocDPPWaveforms(handle, (void**)&waveform, &size)); 
+        unique_ptr<EventBuilder> builder;
+        if (eventconfig.enabled) {
+            cout << "Building events within " << eventconfig.window << " ns" << endl;
+            builder.reset(new EventBuilder(*output, eventconfig));
+        }
         
-        cout << "Allocating temporary data storage..." << endl;
+        cout << "Allocating readout buffers..." << endl;
         
-        map<int,int> chan2idx,idx2chan;
-        vector<int> nsamples;
-        vector<uint16_t*> grabs, baselines, qshorts, qlongs;
-        vector<uint32_t*> times;
-        for (size_t i = 0; i < settings.info.Channels; i++) {
-            if (settings.chans[i].enabled) {
-                chan2idx[i] = nsamples.size();
-                idx2chan[nsamples.size()] = i;
-                nsamples.push_back(settings.chans[i].samples);
-                grabs.push_back(new uint16_t[ngrabs*nsamples.back()]);
-                baselines.push_back(new uint16_t[ngrabs]);
-                qshorts.push_back(new uint16_t[ngrabs]);
-                qlongs.push_back(new uint16_t[ngrabs]);
-                times.push_back(new uint32_t[ngrabs]);
-            }
+        vector<unique_ptr<Pipeline>> pipelines;
+        for (size_t b = 0; b < boards.size(); b++) {
+            pipelines.push_back(unique_ptr<Pipeline>(new Pipeline(*dgtzs[b], *output, b, run.continuous ? 0 : run.events, run.readout_buffers, run.decode_threads, ReadoutPacer(run))));
+            pipelines.back()->builder = builder.get();
         }
         
         if (cycle >= 0) {
@@ -108,176 +236,116 @@ int main(int argc, char **argv) {
             cout << "Starting acquisition..." << endl;
         }
         
-        SAFE(CAEN_DGTZ_ClearData(handle));
-        SAFE(CAEN_DGTZ_SWStartAcquisition(handle));
-        vector<int> grabbed(chan2idx.size(),0);
-        
-        bool acquiring = true;
-        while (acquiring) {
+        status.watch(&output->telemetry());
+        const uint64_t cycle_begin = now_ns();
+        if (builder) builder->start();
+        for (size_t b = 0; b < boards.size(); b++) {
+            pipelines[b]->start();
+        }
+        if (cycle > 0) {
+            const double dead = chrono::duration<double>(chrono::steady_clock::now()-stopped).count();
+            cout << "Dead time since cycle " << cycle-1 << ": " << dead*1e3 << " ms" << endl;
+            dead_total += dead;
+            dead_max = max(dead_max,dead);
+            gaps++;
+        }
         
-            cout << "Attempting readout...\n";
-            
-            SAFE(CAEN_DGTZ_ReadData(handle, CAEN_DGTZ_SLAVE_TERMINATED_READOUT_MBLT, readout, &size)); //read raw data from the digitizer
-            
-            usleep(transfer_wait*1000);
-            
-            if (!size) continue;
-            cout << "Transferred " << size << " bytes" << endl;
+        // until every board is done: stop early on a signal, duration_s, total_events, or livetime_s, and rotate files
+        chrono::steady_clock::time_point began = chrono::steady_clock::now(), opened = began, checked = began;
+        bool stopping = false;
+        for (int part = 1; ; ) {
+            bool running = false;
+            for (size_t b = 0; b < boards.size(); b++) {
+                if (!pipelines[b]->stopped()) running = true;
+            }
+            if (!running) break;
             
-            SAFE(CAEN_DGTZ_GetDPPEvents(handle, readout, size, (void **)events, nevents)); //parses the buffer and populates events and nevents
+            uint64_t taken = 0;
+            double livetime = 0.0;
+            for (size_t b = 0; b < boards.size(); b++) {
+                taken += pipelines[b]->taken();
+                livetime = max(livetime,pipelines[b]->clockTime());
+            }
             
-            acquiring = false;
+            chrono::steady_clock::time_point now = chrono::steady_clock::now();
+            const char *reason = NULL;
+            if (interrupted) {
+                reason = "Interrupted";
+            } else if (run.duration_s > 0 && chrono::duration<double>(now-began).count() >= run.duration_s) {
+                reason = "Reached duration_s";
+            } else if (run.total_events > 0 && taken >= run.total_events) {
+                reason = "Reached total_events";
+            } else if (run.livetime_s > 0 && livetime >= run.livetime_s) {
+                reason = "Reached livetime_s";
+            }
+            if (!stopping && reason) {
+                cout << reason << ", stopping..." << endl;
+                for (size_t b = 0; b < boards.size(); b++) pipelines[b]->stop();
+                stopping = true;
+            }
             
-            for (uint32_t ch = 0; ch < settings.info.Channels; ch++) {
-                if (!settings.chans[ch].enabled || grabbed[chan2idx[ch]] >= ngrabs) continue; //skip disabled channels
-                
-                acquiring = true;
-                
-                cout << "\t Ch" << ch << ": " << nevents[ch] << " events" << endl;
-                
-                int idx = chan2idx[ch];
-                int &chgrabbed = grabbed[idx];
-                
-                for (uint32_t ev = 0; ev < nevents[ch] && chgrabbed < ngrabs; ev++, chgrabbed++) {
-                    SAFE(CAEN_DGTZ_DecodeDPPWaveforms(handle, (void*) &events[ch][ev], (void*) waveform)); //unpacks the data into a nicer CAEN_DGTZ_DPP_PSD_Waveforms_t
-                    /* FOR REFERENCE
-                    typedef struct 
-                    {
-                        uint32_t Format;
-                        uint32_t TimeTag;
-	                    int16_t ChargeShort;
-	                    int16_t ChargeLong;
-                        int16_t Baseline;
-	                    int16_t Pur;
-                        uint32_t *Waveforms; 
-                    } CAEN_DGTZ_DPP_PSD_Event_t;
-                    typedef struct
-                    {
-                        uint32_t Ns;
-                        uint8_t  dualTrace;
-                        uint8_t  anlgProbe;
-                        uint8_t  dgtProbe1;
-                        uint8_t  dgtProbe2;
-                        uint16_t *Trace1;
-                        uint16_t *Trace2;
-                        uint8_t  *DTrace1;
-                        uint8_t  *DTrace2;
-                        uint8_t  *DTrace3;
-                        uint8_t  *DTrace4;
-                    } CAEN_DGTZ_DPP_PSD_Waveforms_t;
-                    */
-                    memcpy(grabs[idx]+nsamples[idx]*chgrabbed,waveform->Trace1,sizeof(uint16_t)*nsamples[idx]);
-                    baselines[idx][chgrabbed] = events[ch][ev].Baseline;
-                    qshorts[idx][chgrabbed] = events[ch][ev].ChargeShort;
-                    qlongs[idx][chgrabbed] = events[ch][ev].ChargeLong;
-                    times[idx][chgrabbed] = events[ch][ev].TimeTag;
+            if (!stopping && rotating && chrono::duration<double>(now-checked).count() >= 0.1) {
+                checked = now;
+                if ((run.rotate_s > 0 && chrono::duration<double>(now-opened).count() >= run.rotate_s) || (run.rotate_mb > 0 && output->fileBytes() >= run.rotate_mb*1e6)) {
+                    const uint64_t begin = now_ns();
+                    
+                    // the file before this one must be done with the arena the next one takes
+                    if (finisher.joinable()) finisher.join();
+                    finishing.reset();
+                    if (!finish_error.empty()) throw runtime_error(finish_error);
+                    
+                    const string next = run.outfile + "." + to_string(part++) + ".h5";
+                    unique_ptr<Output> fresh(new Output(next, settings, boards, run, eventconfig, ReserveArena(arenas[files++ % 2], storage, run)));
+                    for (size_t b = 0; b < boards.size(); b++) pipelines[b]->rotate(*fresh);
+                    for (size_t b = 0; b < boards.size(); b++) {
+                        while (!pipelines[b]->rotated()) this_thread::sleep_for(chrono::microseconds(100));
+                    }
+                    status.watch(&fresh->telemetry());
+                    TraceEvent("rotate",begin,now_ns());
+                    
+                    cout << "Rotated to " << next << ", finishing " << fname << " in the background..." << endl;
+                    finishing = move(output);
+                    finisher = std::thread(FinishOutput, finishing.get(), fname, ref(finish_error));
+                    output = move(fresh);
+                    fname = next;
+                    opened = now;
                 }
             }
+            
+            this_thread::sleep_for(chrono::milliseconds(1));
         }
         
-        SAFE(CAEN_DGTZ_SWStopAcquisition(handle));
-        SAFE(CAEN_DGTZ_CloseDigitizer(handle));
-        
-        Exception::dontPrint();
-        
-        string fname = outfile;
-        if (nrepeat > 0) {
-            fname += "." + to_string(cycle);
+        for (size_t b = 0; b < boards.size(); b++) {
+            pipelines[b]->finish();
         }
-        fname += ".h5"; 
+        stopped = chrono::steady_clock::now();
+        if (builder) builder->close();
+        TraceEvent("cycle",cycle_begin,now_ns());
+        status.watch(NULL); // the output is finished without it
         
-        cout << "Saving data to " << fname << endl;
-        
-        H5File file(fname, H5F_ACC_TRUNC);
+        for (size_t b = 0; b < boards.size(); b++) {
+            if (boards[b] >= 0) cout << "Board " << boards[b] << " ";
+            pipelines[b]->report(cout);
+        }
+        if (builder) builder->report(cout);
         
-        for (size_t i = 0; i < nsamples.size(); i++) {
-            cout << "Dumping channel " << idx2chan[i] << "... ";
+        // at most one file finishes in the background, which also frees the other arena
+        if (finisher.joinable()) finisher.join();
+        finishing.reset();
+        if (!finish_error.empty()) throw runtime_error(finish_error);
         
-            string groupname = "/ch" + to_string(idx2chan[i]);
-            Group group = file.createGroup(groupname);
-            
-            cout << "Attributes, ";
-            
-            DataSpace scalar(0,NULL);
-            
-            Attribute bits = group.createAttribute("bits",PredType::NATIVE_UINT32,scalar);
-            bits.write(PredType::NATIVE_INT32,&settings.info.ADC_NBits);
-            
-            Attribute ns_sample = group.createAttribute("ns_sample",PredType::NATIVE_DOUBLE,scalar);
-            double val = 0.0;
-            switch (settings.info.FamilyCode) {
-                case 5:
-                    val = 1.0;
-                    break;
-                case 11:
-                    val = 2.0;
-                    break;
-            }
-            ns_sample.write(PredType::NATIVE_DOUBLE,&val);
-            
-            Attribute offset = group.createAttribute("offset",PredType::NATIVE_UINT32,scalar);
-            offset.write(PredType::NATIVE_UINT32,&settings.chans[idx2chan[i]].offset);
-            
-            Attribute samples = group.createAttribute("samples",PredType::NATIVE_UINT32,scalar);
-            samples.write(PredType::NATIVE_UINT32,&settings.chans[idx2chan[i]].samples);
-            
-            Attribute presamples = group.createAttribute("presamples",PredType::NATIVE_UINT32,scalar);
-            presamples.write(PredType::NATIVE_UINT32,&settings.chans[idx2chan[i]].presamples);
-            
-            Attribute threshold = group.createAttribute("threshold",PredType::NATIVE_UINT32,scalar);
-            threshold.write(PredType::NATIVE_UINT32,&settings.chans[idx2chan[i]].threshold);
-            
-            Attribute chargesens = group.createAttribute("chargesens",PredType::NATIVE_UINT32,scalar);
-            chargesens.write(PredType::NATIVE_UINT32,&settings.chans[idx2chan[i]].chargesens);
-            
-            Attribute baseline = group.createAttribute("baseline",PredType::NATIVE_UINT32,scalar);
-            baseline.write(PredType::NATIVE_UINT32,&settings.chans[idx2chan[i]].baseline);
-            
-            Attribute coincidence = group.createAttribute("coincidence",PredType::NATIVE_UINT32,scalar);
-            coincidence.write(PredType::NATIVE_UINT32,&settings.chans[idx2chan[i]].coincidence);
-            
-            Attribute shortgate = group.createAttribute("shortgate",PredType::NATIVE_UINT32,scalar);
-            shortgate.write(PredType::NATIVE_UINT32,&settings.chans[idx2chan[i]].shortgate);
-            
-            Attribute longgate = group.createAttribute("longgate",PredType::NATIVE_UINT32,scalar);
-            longgate.write(PredType::NATIVE_UINT32,&settings.chans[idx2chan[i]].longgate);
-            
-            Attribute pregate = group.createAttribute("pregate",PredType::NATIVE_UINT32,scalar);
-            pregate.write(PredType::NATIVE_UINT32,&settings.chans[idx2chan[i]].pregate);
-            
-            hsize_t dimensions[2];
-            dimensions[0] = ngrabs;
-            dimensions[1] = nsamples[i];
-            
-            DataSpace samplespace(2, dimensions);
-            DataSpace metaspace(1, dimensions);
-            
-            cout << "Samples, ";
-            DataSet samples_ds = file.createDataSet(groupname+"/samples", PredType::NATIVE_UINT16, samplespace);
-            samples_ds.write(grabs[i], PredType::NATIVE_UINT16);
-            delete [] grabs[i];
-            
-            cout << "Baselines, ";
-            DataSet baselines_ds = file.createDataSet(groupname+"/baselines", PredType::NATIVE_UINT16, metaspace);
-            baselines_ds.write(baselines[i], PredType::NATIVE_UINT16);
-            delete [] baselines[i];
-            
-            cout << "QShorts, ";
-            DataSet qshorts_ds = file.createDataSet(groupname+"/qshorts", PredType::NATIVE_UINT16, metaspace);
-            qshorts_ds.write(qshorts[i], PredType::NATIVE_UINT16);
-            delete [] qshorts[i];
-            
-            cout << "QLongs, ";
-            DataSet qlongs_ds = file.createDataSet(groupname+"/qlongs", PredType::NATIVE_UINT16, metaspace);
-            qlongs_ds.write(qlongs[i], PredType::NATIVE_UINT16);
-            delete [] qlongs[i];
-
-            cout << "Times ";
-            DataSet times_ds = file.createDataSet(groupname+"/times", PredType::NATIVE_UINT32, metaspace);
-            times_ds.write(times[i], PredType::NATIVE_UINT32);
-            delete [] times[i];
-            
-            cout << endl;
-        }
+        cout << "Finishing " << fname << " in the background..." << endl;
+        finishing = move(output);
+        finisher = std::thread(FinishOutput, finishing.get(), fname, ref(finish_error));
+    }
+    
+    if (finisher.joinable()) finisher.join();
+    finishing.reset();
+    if (!finish_error.empty()) throw runtime_error(finish_error);
+    if (gaps) cout << "Dead time between cycles: " << dead_total/gaps*1e3 << " ms mean, " << dead_max*1e3 << " ms max over " << gaps << " gaps" << endl;
+    
+    if (!trace_file.empty()) {
+        TraceWrite(trace_file);
+        cout << "Wrote trace to " << trace_file << endl;
     }
 }
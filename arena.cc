@@ -0,0 +1,72 @@
+/**
+ *  Copyright 2014 by Benjamin Land (a.k.a. BenLand100)
+ *
+ *  acquire is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  acquire is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with acquire. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "arena.hh"
+
+#include <iostream>
+#include <stdexcept>
+
+#include <unistd.h>
+#include <sys/mman.h>
+
+using namespace std;
+
+static const size_t huge_page = 2 << 20;
+
+Arena::Arena(size_t bytes, const string &hugepages) : base(NULL), used(0), backing(hugepages) {
+    if (hugepages != "none" && hugepages != "transparent" && hugepages != "explicit") {
+        throw runtime_error("Unknown hugepages " + hugepages);
+    }
+    size = max<size_t>(bytes,1);
+
+    void *mem = MAP_FAILED;
+    if (hugepages == "explicit") {
+        const size_t rounded = (size + huge_page - 1) & ~(huge_page - 1);
+        mem = mmap(NULL, rounded, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+        if (mem != MAP_FAILED) {
+            size = rounded;
+        } else {
+            cout << "No explicit hugepages for " << size/1e6 << " MB (see /proc/sys/vm/nr_hugepages), using transparent ones" << endl;
+            backing = "transparent";
+        }
+    }
+    if (mem == MAP_FAILED) {
+        const size_t page = backing == "transparent" ? huge_page : sysconf(_SC_PAGESIZE);
+        size = (size + page - 1) & ~(page - 1);
+        mem = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) throw runtime_error("Could not map " + to_string(size) + " bytes for the arena");
+        if (backing == "transparent" && madvise(mem, size, MADV_HUGEPAGE)) backing = "none"; // THP disabled in this kernel
+    }
+    base = (char*)mem;
+
+    // fault everything in now rather than during acquisition
+    const size_t page = sysconf(_SC_PAGESIZE);
+    for (size_t offset = 0; offset < size; offset += page) base[offset] = 0;
+}
+
+Arena::~Arena() {
+    munmap(base, size);
+}
+
+void* Arena::take(size_t bytes) {
+    if (bytes > size - used) {
+        throw runtime_error("Arena of " + to_string(size) + " bytes cannot fit " + to_string(bytes) + " more");
+    }
+    void *ptr = base + used;
+    used += bytes;
+    return ptr;
+}
@@ -0,0 +1,66 @@
+/**
+ *  Copyright 2014 by Benjamin Land (a.k.a. BenLand100)
+ *
+ *  acquire is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  acquire is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with acquire. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __ARENA__HH
+#define __ARENA__HH
+
+#include <cstddef>
+#include <string>
+
+//Run-scoped memory: one mapping reserved and faulted in up front, handed out
+//by bumping an offset and taken back all at once by reset(), so every cycle
+//of a run reuses the same pages and nothing is allocated or faulted while
+//acquiring. Not thread safe; allocate while setting up a cycle.
+class Arena {
+
+    public:
+
+        // Maps at least bytes and touches every page. hugepages is none, transparent
+        // (madvise for THP), or explicit (MAP_HUGETLB, falling back to transparent).
+        Arena(size_t bytes, const std::string &hugepages);
+
+        ~Arena();
+
+        // Space taken by n objects of size bytes, including alignment
+        static inline size_t footprint(size_t size, size_t n) { return (size*n + align - 1) & ~(align - 1); }
+
+        // n uninitialized objects aligned to a cache line. Throws if the arena is exhausted.
+        template <typename T> T* alloc(size_t n) { return (T*)take(footprint(sizeof(T),n)); }
+
+        // Forgets every allocation, keeping the pages
+        inline void reset() { used = 0; }
+
+        inline size_t capacity() const { return size; }
+
+        inline size_t allocated() const { return used; }
+
+        // How the pages ended up backed: none, transparent, or explicit
+        inline const std::string& pages() const { return backing; }
+
+        static const size_t align = 64;
+
+    protected:
+
+        void* take(size_t bytes);
+
+        char *base;
+        size_t size, used;
+        std::string backing;
+
+};
+
+#endif
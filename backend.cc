@@ -0,0 +1,188 @@
+/**
+ *  Copyright 2014 by Benjamin Land (a.k.a. BenLand100)
+ *
+ *  acquire is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  acquire is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with acquire. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "backend.hh"
+#include "simulator.hh"
+
+#include <iostream>
+#include <thread>
+
+using namespace std;
+
+CAENBackend::CAENBackend(CAEN_DGTZ_ConnectionType link, int linknum, int conetnode, uint32_t baseaddr) :
+    link(link), linknum(linknum), conetnode(conetnode), baseaddr(baseaddr), handle(-1) {
+    applied.valid = false;
+    applied.seconds_per_call = 0.0;
+    interrupts = false;
+    enabled = disabled = 0;
+}
+
+CAENBackend::~CAENBackend() {
+    if (handle >= 0) CAEN_DGTZ_CloseDigitizer(handle);
+}
+
+void CAENBackend::open() {
+    SAFE(CAEN_DGTZ_OpenDigitizer(link, linknum, conetnode, baseaddr, &handle));
+    SAFE(CAEN_DGTZ_SWStopAcquisition(handle));
+    SAFE(CAEN_DGTZ_Reset(handle));
+    applied.valid = false;
+}
+
+void CAENBackend::getInfo(CAEN_DGTZ_BoardInfo_t &info) {
+    SAFE(CAEN_DGTZ_GetInfo(handle, &info));
+}
+
+void CAENBackend::program(Settings &settings) {
+    const ApplyStats stats = ApplySettings(handle,settings,&applied);
+    interrupts = settings.config_inter;
+    enabled = 0;
+    for (size_t i = 0; i < settings.info.Channels; i++) {
+        if (settings.chans[i].enabled) enabled |= 1 << i;
+    }
+    if (disabled) {
+        // ApplySettings only compares with what it last requested, so it skips an unchanged mask
+        SAFE(CAEN_DGTZ_SetChannelEnableMask(handle, enabled));
+        disabled = 0;
+    }
+    if (stats.skipped) {
+        cout << "Programmed board " << settings.info.SerialNumber << " in " << stats.seconds*1e3 << " ms: " << stats.issued << " calls, "
+             << stats.skipped << " skipped as unchanged (~" << stats.saved*1e3 << " ms saved)" << endl;
+    }
+}
+
+void CAENBackend::invalidate() {
+    applied.valid = false;
+}
+
+void CAENBackend::start() {
+    SAFE(CAEN_DGTZ_ClearData(handle));
+    SAFE(CAEN_DGTZ_SWStartAcquisition(handle));
+}
+
+void CAENBackend::stop() {
+    SAFE(CAEN_DGTZ_SWStopAcquisition(handle));
+}
+
+void CAENBackend::disable(uint32_t chmask) {
+    if (chmask == disabled) return;
+    SAFE(CAEN_DGTZ_SetChannelEnableMask(handle, enabled & ~chmask));
+    disabled = chmask;
+}
+
+char* CAENBackend::allocBuffer(uint32_t &size) {
+    char *buffer = NULL; // readout buffer (must init to NULL)
+    SAFE(CAEN_DGTZ_MallocReadoutBuffer(handle, &buffer, &size));
+    return buffer;
+}
+
+void CAENBackend::freeBuffer(char *buffer) {
+    SAFE(CAEN_DGTZ_FreeReadoutBuffer(&buffer));
+}
+
+void CAENBackend::read(char *buffer, uint32_t &size) {
+    SAFE(CAEN_DGTZ_ReadData(handle, CAEN_DGTZ_SLAVE_TERMINATED_READOUT_MBLT, buffer, &size)); //read raw data from the digitizer
+}
+
+bool CAENBackend::full() {
+    uint32_t status;
+    SAFE(CAEN_DGTZ_ReadRegister(handle,0x8104,&status)); // acquisition status
+    return status & (1<<4);
+}
+
+bool CAENBackend::wait(uint64_t timeout) {
+    if (!interrupts) return false;
+    const int err = CAEN_DGTZ_IRQWait(handle, (uint32_t)((timeout+999)/1000));
+    if (err && err != CAEN_DGTZ_Timeout) SAFE(err);
+    return true;
+}
+
+// Looks up a board setting in DIGITIZER[n], falling back to the RUN table (null if in neither)
+static json::Value BoardSetting(map<string,json::Value> &db, int board, const string &key) {
+    if (board >= 0) {
+        json::Value &digitizer = db[BoardTable("DIGITIZER",board)];
+        if (digitizer.isMember(key)) return digitizer[key];
+    }
+    json::Value &run = db["RUN[]"];
+    return run.isMember(key) ? run[key] : json::Value();
+}
+
+Backend* OpenBackend(map<string,json::Value> &db, int board) {
+    json::Value backendval = BoardSetting(db,board,"backend");
+    string backend = backendval.getType() == json::TNULL ? "caen" : backendval.cast<string>();
+    if (backend == "caen") {
+        json::Value conetnode = BoardSetting(db,board,"conet_node");
+        return new CAENBackend(CAEN_DGTZ_USB, BoardSetting(db,board,"link_num").cast<int>(), conetnode.getType() == json::TNULL ? 0 : conetnode.cast<int>(), BoardSetting(db,board,"base_address").cast<int>());
+    } else if (backend == "sim") {
+        string simname = BoardTable("SIMULATION",board);
+        if (db.find(simname) == db.end()) simname = "SIMULATION[]";
+        if (db.find(simname) == db.end()) throw runtime_error("sim backend requires a SIMULATION table");
+        return new SimBackend(db[simname], board < 0 ? 0 : board);
+    } else {
+        throw runtime_error("Unknown backend " + backend);
+    }
+}
+
+// Runs fn(i) for every board on its own thread, then throws the first failure
+template <typename Fn> static void ForEachBoard(const vector<int> &boards, Fn fn) {
+    vector<string> errors(boards.size());
+    vector<thread> threads;
+    for (size_t i = 0; i < boards.size(); i++) {
+        threads.push_back(thread([&,i]() {
+            try {
+                fn(i);
+            } catch (runtime_error &e) {
+                errors[i] = e.what();
+            }
+        }));
+    }
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads[i].join();
+    }
+    for (size_t i = 0; i < boards.size(); i++) {
+        if (!errors[i].empty()) throw runtime_error("Board " + to_string(boards[i]) + ": " + errors[i]);
+    }
+}
+
+void OpenBoards(map<string,json::Value> &db, const vector<int> &boards, vector<Backend*> &dgtzs, vector<Settings> &settings) {
+    // the DB is only read from this thread; the threads only talk to boards
+    dgtzs.clear();
+    settings.resize(boards.size());
+    try {
+        for (size_t i = 0; i < boards.size(); i++) {
+            dgtzs.push_back(OpenBackend(db,boards[i]));
+        }
+        ForEachBoard(boards,[&](size_t i) {
+            dgtzs[i]->open();
+            InitSettings(*dgtzs[i],settings[i]);
+        });
+        ProgramBoards(db,boards,dgtzs,settings);
+    } catch (runtime_error &e) {
+        for (size_t i = 0; i < dgtzs.size(); i++) delete dgtzs[i];
+        dgtzs.clear();
+        throw;
+    }
+}
+
+void ProgramBoards(map<string,json::Value> &db, const vector<int> &boards, vector<Backend*> &dgtzs, vector<Settings> &settings, bool full) {
+    for (size_t i = 0; i < boards.size(); i++) {
+        SettingsFromDB(db,settings[i],boards[i]);
+    }
+    ForEachBoard(boards,[&](size_t i) {
+        if (full) dgtzs[i]->invalidate();
+        dgtzs[i]->program(settings[i]);
+    });
+}
@@ -0,0 +1,138 @@
+/**
+ *  Copyright 2014 by Benjamin Land (a.k.a. BenLand100)
+ *
+ *  acquire is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  acquire is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with acquire. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __BACKEND__HH
+#define __BACKEND__HH
+
+#include "digitizer.hh"
+
+//Everything acquire and trigrate need from a digitizer. Readout buffers hold
+//DPP-PSD aggregates (see dpppsd.hh) regardless of the backend, so decoding is
+//shared by all of them.
+class Backend {
+
+    public:
+
+        virtual ~Backend() { }
+
+        // Connects to the board (separate from construction so boards can be opened in parallel)
+        virtual void open() = 0;
+
+        // Board description, as from CAEN_DGTZ_GetInfo
+        virtual void getInfo(CAEN_DGTZ_BoardInfo_t &info) = 0;
+
+        // Programs the board, updating settings to the values actually applied
+        virtual void program(Settings &settings) = 0;
+
+        // Makes the next program() push every setting rather than only those that changed
+        virtual void invalidate() { }
+
+        // Clears any buffered data and starts acquiring
+        virtual void start() = 0;
+
+        // Stops acquiring
+        virtual void stop() = 0;
+
+        // Stops the board sending events from the channels in chmask, keeping the rest enabled.
+        // Each call replaces the previous mask, which stays on the board (across start()) until
+        // disable(0) or program().
+        virtual void disable(uint32_t chmask) { }
+
+        // Allocates a buffer large enough for one transfer, setting size to its capacity
+        virtual char* allocBuffer(uint32_t &size) = 0;
+
+        virtual void freeBuffer(char *buffer) = 0;
+
+        // Reads one transfer into buffer, setting size to the bytes read (0 if none were ready)
+        virtual void read(char *buffer, uint32_t &size) = 0;
+
+        // Waits up to timeout us for the board's interrupt (irq_events buffered). False, without
+        // waiting, if the board was not programmed to interrupt.
+        virtual bool wait(uint64_t timeout) { return false; }
+
+        // True once a finite source (a replayed file) has nothing left to read
+        virtual bool finished() const { return false; }
+
+        // Whether the board's event memory is full, so it is dropping triggers until the next read.
+        // False if the backend cannot tell.
+        virtual bool full() { return false; }
+
+};
+
+//A real board through CAEN's Digitizer library
+class CAENBackend : public Backend {
+
+    public:
+
+        CAENBackend(CAEN_DGTZ_ConnectionType link, int linknum, int conetnode, uint32_t baseaddr);
+
+        // Closes the digitizer if it was opened
+        virtual ~CAENBackend();
+
+        // Opens, stops, and resets the digitizer
+        virtual void open();
+
+        // Only makes the library calls whose settings changed since the last one, unless invalidated
+        virtual void program(Settings &settings);
+
+        virtual void invalidate();
+
+        virtual void getInfo(CAEN_DGTZ_BoardInfo_t &info);
+        virtual void start();
+        virtual void stop();
+
+        // Clears the channels from the channel enable mask on the fly (only if they changed)
+        virtual void disable(uint32_t chmask);
+
+        virtual char* allocBuffer(uint32_t &size);
+        virtual void freeBuffer(char *buffer);
+        virtual void read(char *buffer, uint32_t &size);
+        virtual bool wait(uint64_t timeout);
+
+        // The memory full bit of the acquisition status register
+        virtual bool full();
+
+        inline int getHandle() const { return handle; }
+
+    protected:
+
+        CAEN_DGTZ_ConnectionType link;
+        int linknum, conetnode;
+        uint32_t baseaddr;
+
+        int handle; // CAENDigitizerSDK digitizer identifier (-1 until opened)
+
+        AppliedSettings applied; // what the board was last programmed with
+        bool interrupts; // programmed to interrupt
+        uint32_t enabled, disabled; // channels programmed to be enabled, and those disable() cleared
+
+};
+
+// Creates (but does not open) the backend selected by the backend field of DIGITIZER[board] or the RUN
+// table: "caen" (the default, using link_num, conet_node and base_address from
+// the same tables) or "sim" (using SIMULATION[board] or SIMULATION[])
+Backend* OpenBackend(std::map<std::string,json::Value> &db, int board = -1);
+
+// Opens and programs every board, with the slow register round trips of all boards
+// in parallel. Throws if any board failed.
+void OpenBoards(std::map<std::string,json::Value> &db, const std::vector<int> &boards, std::vector<Backend*> &dgtzs, std::vector<Settings> &settings);
+
+// Reprograms boards opened by OpenBoards from db, in parallel, pushing only the settings that
+// changed unless full. Throws if any board failed.
+void ProgramBoards(std::map<std::string,json::Value> &db, const std::vector<int> &boards, std::vector<Backend*> &dgtzs, std::vector<Settings> &settings, bool full = false);
+
+#endif
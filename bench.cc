@@ -0,0 +1,609 @@
+/**
+ *  Copyright 2014 by Benjamin Land (a.k.a. BenLand100)
+ *
+ *  acquire is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  acquire is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with acquire. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "digitizer.hh"
+#include "dpppsd.hh"
+#include "simulator.hh"
+#include "pipeline.hh"
+#include "psd.hh"
+#include "tracecodec.hh"
+#include "arena.hh"
+#include "trace.hh"
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <random>
+#include <cmath>
+#include <memory>
+
+#include <zlib.h>
+#include <sys/resource.h>
+
+using namespace std;
+
+typedef chrono::steady_clock bench_clock;
+
+inline double seconds_since(bench_clock::time_point start) {
+    return chrono::duration<double>(bench_clock::now()-start).count();
+}
+
+// Fills buf with board aggregates holding nevents events spread over nchans channels
+size_t synth_aggregates(char *buf, size_t capacity, uint32_t nchans, uint32_t nsamples, size_t nevents) {
+    mt19937 rng(1234);
+    normal_distribution<double> noise(0.0,2.0);
+    vector<uint16_t> trace(nsamples);
+
+    const uint32_t format = AggregateEncoder::format(nsamples,true,PSD_EXTRAS_BASELINE,true);
+    const size_t per_pair = 2*nevents/nchans;
+    AggregateEncoder enc(buf,capacity);
+    enc.beginBoard(0,0,0);
+    for (uint32_t pair = 0; pair < nchans/2; pair++) {
+        enc.beginPair(pair,format);
+        for (size_t i = 0; i < per_pair; i++) {
+            const uint32_t ch = 2*pair + (i & 1);
+            for (uint32_t s = 0; s < nsamples; s++) {
+                const double pulse = s < nsamples/8 ? 0.0 : 800.0*exp(-(double)(s-nsamples/8)/6.0);
+                trace[s] = (uint16_t)(8000.0 - pulse + noise(rng));
+            }
+            enc.addEvent(ch,i*100,8000*4,400,2000,false,trace.data());
+        }
+        enc.endPair();
+    }
+    enc.endBoard();
+    return enc.size();
+}
+
+// Unpacks events into a scratch block like acquire's BlockSink
+struct ScratchSink {
+    vector<uint16_t> samples, meta;
+    size_t n;
+    inline void operator()(const PSDEvent &ev) {
+        if (n*ev.nsamples >= samples.size()) n = 0;
+        UnpackSamples(ev,samples.data()+n*ev.nsamples);
+        meta[3*(n%1024)] = ev.baseline;
+        meta[3*(n%1024)+1] = ev.qshort;
+        meta[3*(n%1024)+2] = ev.qlong;
+        n++;
+    }
+};
+
+void bench_decode(int argc, char **argv) {
+    const uint32_t nchans = 16;
+    const uint32_t nsamples = argc > 0 ? atoi(argv[0]) : 64;
+    const size_t nevents = 1024;
+    const int reps = 2000;
+
+    vector<char> buf(nevents*(nsamples*2+16)+4096);
+    const size_t size = synth_aggregates(buf.data(),buf.size(),nchans,nsamples,nevents);
+
+    cout << "Decoding " << nevents << " events x " << nsamples << " samples (" << size << " bytes) " << reps << " times" << endl;
+
+    ScratchSink sink;
+    sink.samples.resize(1024*nsamples);
+    sink.meta.resize(3*1024);
+    sink.n = 0;
+    size_t total = 0;
+    bench_clock::time_point start = bench_clock::now();
+    for (int i = 0; i < reps; i++) {
+        total += DecodeAggregates(buf.data(),size,0xFFFF,sink);
+    }
+    double native = seconds_since(start);
+    cout << "native: " << total/native << " events/s, " << size*reps/native/1e6 << " MB/s" << endl;
+
+    if (argc < 2) return;
+
+    // the library path needs an open handle to know the firmware
+    map<string,json::Value> db = ReadDB(argv[1]);
+    json::Value run = db["RUN[]"];
+    CAENBackend dgtz(CAEN_DGTZ_USB, run["link_num"].cast<int>(), 0, run["base_address"].cast<int>());
+    dgtz.open();
+    const int handle = dgtz.getHandle();
+    Settings settings;
+    InitSettings(dgtz,settings);
+    SettingsFromDB(db,settings,BoardsFromDB(db)[0]);
+    dgtz.program(settings);
+
+    uint32_t allocated;
+    uint32_t nevts[MAX_DPP_PSD_CHANNEL_SIZE];
+    CAEN_DGTZ_DPP_PSD_Event_t *events[MAX_DPP_PSD_CHANNEL_SIZE];
+    CAEN_DGTZ_DPP_PSD_Waveforms_t *waveform = NULL;
+    SAFE(CAEN_DGTZ_MallocDPPEvents(handle, (void**)events, &allocated));
+    SAFE(CAEN_DGTZ_MallocDPPWaveforms(handle, (void**)&waveform, &allocated));
+
+    total = 0;
+    start = bench_clock::now();
+    for (int i = 0; i < reps; i++) {
+        SAFE(CAEN_DGTZ_GetDPPEvents(handle, buf.data(), size, (void **)events, nevts));
+        for (uint32_t ch = 0; ch < nchans; ch++) {
+            for (uint32_t ev = 0; ev < nevts[ch]; ev++, total++) {
+                SAFE(CAEN_DGTZ_DecodeDPPWaveforms(handle, (void*) &events[ch][ev], (void*) waveform));
+                memcpy(sink.samples.data(),waveform->Trace1,sizeof(uint16_t)*nsamples);
+            }
+        }
+    }
+    double caen = seconds_since(start);
+    cout << "CAENDigitizer: " << total/caen << " events/s, " << size*reps/caen/1e6 << " MB/s" << endl;
+    cout << "speedup: " << caen/native << "x" << endl;
+
+    SAFE(CAEN_DGTZ_FreeDPPEvents(handle, (void**)events));
+    SAFE(CAEN_DGTZ_FreeDPPWaveforms(handle, (void*)waveform));
+}
+
+// Holds one set of ComputePSD outputs
+struct PSDArrays {
+    vector<uint16_t> baselines, peaks;
+    vector<int32_t> qshorts, qlongs;
+    vector<float> tails;
+    PSDResults results;
+    PSDArrays(size_t n) : baselines(n), peaks(n), qshorts(n), qlongs(n), tails(n) {
+        results.baselines = baselines.data();
+        results.qshorts = qshorts.data();
+        results.qlongs = qlongs.data();
+        results.tails = tails.data();
+        results.peaks = peaks.data();
+    }
+    bool operator==(const PSDArrays &other) const {
+        // tails compared bitwise through memcmp so that any rounding difference counts
+        return baselines == other.baselines && peaks == other.peaks && qshorts == other.qshorts && qlongs == other.qlongs &&
+               !memcmp(tails.data(),other.tails.data(),sizeof(float)*tails.size());
+    }
+};
+
+// Times each software PSD kernel against the scalar one and checks they agree exactly
+bool bench_psd(int argc, char **argv) {
+    const uint32_t nsamples = argc > 0 ? atoi(argv[0]) : 64;
+    const size_t nevents = 16384;
+    const int reps = 100;
+    if (nsamples < 16) throw runtime_error("psd benchmark needs at least 16 samples");
+
+    mt19937 rng(1234);
+    normal_distribution<double> noise(0.0,2.0);
+    vector<uint16_t> samples(nevents*nsamples);
+    for (size_t ev = 0; ev < nevents; ev++) {
+        const double height = 100.0 + 3000.0*(ev % 97)/97.0;
+        for (uint32_t s = 0; s < nsamples; s++) {
+            const double pulse = s < nsamples/8 ? 0.0 : height*exp(-(double)(s-nsamples/8)/6.0);
+            samples[ev*nsamples+s] = (uint16_t)min(16383.0,max(0.0,8000.0 - pulse + noise(rng)));
+        }
+    }
+
+    // the configured gates plus odd lengths that exercise every partial vector
+    vector<PSDGates> gates;
+    for (uint32_t len = 1; len <= nsamples; len += 7) {
+        PSDGates g = {16, nsamples/8 - 2, len/3, len, true};
+        gates.push_back(g);
+    }
+    PSDGates positive = {nsamples/8, nsamples/8, nsamples/4, nsamples, false};
+    gates.push_back(positive);
+
+    const PSDKernel kernels[3] = {PSD_KERNEL_SCALAR, PSD_KERNEL_AVX2, PSD_KERNEL_AVX512};
+    PSDArrays reference(nevents), result(nevents);
+    bool exact = true;
+    for (size_t g = 0; g < gates.size(); g++) {
+        ComputePSD(gates[g],samples.data(),nevents,nsamples,reference.results,PSD_KERNEL_SCALAR);
+        for (int k = 1; k < 3; k++) {
+            if (!PSDKernelSupported(kernels[k])) continue;
+            ComputePSD(gates[g],samples.data(),nevents,nsamples,result.results,kernels[k]);
+            if (!(result == reference)) {
+                cout << PSDKernelName(kernels[k]) << " differs from scalar with longgate " << gates[g].longgate << endl;
+                exact = false;
+            }
+        }
+    }
+    cout << "Exactness: " << gates.size() << " gate settings, " << (exact ? "all kernels match scalar" : "MISMATCH") << endl;
+
+    PSDGates timed = {16, nsamples/8 - 2, nsamples/4, nsamples - nsamples/8, true};
+    cout << "Integrating " << nevents << " events x " << nsamples << " samples " << reps << " times" << endl;
+    double scalar = 0.0;
+    for (int k = 0; k < 3; k++) {
+        if (!PSDKernelSupported(kernels[k])) {
+            cout << PSDKernelName(kernels[k]) << ": not supported" << endl;
+            continue;
+        }
+        bench_clock::time_point start = bench_clock::now();
+        for (int i = 0; i < reps; i++) {
+            ComputePSD(timed,samples.data(),nevents,nsamples,result.results,kernels[k]);
+        }
+        const double elapsed = seconds_since(start);
+        if (k == 0) scalar = elapsed;
+        cout << PSDKernelName(kernels[k]) << ": " << nevents*reps/elapsed << " events/s, "
+             << samples.size()*sizeof(uint16_t)*reps/elapsed/1e6 << " MB/s, "
+             << scalar/elapsed << "x scalar" << endl;
+    }
+    return exact;
+}
+
+static long minor_faults() {
+    rusage usage;
+    getrusage(RUSAGE_SELF,&usage);
+    return usage.ru_minflt;
+}
+
+// The arrays of one write buffer, as Output allocates them
+struct BenchBlock {
+    uint16_t *samples, *baselines, *qshorts, *qlongs;
+    uint64_t *times;
+};
+
+// Times cycles of allocating and filling write buffers from the heap and from an Arena of each page backing
+void bench_arena(int argc, char **argv) {
+    const uint32_t nsamples = argc > 0 ? atoi(argv[0]) : 256;
+    const int cycles = argc > 1 ? atoi(argv[1]) : 10;
+    const size_t nchans = 8, nblocks = 8, chunk_events = 4096;
+    if (cycles < 2) throw runtime_error("arena benchmark needs at least 2 cycles");
+
+    size_t bytes = 0;
+    for (size_t i = 0; i < nchans*nblocks; i++) {
+        bytes += Arena::footprint(sizeof(uint16_t),chunk_events*nsamples) + 3*Arena::footprint(sizeof(uint16_t),chunk_events) + Arena::footprint(sizeof(uint64_t),chunk_events);
+    }
+    cout << "Cycling " << nchans << " channels x " << nblocks << " write buffers of " << chunk_events << " events x " << nsamples
+         << " samples (" << bytes/(1<<20) << " MB) " << cycles << " times" << endl;
+
+    const char *modes[4] = {"heap", "none", "transparent", "explicit"};
+    vector<BenchBlock> blocks(nchans*nblocks);
+    for (int m = 0; m < 4; m++) {
+        const string mode = modes[m];
+        unique_ptr<Arena> arena;
+        double first = 0.0, steady = 0.0;
+        long first_faults = 0, steady_faults = 0;
+        for (int c = 0; c < cycles; c++) {
+            const long faults = minor_faults();
+            bench_clock::time_point start = bench_clock::now();
+            if (mode != "heap") {
+                if (!arena) arena.reset(new Arena(bytes,mode));
+                arena->reset();
+            }
+            for (size_t i = 0; i < blocks.size(); i++) {
+                BenchBlock &block = blocks[i];
+                block.samples = arena ? arena->alloc<uint16_t>(chunk_events*nsamples) : new uint16_t[chunk_events*nsamples];
+                block.baselines = arena ? arena->alloc<uint16_t>(chunk_events) : new uint16_t[chunk_events];
+                block.qshorts = arena ? arena->alloc<uint16_t>(chunk_events) : new uint16_t[chunk_events];
+                block.qlongs = arena ? arena->alloc<uint16_t>(chunk_events) : new uint16_t[chunk_events];
+                block.times = arena ? arena->alloc<uint64_t>(chunk_events) : new uint64_t[chunk_events];
+            }
+            // what decoding does to every buffer in a cycle
+            for (size_t i = 0; i < blocks.size(); i++) {
+                BenchBlock &block = blocks[i];
+                memset(block.samples,c,chunk_events*nsamples*sizeof(uint16_t));
+                memset(block.baselines,c,chunk_events*sizeof(uint16_t));
+                memset(block.qshorts,c,chunk_events*sizeof(uint16_t));
+                memset(block.qlongs,c,chunk_events*sizeof(uint16_t));
+                memset(block.times,c,chunk_events*sizeof(uint64_t));
+            }
+            if (!arena) {
+                for (size_t i = 0; i < blocks.size(); i++) {
+                    delete [] blocks[i].samples;
+                    delete [] blocks[i].baselines;
+                    delete [] blocks[i].qshorts;
+                    delete [] blocks[i].qlongs;
+                    delete [] blocks[i].times;
+                }
+            }
+            const double elapsed = seconds_since(start);
+            if (c == 0) {
+                first = elapsed;
+                first_faults = minor_faults() - faults;
+            } else {
+                steady += elapsed/(cycles-1);
+                steady_faults += minor_faults() - faults;
+            }
+        }
+        cout << mode;
+        if (arena && arena->pages() != mode) cout << " (got " << arena->pages() << ")";
+        cout << ": first cycle " << first*1e3 << " ms, " << first_faults << " page faults; steady state "
+             << steady*1e3 << " ms, " << steady_faults/(cycles-1) << " page faults per cycle" << endl;
+    }
+}
+
+// Fills samples with ntraces digitized pulses on a noisy baseline, like a V1730 in list mode
+void synth_traces(vector<uint16_t> &samples, size_t ntraces, uint32_t nsamples) {
+    mt19937 rng(4321);
+    normal_distribution<double> noise(0.0,2.0);
+    exponential_distribution<double> height(1.0/400.0);
+    uniform_real_distribution<double> uniform(0.0,1.0);
+    samples.resize(ntraces*nsamples);
+    for (size_t t = 0; t < ntraces; t++) {
+        const double baseline = 8000.0 + 3.0*sin(t/5000.0);
+        const double amplitude = min(7000.0,20.0+height(rng));
+        const double slow = uniform(rng) < 0.3 ? 0.3 : 0.05; // neutrons have more light in the tail
+        for (uint32_t s = 0; s < nsamples; s++) {
+            const double dt = (double)s - nsamples/8.0;
+            const double pulse = dt < 0.0 ? 0.0 : amplitude*((1.0-slow)*exp(-dt/4.0) + slow*exp(-dt/40.0))*(1.0-exp(-dt-0.5));
+            samples[t*nsamples+s] = (uint16_t)min(16383.0,max(0.0,round(baseline - pulse + noise(rng))));
+        }
+    }
+}
+
+// Byte shuffle as HDF5's shuffle filter does it for 2 byte elements
+static void shuffle16(const uint16_t *in, size_t n, uint8_t *out, bool reverse) {
+    if (!reverse) {
+        for (size_t i = 0; i < n; i++) {
+            out[i] = in[i] & 0xFF;
+            out[n+i] = in[i] >> 8;
+        }
+    } else {
+        const uint8_t *bytes = (const uint8_t*)in;
+        for (size_t i = 0; i < n; i++) ((uint16_t*)out)[i] = bytes[i] | (bytes[n+i] << 8);
+    }
+}
+
+bool bench_codec_samples(const vector<uint16_t> &samples, uint32_t nsamples, size_t chunk_traces) {
+    const size_t chunk_values = chunk_traces*nsamples;
+    const size_t nchunks = samples.size()/chunk_values;
+    const double mb = samples.size()*sizeof(uint16_t)/1e6;
+    bool exact = true;
+
+    // losslessness, including partial blocks and incompressible data
+    {
+        vector<uint16_t> noise(1000);
+        mt19937 rng(99);
+        for (size_t i = 0; i < noise.size(); i++) noise[i] = rng();
+        const uint16_t *inputs[4] = {samples.data(), samples.data(), samples.data()+5, noise.data()};
+        const size_t sizes[4] = {chunk_values, 1001, 333, noise.size()};
+        for (int c = 0; c < 4; c++) {
+            vector<char> encoded(TraceEncodedBound(sizes[c]));
+            vector<uint16_t> decoded(sizes[c]);
+            const size_t size = EncodeTraces(inputs[c],sizes[c],encoded.data());
+            if (TraceDecodedValues(encoded.data(),size) != sizes[c] || !DecodeTraces(encoded.data(),size,decoded.data()) ||
+                memcmp(decoded.data(),inputs[c],sizes[c]*sizeof(uint16_t))) {
+                cout << "trace codec round trip " << c << " FAILED" << endl;
+                exact = false;
+            }
+        }
+    }
+
+    vector<char> encoded(nchunks*TraceEncodedBound(chunk_values));
+    vector<size_t> sizes(nchunks);
+    vector<uint16_t> decoded(samples.size());
+
+    bench_clock::time_point start = bench_clock::now();
+    size_t total = 0;
+    for (size_t c = 0; c < nchunks; c++) {
+        sizes[c] = EncodeTraces(samples.data()+c*chunk_values,chunk_values,encoded.data()+total);
+        total += sizes[c];
+    }
+    const double encode = seconds_since(start);
+    start = bench_clock::now();
+    for (size_t c = 0, offset = 0; c < nchunks; offset += sizes[c++]) {
+        if (!DecodeTraces(encoded.data()+offset,sizes[c],decoded.data()+c*chunk_values)) exact = false;
+    }
+    const double decode = seconds_since(start);
+    if (decoded != samples) exact = false;
+    cout << "trace: ratio " << mb*1e6/total << ", compress " << mb/encode << " MB/s, decompress " << mb/decode << " MB/s" << endl;
+
+    const int levels[2] = {1, 4};
+    for (int shuffle = 0; shuffle < 2; shuffle++) {
+        for (int l = 0; l < 2; l++) {
+            vector<uint8_t> shuffled(chunk_values*sizeof(uint16_t));
+            vector<Bytef> deflated(nchunks*compressBound(chunk_values*sizeof(uint16_t)));
+            vector<uLongf> lengths(nchunks);
+            total = 0;
+            start = bench_clock::now();
+            for (size_t c = 0; c < nchunks; c++) {
+                const uint16_t *chunk = samples.data()+c*chunk_values;
+                const Bytef *src = (const Bytef*)chunk;
+                if (shuffle) {
+                    shuffle16(chunk,chunk_values,shuffled.data(),false);
+                    src = shuffled.data();
+                }
+                lengths[c] = compressBound(chunk_values*sizeof(uint16_t));
+                compress2(deflated.data()+total,&lengths[c],src,chunk_values*sizeof(uint16_t),levels[l]);
+                total += lengths[c];
+            }
+            const double zencode = seconds_since(start);
+            start = bench_clock::now();
+            for (size_t c = 0, offset = 0; c < nchunks; offset += lengths[c++]) {
+                uLongf length = chunk_values*sizeof(uint16_t);
+                Bytef *dest = shuffle ? shuffled.data() : (Bytef*)(decoded.data()+c*chunk_values);
+                uncompress(dest,&length,deflated.data()+offset,lengths[c]);
+                if (shuffle) shuffle16((const uint16_t*)shuffled.data(),chunk_values,(uint8_t*)(decoded.data()+c*chunk_values),true);
+            }
+            const double zdecode = seconds_since(start);
+            cout << (shuffle ? "shuffle+deflate-" : "deflate-") << levels[l] << ": ratio " << mb*1e6/total
+                 << ", compress " << mb/zencode << " MB/s, decompress " << mb/zdecode << " MB/s" << endl;
+        }
+    }
+
+    cout << "Exactness: " << (exact ? "trace codec is lossless" : "MISMATCH") << endl;
+    return exact;
+}
+
+// Compares the trace codec against deflate and shuffle+deflate on chunks of traces, and checks it is lossless
+bool bench_codec(int argc, char **argv) {
+    const uint32_t nsamples = argc > 0 ? atoi(argv[0]) : 64;
+    const size_t chunk_traces = 1024; // acquire's default chunk_events
+    const size_t nchunks = 64;
+
+    vector<uint16_t> samples;
+    if (argc > 2) {
+        // traces from an acquire output file instead, e.g. /ch0/samples
+        H5::H5File file(argv[1], H5F_ACC_RDONLY);
+        H5::DataSet dataset = file.openDataSet(argv[2]);
+        hsize_t dims[2];
+        if (dataset.getSpace().getSimpleExtentNdims() != 2) throw runtime_error("expected a 2D samples dataset");
+        dataset.getSpace().getSimpleExtentDims(dims);
+        samples.resize(dims[0]*dims[1]);
+        dataset.read(samples.data(), H5::PredType::NATIVE_UINT16);
+        const size_t ntraces = dims[0]/chunk_traces*chunk_traces;
+        if (!ntraces) throw runtime_error("need at least one chunk of traces");
+        samples.resize(ntraces*dims[1]);
+        cout << "Compressing " << ntraces << " traces x " << dims[1] << " samples from " << argv[1] << argv[2] << endl;
+        return bench_codec_samples(samples, dims[1], chunk_traces);
+    }
+    synth_traces(samples,chunk_traces*nchunks,nsamples);
+    cout << "Compressing " << chunk_traces*nchunks << " simulated traces x " << nsamples << " samples" << endl;
+    return bench_codec_samples(samples, nsamples, chunk_traces);
+}
+
+// Runs the full acquire pipeline against the simulated digitizer in the SIMULATION table,
+// in List mode if list, and returns the events stored per second
+double sim_pipeline(map<string,json::Value> &db, const RunConfig &run, const EventConfig &eventconfig, const string &fname, bool list) {
+    const vector<int> boards(1,BoardsFromDB(db)[0]);
+    SimBackend dgtz(db["SIMULATION[]"]);
+    vector<Settings> settings(1);
+    InitSettings(dgtz,settings[0]);
+    SettingsFromDB(db,settings[0],boards[0]);
+    if (list) settings[0].dppacqmode = CAEN_DGTZ_DPP_ACQ_MODE_List;
+    dgtz.program(settings[0]);
+
+    Output output(fname, settings, boards, run, eventconfig);
+    unique_ptr<EventBuilder> builder(eventconfig.enabled ? new EventBuilder(output, eventconfig) : NULL);
+    Pipeline pipeline(dgtz, output, 0, run.events, run.readout_buffers, run.decode_threads, ReadoutPacer(run));
+    pipeline.builder = builder.get();
+
+    cout << "Acquiring " << run.events << " events per channel into " << fname << endl;
+
+    bench_clock::time_point start = bench_clock::now();
+    if (builder) builder->start();
+    pipeline.run();
+    if (builder) builder->close();
+    output.close();
+    double elapsed = seconds_since(start);
+
+    size_t nevents = 0;
+    for (size_t i = 0; i < output.size(); i++) nevents += output.written(i);
+
+    pipeline.report(cout);
+    if (builder) builder->report(cout);
+    output.report(cout);
+    cout << "Simulated: " << dgtz.generated() << " events, " << dgtz.lost() << " lost to full board buffer" << endl;
+    cout << "Elapsed: " << elapsed << " s" << endl;
+    cout << "Throughput: " << nevents/elapsed << " events/s, " << pipeline.bytes/elapsed/1e6 << " MB/s transferred" << endl;
+    const LatencyHistogram &latency = output.latency();
+    cout << "Transfer to disk latency: p50 " << latency.percentile(0.5)/1e6 << " ms, p99 " << latency.percentile(0.99)/1e6
+         << " ms, max " << latency.maximum()/1e6 << " ms (" << latency.count() << " blocks)" << endl;
+    return nevents/elapsed;
+}
+
+void bench_pipeline(int argc, char **argv) {
+    if (argc < 1) throw runtime_error("./bench pipeline settings.json");
+
+    map<string,json::Value> db = ReadDB(argv[0]);
+    if (db.find("SIMULATION[]") == db.end()) throw runtime_error("pipeline benchmark requires a SIMULATION table");
+    RunConfig run;
+    RunConfigFromDB(db,run);
+    EventConfig eventconfig;
+    EventConfigFromDB(db,eventconfig);
+
+    H5::Exception::dontPrint();
+
+    sim_pipeline(db, run, eventconfig, run.outfile + "_bench.h5", false);
+}
+
+// Stores the same simulated List mode run as per-channel datasets and then as a list table
+void bench_list(int argc, char **argv) {
+    if (argc < 1) throw runtime_error("./bench list settings.json");
+
+    map<string,json::Value> db = ReadDB(argv[0]);
+    if (db.find("SIMULATION[]") == db.end()) throw runtime_error("list benchmark requires a SIMULATION table");
+    RunConfig run;
+    RunConfigFromDB(db,run);
+    EventConfig eventconfig;
+    EventConfigFromDB(db,eventconfig);
+    eventconfig.enabled = false; // the list table has no per-channel rows to build from
+
+    H5::Exception::dontPrint();
+
+    cout << "== Per-channel datasets ==" << endl;
+    run.list_table = false;
+    const double channels = sim_pipeline(db, run, eventconfig, run.outfile + "_bench.h5", true);
+    cout << "== List table ==" << endl;
+    run.list_table = true;
+    const double table = sim_pipeline(db, run, eventconfig, run.outfile + "_bench_list.h5", true);
+    cout << "List table: " << table << " events/s vs " << channels << " events/s (" << setprecision(3) << table/channels << "x)" << endl;
+}
+
+// Runs the simulated pipeline alternately without and with tracing, comparing the best of each
+void bench_trace(int argc, char **argv) {
+    if (argc < 1) throw runtime_error("./bench trace settings.json [rounds]");
+
+    map<string,json::Value> db = ReadDB(argv[0]);
+    if (db.find("SIMULATION[]") == db.end()) throw runtime_error("trace benchmark requires a SIMULATION table");
+    const int rounds = argc > 1 ? atoi(argv[1]) : 3;
+    RunConfig run;
+    RunConfigFromDB(db,run);
+    EventConfig eventconfig;
+    EventConfigFromDB(db,eventconfig);
+    const string fname = run.trace_file.empty() ? run.outfile + "_bench_trace.json" : run.trace_file;
+
+    H5::Exception::dontPrint();
+
+    // cost of one span on its own
+    const size_t nspans = 1 << 22;
+    TraceStart(nspans);
+    TraceThread("bench");
+    bench_clock::time_point start = bench_clock::now();
+    for (size_t i = 0; i < nspans; i++) TraceEvent("span",i,i+1);
+    const double span_ns = seconds_since(start)/nspans*1e9;
+    TraceWrite("/dev/null");
+
+    double plain = 0.0, traced = 0.0, elapsed = 0.0, written = 0.0;
+    uint64_t spans = 0;
+    for (int i = 0; i < rounds; i++) {
+        cout << "== Round " << i << " untraced ==" << endl;
+        plain = max(plain,sim_pipeline(db, run, eventconfig, run.outfile + "_bench.h5", false));
+        cout << "== Round " << i << " traced ==" << endl;
+        TraceStart(run.trace_events);
+        start = bench_clock::now();
+        traced = max(traced,sim_pipeline(db, run, eventconfig, run.outfile + "_bench.h5", false));
+        elapsed = seconds_since(start);
+        spans = trace_ring->recorded();
+        start = bench_clock::now();
+        TraceWrite(fname);
+        written = seconds_since(start);
+    }
+    cout << "Trace of the last round: " << spans << " spans in " << elapsed << " s, written to " << fname << " in " << written << " s" << endl;
+    cout << "Span cost: " << span_ns << " ns, " << setprecision(3) << 100.0*spans*span_ns/1e9/elapsed << "% of the run" << endl;
+    cout << "Best throughput: " << traced << " events/s traced vs " << plain << " events/s untraced ("
+         << 100.0*(plain-traced)/plain << "% slower, compare with the spread of the rounds)" << endl;
+}
+
+int main(int argc, char **argv) {
+
+    if (argc < 2) {
+        cout << "./bench decode [samples] [settings.json]" << endl;
+        cout << "./bench pipeline settings.json" << endl;
+        cout << "./bench list settings.json" << endl;
+        cout << "./bench trace settings.json [rounds]" << endl;
+        cout << "./bench psd [samples]" << endl;
+        cout << "./bench codec [samples] [file.h5 /chN/samples]" << endl;
+        cout << "./bench arena [samples] [cycles]" << endl;
+        return -1;
+    }
+
+    string mode = argv[1];
+    if (mode == "decode") {
+        bench_decode(argc-2,argv+2);
+    } else if (mode == "pipeline") {
+        bench_pipeline(argc-2,argv+2);
+    } else if (mode == "list") {
+        bench_list(argc-2,argv+2);
+    } else if (mode == "trace") {
+        bench_trace(argc-2,argv+2);
+    } else if (mode == "codec") {
+        if (!bench_codec(argc-2,argv+2)) return 1;
+    } else if (mode == "psd") {
+        if (!bench_psd(argc-2,argv+2)) return 1;
+    } else if (mode == "arena") {
+        bench_arena(argc-2,argv+2);
+    } else {
+        cout << "Unknown benchmark " << mode << endl;
+        return -1;
+    }
+
+}
@@ -1,3 +1,12 @@
-g++ -g -std=c++11 -DLINUX acquire.cc digitizer.cc json.cc -l hdf5_cpp -l hdf5 -l CAENDigitizer -l CAENVME -o acquire
+g++ -g -O2 -std=c++11 -pthread -DLINUX acquire.cc digitizer.cc backend.cc simulator.cc rawfile.cc pipeline.cc eventbuilder.cc output.cc metrics.cc trace.cc arena.cc tracecodec.cc psd.cc histogram.cc dpppsd.cc json.cc -l hdf5_cpp -l hdf5 -l z -l CAENDigitizer -l CAENVME -o acquire
 
-g++ -g -std=c++11 -DLINUX trigrate.cc digitizer.cc json.cc -l ncurses -l CAENDigitizer -l CAENVME -o trigrate
+g++ -g -std=c++11 -pthread -DLINUX trigrate.cc digitizer.cc backend.cc simulator.cc dpppsd.cc metrics.cc trace.cc json.cc -l ncurses -l CAENDigitizer -l CAENVME -o trigrate
+
+g++ -g -O2 -std=c++11 -pthread -DLINUX bench.cc digitizer.cc backend.cc simulator.cc pipeline.cc eventbuilder.cc output.cc metrics.cc trace.cc arena.cc tracecodec.cc psd.cc histogram.cc dpppsd.cc json.cc -l hdf5_cpp -l hdf5 -l z -l CAENDigitizer -l CAENVME -o bench
+
+g++ -g -O2 -std=c++11 -pthread -DLINUX replay.cc digitizer.cc backend.cc simulator.cc rawfile.cc pipeline.cc eventbuilder.cc output.cc metrics.cc trace.cc arena.cc tracecodec.cc psd.cc histogram.cc dpppsd.cc json.cc -l hdf5_cpp -l hdf5 -l z -l CAENDigitizer -l CAENVME -o acquire-replay
+
+g++ -g -std=c++11 -DLINUX test_decode.cc dpppsd.cc -o test_decode
+./test_decode
+
+g++ -O2 -std=c++11 -shared -fPIC -DLINUX tracefilter.cc tracecodec.cc -l hdf5 -o libh5trace.so
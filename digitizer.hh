@@ -94,6 +94,15 @@ typedef struct {
     CAEN_DGTZ_DPP_TriggerMode_t dpp;
 } TriggerConfig;
 
+typedef struct {
+    bool enabled; // fill histograms from the decoded charges
+    uint32_t energy_bins; // 1D qlong histogram
+    double energy_max;
+    uint32_t psd_energy_bins, psd_bins; // 2D qlong x qshort/qlong histogram
+    double psd_max;
+    int prescale; // store 1 in prescale events as usual, or none if 0
+} HistogramConfig;
+
 typedef struct {
     bool enabled;
     uint32_t samples, presamples;
@@ -108,8 +117,25 @@ typedef struct {
     uint32_t eventsperagg;
     CAEN_DGTZ_TriggerMode_t trigmode;
     CAEN_DGTZ_PulsePolarity_t pulsepol;
+    
+    bool software_psd; // recompute charges from the waveforms (psd.hh) into psd_* datasets
+    
+    int zs_threshold; // store only samples near an excursion this far past the baseline (0 stores whole traces)
+    uint32_t zs_pad; // samples kept either side of the excursions
+    
+    int waveform_prescale; // keep the waveform of 1 in this many stored events (0 for none)
+    int waveform_energy_cut; // and of every event with qlong at least this (0 for no cut)
+    
+    HistogramConfig hist;
+    
+    int events; // events to take from this channel before it is switched off (0 for RUN events)
 } ChannelConfig;
 
+// True if a channel keeps the waveforms of only some of the events it stores
+inline bool SparseWaveforms(const ChannelConfig &config) {
+    return config.waveform_prescale != 1 || config.waveform_energy_cut > 0;
+}
+
 typedef struct {
     CAEN_DGTZ_BoardInfo_t info;    
     
@@ -129,8 +155,68 @@ typedef struct {
     CAEN_DGTZ_DPP_SaveParam_t dppacqparam;
     
     uint32_t aggperblt;
+    
+    uint32_t extras; // extras word option for every channel (PSD_EXTRAS_* in dpppsd.hh)
 } Settings;
 
+typedef struct {
+    bool valid; // requested and applied describe the board
+    Settings requested; // as passed to the last ApplySettings
+    Settings applied; // as the board took them
+    double seconds_per_call; // average round trip of the calls made so far
+} AppliedSettings;
+
+typedef struct {
+    size_t issued, skipped; // library calls made and left out as unchanged
+    double seconds; // spent applying
+    double saved; // estimated time the skipped calls would have taken
+} ApplyStats;
+
+typedef struct {
+    int events; // events to grab per channel
+    std::string outfile;
+    int repeat_times;
+    bool continuous; // ignore events (not CH quotas) and run until a signal or duration_s
+    double duration_s; // seconds each cycle runs at most (0 for no limit)
+    double rotate_mb, rotate_s; // start a new file once the current one is this large or old (0 for never)
+    uint64_t total_events; // end a cycle once the boards have sent this many events in all (0 for no limit)
+    double livetime_s; // or once any board's clock reaches this many seconds (0 for no limit)
+    int transfer_wait; // ms to sleep after each readout (fixed pacing) or the longest wait (adaptive)
+    std::string pacing; // fixed or adaptive (pacing.hh)
+    double pacing_target; // fraction of the readout buffer adaptive pacing aims to fill with each transfer
+    
+    int readout_buffers; // raw transfers in flight between readout and decode
+    int decode_threads;
+    
+    int chunk_events; // events per HDF5 chunk and write
+    int write_buffers; // chunks in flight per channel
+    double flush_interval; // seconds between HDF5 flushes
+    std::string compression; // filter for the samples datasets: none, deflate, shuffle_deflate, or trace
+    int compression_level; // for deflate
+    int compress_threads; // compress samples chunks in parallel and write them directly, or in HDF5 on the writer thread if 0
+    std::string hugepages; // backing of the arena holding the write buffers: none, transparent, or explicit
+    bool full_apply; // reprogram every setting at each sequence point, not only the changed ones
+    bool list_table; // store boards in List mode as one compound table per board rather than per-channel datasets
+    int list_chunk_events; // rows per list table chunk and write
+    double status_interval; // seconds between status lines (0 for none)
+    std::string stats_file; // tab separated telemetry rows are appended here if not empty
+    std::string trace_file; // Chrome trace of the pipeline threads written here at exit if not empty
+    int trace_events; // spans the trace ring holds (older ones are overwritten)
+    
+    bool raw; // dump undecoded transfers to .raw files instead of HDF5
+    int raw_chunk_mb; // size of each raw write
+    int raw_buffers; // raw writes in flight per board
+    int raw_prealloc_mb; // file space reserved ahead of the data
+} RunConfig;
+
+typedef struct {
+    bool enabled; // build /events (EVENTS table present)
+    double window; // ns after the first hit of an event that later hits join it
+    double max_lag; // ms a channel may go without hits before the builder stops waiting on it
+    bool coincidence_only; // only store events with hits on more than one channel
+    int ring_events; // hits buffered per channel between decode and the builder
+} EventConfig;
+
 inline std::string CAENERR(int code) {
     switch (code) {
         case -1: return "Communication error";
@@ -180,13 +266,42 @@ inline std::string CAENERR(int code) {
     if (err) throw std::runtime_error("CAEN Error (" + CAENERR(err) + ") at " __FILE__ ":" S__LINE__ " " #call);  \
 }
 
+class Backend;
+
 std::map<std::string,json::Value> ReadDB(std::string file);
 
-void InitSettings(int handle, Settings &settings);
+// Board numbers described by the DB: 0..N-1 for DIGITIZER[n] / CH[n.m] tables, or
+// just -1 for a single board described by DIGITIZER[] / CH[m]
+std::vector<int> BoardsFromDB(std::map<std::string,json::Value> &db);
+
+// DB key of a per-board table, e.g. DIGITIZER[] for board -1 or DIGITIZER[2] for board 2
+std::string BoardTable(const std::string &name, int board);
+
+// DB key of a channel table, e.g. CH[3] for board -1 or CH[2.3] for board 2
+std::string ChannelTable(int board, int chan);
+
+void InitSettings(Backend &dgtz, Settings &settings);
+
+void PrintInfo(Settings &settings);
+
+void SettingsFromDB(std::map<std::string,json::Value> &db, Settings &settings, int board = -1);
+
+// Reads the RUN table, using the defaults for anything it leaves out (everything if there is none)
+void RunConfigFromDB(std::map<std::string,json::Value> &db, RunConfig &config);
+
+void EventConfigFromDB(std::map<std::string,json::Value> &db, EventConfig &config);
+
+// The SEQUENCE[0], SEQUENCE[1], ... tables of a scan in order (empty if the settings are not a scan)
+std::vector<json::Value> SequenceFromDB(std::map<std::string,json::Value> &db);
 
-void SettingsFromDB(std::map<std::string,json::Value> &db, Settings &settings);
+// The DB of one sequence point: db with the members of every table the point names replaced
+// by the point's. Tables it does not name are shared with db.
+std::map<std::string,json::Value> OverrideDB(std::map<std::string,json::Value> &db, json::Value &point);
 
-void ApplySettings(int handle, Settings &settings);
+// Programs a board, updating settings to the values actually applied. With a valid
+// cache only the calls whose inputs differ from the cached request are made; the
+// cache is then updated (clear valid, e.g. after a reset, to apply everything).
+ApplyStats ApplySettings(int handle, Settings &settings, AppliedSettings *cache = NULL);
 
 #endif
 
@@ -0,0 +1,80 @@
+/**
+ *  Copyright 2014 by Benjamin Land (a.k.a. BenLand100)
+ *
+ *  acquire is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  acquire is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with acquire. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "dpppsd.hh"
+
+using namespace std;
+
+void BadAggregate(const string &what, size_t word) {
+    throw runtime_error("DPP-PSD decode error (" + what + ") at word " + to_string(word));
+}
+
+AggregateEncoder::AggregateEncoder(char *buffer, size_t capacity) : words((uint32_t*)buffer), capacity(capacity/4), pos(0), board_start(0), pair_start(0), pair_format(0) {
+}
+
+void AggregateEncoder::put(uint32_t word) {
+    if (pos >= capacity) throw runtime_error("AggregateEncoder buffer overflow");
+    words[pos++] = word;
+}
+
+void AggregateEncoder::beginBoard(uint32_t boardid, uint32_t counter, uint32_t timetag) {
+    board_start = pos;
+    put(0xA0000000);
+    put((boardid & 0x1F) << 27);
+    put(counter & 0x7FFFFF);
+    put(timetag);
+}
+
+void AggregateEncoder::beginPair(uint32_t pair, uint32_t format) {
+    words[board_start+1] |= 1 << pair;
+    pair_start = pos;
+    pair_format = format;
+    put(0x80000000);
+    put(format);
+}
+
+void AggregateEncoder::addEvent(uint32_t ch, uint32_t timetag, uint32_t extras, uint16_t qshort, uint16_t qlong, bool pur, const uint16_t *samples) {
+    put(((ch & 1) << 31) | (timetag & 0x7FFFFFFF));
+    if (PSDHasSamples(pair_format)) {
+        const uint32_t nsamples = PSDSamples(pair_format);
+        for (uint32_t i = 0; i < nsamples; i += 2) {
+            put((samples[i] & 0x3FFF) | ((uint32_t)(samples[i+1] & 0x3FFF) << 16));
+        }
+    }
+    if (PSDHasExtras(pair_format)) put(extras);
+    if (PSDHasCharge(pair_format)) put((qshort & 0x7FFF) | (pur ? 0x8000 : 0) | ((uint32_t)qlong << 16));
+}
+
+void AggregateEncoder::endPair() {
+    words[pair_start] |= (pos - pair_start) & 0x3FFFFF;
+}
+
+void AggregateEncoder::endBoard() {
+    words[board_start] |= (pos - board_start) & 0x0FFFFFFF;
+}
+
+size_t AggregateEncoder::eventWords(uint32_t format) {
+    return 1 + (PSDHasSamples(format) ? PSDSamples(format)/2 : 0) + (PSDHasExtras(format) ? 1 : 0) + (PSDHasCharge(format) ? 1 : 0);
+}
+
+uint32_t AggregateEncoder::format(uint32_t nsamples, bool extras, uint32_t extras_option, bool charge) {
+    uint32_t format = 0x20000000; // time tag always present
+    if (charge) format |= 0x40000000;
+    if (extras) format |= 0x10000000 | ((extras_option & 0x7) << 24);
+    if (nsamples) format |= 0x08000000 | ((nsamples >> 3) & 0xFFFF);
+    return format;
+}
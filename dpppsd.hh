@@ -0,0 +1,353 @@
+/**
+ *  Copyright 2014 by Benjamin Land (a.k.a. BenLand100)
+ *
+ *  acquire is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  acquire is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with acquire. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __DPPPSD__HH
+#define __DPPPSD__HH
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <stdexcept>
+
+/* DPP-PSD (x730) readout format, all 32-bit little endian words
+ *
+ * Board aggregate header (4 words), followed by one channel aggregate per bit in the pair mask
+ *   0: [31:28] 0xA  [27:0] board aggregate size (words, including header)
+ *   1: [31:27] board id  [26] board fail  [23:8] LVDS pattern  [7:0] channel pair mask
+ *   2: [22:0] board aggregate counter
+ *   3: [31:0] board time tag
+ *
+ * Channel aggregate header (2 words), followed by events
+ *   0: [31] 1  [21:0] channel aggregate size (words, including header)
+ *   1: [31] dual trace  [30] charge  [29] time tag  [28] extras  [27] samples  [26:24] extras option
+ *      [23:22] analog probe  [21:19] digital probe 2  [18:16] digital probe 1  [15:0] samples/8
+ *
+ * Event
+ *   0: [31] odd channel of pair  [30:0] trigger time tag
+ *   samples/2 words if samples enabled: [29:16] sample 2i+1  [13:0] sample 2i (digital probes in bits 14,15,30,31)
+ *   1 word if extras enabled (meaning depends on extras option, see PSD_EXTRAS_*)
+ *   1 word if charge enabled: [31:16] charge long  [15] pile-up  [14:0] charge short
+ */
+
+// Extras word options ([26:24] of the channel aggregate format)
+enum {
+    PSD_EXTRAS_BASELINE = 0, // [31:16] extended time stamp [15:0] baseline*4
+    PSD_EXTRAS_FLAGS = 1, // [31:16] extended time stamp [15:0] flags
+    PSD_EXTRAS_FINETIME = 2, // [31:16] extended time stamp [15:10] flags [9:0] fine time stamp
+    PSD_EXTRAS_COUNTERS = 4, // [31:16] lost trigger counter [15:0] total trigger counter
+    PSD_EXTRAS_ZEROCROSS = 5 // [31:16] sample before zero crossing [15:0] sample after zero crossing
+};
+
+// One event as it sits in a readout buffer. The waveform is left packed so the
+// consumer can unpack it directly into its final destination (or not at all).
+typedef struct {
+    uint32_t ch; // digitizer channel
+    uint32_t format; // channel aggregate format word
+    uint32_t timetag; // 31 bit trigger time tag
+    uint64_t timestamp; // time tag extended to 47 bits when the extras word carries the extended time stamp
+    uint32_t extras; // raw extras word (0 if disabled)
+    uint16_t finetime; // fraction of a tick in 1024ths when the extras word carries it, otherwise 0
+    uint16_t qshort, qlong;
+    uint16_t baseline; // from the extras word when it carries one, otherwise 0
+    bool pur; // pile-up rejection flag
+    uint32_t nsamples; // samples per trace
+    const uint32_t *waveform; // packed samples, NULL if samples are disabled
+} PSDEvent;
+
+inline bool PSDDualTrace(uint32_t format) { return format & 0x80000000; }
+inline bool PSDHasCharge(uint32_t format) { return format & 0x40000000; }
+inline bool PSDHasExtras(uint32_t format) { return format & 0x10000000; }
+inline bool PSDHasSamples(uint32_t format) { return format & 0x08000000; }
+inline uint32_t PSDExtrasOption(uint32_t format) { return (format >> 24) & 0x7; }
+inline uint32_t PSDSamples(uint32_t format) { return (format & 0xFFFF) << 3; }
+
+// Extras options 0-2 put the upper 16 bits of a 47 bit time stamp in the extras word
+inline bool PSDHasExtendedTime(uint32_t format) { return PSDHasExtras(format) && PSDExtrasOption(format) <= PSD_EXTRAS_FINETIME; }
+inline bool PSDHasFineTime(uint32_t format) { return PSDHasExtras(format) && PSDExtrasOption(format) == PSD_EXTRAS_FINETIME; }
+inline bool PSDHasCounters(uint32_t format) { return PSDHasExtras(format) && PSDExtrasOption(format) == PSD_EXTRAS_COUNTERS; }
+
+// Significant bits of PSDEvent::timestamp for a format
+inline uint32_t PSDTimeBits(uint32_t format) { return PSDHasExtendedTime(format) ? 47 : 31; }
+
+//Extends the wrapping time stamps of one channel to 64 bits by counting
+//rollovers. Only the order of that channel's own events matters, so batching
+//and the interleaving of channels within a buffer do not affect it. A gap of
+//more than half a wrap period between consecutive events of a channel is
+//ambiguous, which at 2 ns ticks is about 2 s without the extended time stamp
+//and days with it.
+class TimeExtender {
+
+    public:
+
+        inline TimeExtender() : last(0), offset(0), rollovers(0) { }
+
+        // Maps a time stamp with the given significant bits onto a 64 bit time line
+        inline uint64_t extend(uint64_t stamp, uint32_t bits) {
+            const uint64_t period = (uint64_t)1 << bits;
+            if (stamp < last && last - stamp > period/2) {
+                offset += period;
+                rollovers++;
+            }
+            last = stamp;
+            return offset + stamp;
+        }
+
+        // Wraps seen so far
+        inline uint64_t count() const { return rollovers; }
+
+    protected:
+
+        uint64_t last, offset, rollovers;
+};
+
+// Dead time and lost events of one channel over a stretch of its events
+typedef struct {
+    uint64_t events; // seen in the stretch
+    uint64_t first, last; // extended time stamps where the stretch begins (the event before it, or 0) and its last event
+    uint64_t gaps; // intervals too long to be chance at the channel's rate
+    double gap_ticks; // what those intervals took beyond the mean interval
+    double gap_lost; // events the channel's rate would have had in that time
+    bool counted; // the board sent trigger counters (PSD_EXTRAS_COUNTERS)
+    uint64_t triggers, lost; // their increments over the stretch
+} DeadTime;
+
+// Intervals longer than this many mean intervals count as dead time (by chance 1 in e^20 would)
+static const double dead_gap_factor = 20.0;
+
+//Estimates the dead time of one channel from its extended time stamps. An
+//interval much longer than the smoothed mean is taken as time the channel
+//could not trigger (its board buffer was full while the host was away), and
+//the events its rate would have had then as lost. When the board sends
+//trigger counters they are followed too, since they count the lost triggers
+//outright; the 16 bit counters must not wrap between two events of a channel.
+class DeadTimer {
+
+    public:
+
+        inline DeadTimer() : mean(0.0), seen(0), prev(0), total(0), lost(0) { reset(); }
+
+        // Starts a new stretch after the last event seen, keeping the rate and counters
+        inline void reset() {
+            stats.events = stats.gaps = stats.triggers = stats.lost = 0;
+            stats.first = stats.last = prev;
+            stats.gap_ticks = stats.gap_lost = 0.0;
+            stats.counted = false;
+        }
+
+        // Follows an event with extended time stamp stamp
+        inline void event(uint64_t stamp, const PSDEvent &ev) {
+            if (seen++) {
+                const double interval = stamp > prev ? stamp - prev : 0.0;
+                if (seen > 64 && mean > 0.0 && interval > dead_gap_factor*mean) {
+                    stats.gaps++;
+                    stats.gap_ticks += interval - mean;
+                    stats.gap_lost += (interval - mean)/mean;
+                } else {
+                    mean += (interval - mean)/(seen-1 < 1024 ? seen-1 : 1024); // running mean, then smoothed
+                }
+            }
+            prev = stats.last = stamp;
+            stats.events++;
+            if (PSDHasCounters(ev.format)) {
+                stats.counted = true;
+                stats.triggers += (uint16_t)(ev.extras - total);
+                stats.lost += (uint16_t)((ev.extras >> 16) - lost);
+                total = ev.extras;
+                lost = ev.extras >> 16;
+            }
+        }
+
+        // The stretch so far
+        inline const DeadTime& stretch() const { return stats; }
+
+        // Events lost in the stretch: counted by the board if it sends counters, otherwise estimated
+        inline uint64_t lostEvents() const { return stats.counted ? stats.lost : (uint64_t)stats.gap_lost; }
+
+    protected:
+
+        DeadTime stats;
+        double mean; // interval between events in ticks
+        uint64_t seen, prev; // events since the start of the cycle, and the last one's time stamp
+        uint16_t total, lost; // last trigger counters
+};
+
+// Unpacks the first analog trace of an event into dest (ev.nsamples values)
+inline void UnpackSamples(const PSDEvent &ev, uint16_t *dest) {
+    const uint32_t *words = ev.waveform;
+    const uint32_t nwords = ev.nsamples/2;
+    if (PSDDualTrace(ev.format)) {
+        // traces are interleaved; repeat trace 1 to keep the time axis
+        for (uint32_t i = 0; i < nwords; i++) {
+            dest[2*i] = dest[2*i+1] = words[i] & 0x3FFF;
+        }
+    } else {
+        for (uint32_t i = 0; i < nwords; i++) {
+            const uint32_t w = words[i];
+            dest[2*i] = w & 0x3FFF;
+            dest[2*i+1] = (w >> 16) & 0x3FFF;
+        }
+    }
+}
+
+// Throws a runtime_error describing malformed readout data
+void BadAggregate(const std::string &what, size_t word);
+
+// Walks every board and channel aggregate in a readout buffer, calling sink(const PSDEvent&)
+// for each event on a channel set in chmask. Channel pairs not in chmask are skipped
+// using the aggregate sizes without touching their events. Returns the number of events
+// passed to sink.
+template <typename Sink> size_t DecodeAggregates(const char *data, uint32_t size, uint32_t chmask, Sink &sink) {
+    const uint32_t *words = (const uint32_t*)data;
+    const size_t nwords = size/4;
+    size_t nevents = 0;
+    PSDEvent ev;
+
+    size_t pos = 0;
+    while (pos < nwords) {
+        const uint32_t header = words[pos];
+        if ((header >> 28) != 0xA) BadAggregate("bad board aggregate header",pos);
+        const size_t board_end = pos + (header & 0x0FFFFFFF);
+        if (board_end > nwords || board_end < pos + 4) BadAggregate("bad board aggregate size",pos);
+        const uint32_t pairmask = words[pos+1] & 0xFF;
+
+        pos += 4;
+        for (uint32_t pair = 0; pair < 8; pair++) {
+            if (!(pairmask & (1 << pair))) continue;
+            if (pos + 2 > board_end) BadAggregate("truncated channel aggregate",pos);
+            const size_t chan_end = pos + (words[pos] & 0x3FFFFF);
+            if (chan_end > board_end || chan_end < pos + 2) BadAggregate("bad channel aggregate size",pos);
+
+            if (!(chmask & (3 << (2*pair)))) {
+                pos = chan_end;
+                continue;
+            }
+
+            const uint32_t format = words[pos+1];
+            const bool samples = PSDHasSamples(format);
+            const bool extras = PSDHasExtras(format);
+            const bool charge = PSDHasCharge(format);
+            const bool extras_baseline = extras && PSDExtrasOption(format) == PSD_EXTRAS_BASELINE;
+            const bool extended = PSDHasExtendedTime(format);
+            const bool finetime = PSDHasFineTime(format);
+            const uint32_t nsamples = samples ? PSDSamples(format) : 0;
+            const size_t evsize = 1 + nsamples/2 + (extras ? 1 : 0) + (charge ? 1 : 0);
+
+            ev.format = format;
+            ev.nsamples = nsamples;
+
+            pos += 2;
+            for (; pos + evsize <= chan_end; pos += evsize) {
+                const uint32_t tag = words[pos];
+                ev.ch = 2*pair + (tag >> 31);
+                if (!(chmask & (1 << ev.ch))) continue;
+                ev.timetag = tag & 0x7FFFFFFF;
+                ev.waveform = samples ? words + pos + 1 : NULL;
+                size_t w = pos + 1 + nsamples/2;
+                ev.extras = extras ? words[w++] : 0;
+                ev.baseline = extras_baseline ? (ev.extras & 0xFFFF) >> 2 : 0;
+                ev.timestamp = extended ? ((uint64_t)(ev.extras >> 16) << 31) | ev.timetag : ev.timetag;
+                ev.finetime = finetime ? ev.extras & 0x3FF : 0;
+                if (charge) {
+                    const uint32_t q = words[w];
+                    ev.qshort = q & 0x7FFF;
+                    ev.pur = q & 0x8000;
+                    ev.qlong = q >> 16;
+                } else {
+                    ev.qshort = ev.qlong = 0;
+                    ev.pur = false;
+                }
+                sink(ev);
+                nevents++;
+            }
+            if (pos != chan_end) BadAggregate("channel aggregate not a whole number of events",pos);
+        }
+        if (pos != board_end) BadAggregate("board aggregate size mismatch",pos);
+    }
+
+    return nevents;
+}
+
+// Counts the events in a readout buffer from the aggregate headers alone, without
+// touching the events themselves
+inline size_t CountAggregateEvents(const char *data, uint32_t size) {
+    const uint32_t *words = (const uint32_t*)data;
+    const size_t nwords = size/4;
+    size_t nevents = 0;
+
+    size_t pos = 0;
+    while (pos < nwords) {
+        const uint32_t header = words[pos];
+        if ((header >> 28) != 0xA) BadAggregate("bad board aggregate header",pos);
+        const size_t board_end = pos + (header & 0x0FFFFFFF);
+        if (board_end > nwords || board_end < pos + 4) BadAggregate("bad board aggregate size",pos);
+        for (pos += 4; pos < board_end; ) {
+            if (pos + 2 > board_end) BadAggregate("truncated channel aggregate",pos);
+            const size_t chan_size = words[pos] & 0x3FFFFF;
+            if (pos + chan_size > board_end || chan_size < 2) BadAggregate("bad channel aggregate size",pos);
+            const uint32_t format = words[pos+1];
+            const size_t evsize = 1 + (PSDHasSamples(format) ? PSDSamples(format)/2 : 0) + (PSDHasExtras(format) ? 1 : 0) + (PSDHasCharge(format) ? 1 : 0);
+            nevents += (chan_size-2)/evsize;
+            pos += chan_size;
+        }
+    }
+
+    return nevents;
+}
+
+//Builds DPP-PSD readout buffers in the format above, for simulation and benchmarks.
+class AggregateEncoder {
+
+    public:
+
+        // Writes into a caller-owned buffer of capacity bytes
+        AggregateEncoder(char *buffer, size_t capacity);
+
+        // Starts a new board aggregate
+        void beginBoard(uint32_t boardid, uint32_t counter, uint32_t timetag);
+
+        // Starts a channel aggregate for channels 2*pair and 2*pair+1 with the given format word
+        void beginPair(uint32_t pair, uint32_t format);
+
+        // Appends an event to the open channel aggregate (samples ignored if the format has none)
+        void addEvent(uint32_t ch, uint32_t timetag, uint32_t extras, uint16_t qshort, uint16_t qlong, bool pur, const uint16_t *samples);
+
+        // Closes the open channel aggregate
+        void endPair();
+
+        // Closes the open board aggregate
+        void endBoard();
+
+        // Bytes written so far
+        inline size_t size() const { return pos*4; }
+
+        // Words needed for an event with the given format
+        static size_t eventWords(uint32_t format);
+
+        // Builds a channel aggregate format word
+        static uint32_t format(uint32_t nsamples, bool extras, uint32_t extras_option, bool charge);
+
+    protected:
+
+        void put(uint32_t word);
+
+        uint32_t *words;
+        size_t capacity, pos;
+        size_t board_start, pair_start;
+        uint32_t pair_format;
+};
+
+#endif
@@ -0,0 +1,198 @@
+/**
+ *  Copyright 2014 by Benjamin Land (a.k.a. BenLand100)
+ *
+ *  acquire is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  acquire is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with acquire. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "eventbuilder.hh"
+
+#include <queue>
+#include <algorithm>
+#include <functional>
+
+using namespace std;
+
+EventBuilder::EventBuilder(Output &output, const EventConfig &config) :
+    output(output), coincidence_only(config.coincidence_only) {
+
+    if (!output.size()) throw runtime_error("Event builder needs at least one channel");
+    const double ns_tick = output.tick(0);
+    for (size_t i = 1; i < output.size(); i++) {
+        if (output.tick(i) != ns_tick) throw runtime_error("Event builder needs every board to use the same time stamp period");
+    }
+    if (ns_tick <= 0.0) throw runtime_error("Event builder needs a known time stamp period");
+    window = (uint64_t)(config.window/ns_tick);
+    max_lag = (uint64_t)(config.max_lag*1e6/ns_tick);
+
+    finished = new atomic<bool>[output.size()];
+    for (size_t i = 0; i < output.size(); i++) {
+        rings.push_back(new BoundedQueue<Hit>(pow2ceil(config.ring_events)));
+        finished[i] = false;
+    }
+
+    events = hits = stored = forced = late = truncated = 0;
+    hits_stored = 0;
+    ring_stalls = 0;
+    block = NULL;
+    closing = false;
+    failed = false;
+}
+
+EventBuilder::~EventBuilder() {
+    if (thread.joinable()) {
+        failed = true; // unwinding without close(), so stop without building the rest
+        closing = true;
+        thread.join();
+    }
+    for (size_t i = 0; i < rings.size(); i++) {
+        delete rings[i];
+    }
+    delete [] finished;
+}
+
+void EventBuilder::start() {
+    thread = std::thread(&EventBuilder::build,this);
+}
+
+void EventBuilder::close() {
+    if (!thread.joinable()) return;
+    for (size_t i = 0; i < rings.size(); i++) {
+        finished[i] = true;
+    }
+    closing = true;
+    thread.join();
+    if (failed) throw runtime_error("Event builder failed: " + error);
+}
+
+void EventBuilder::report(ostream &out) const {
+    out << "Event builder: " << events << " events from " << hits << " hits, "
+        << stored << " stored, "
+        << forced << " forced by full rings, "
+        << late << " late hits, "
+        << truncated << " truncated hits, "
+        << ring_stalls << " decode stalls" << endl;
+}
+
+void EventBuilder::build() {
+    try {
+        const size_t nchans = rings.size();
+
+        // k-way merge: at most one head hit per channel, smallest time on top
+        typedef pair<uint64_t,size_t> Head;
+        priority_queue<Head,vector<Head>,greater<Head>> heap;
+        vector<Hit> head(nchans);
+        vector<bool> has(nchans,false);
+        vector<uint64_t> last(nchans,0); // time of the latest hit taken from each ring
+        uint64_t latest = 0; // latest time taken from any ring
+        uint64_t merged = 0; // time of the last hit merged
+
+        current.clear();
+        block = output.getEventBlock();
+
+        while (!failed) {
+            const bool done = closing; // every channel is finished once set, so check before popping
+
+            for (size_t c = 0; c < nchans; c++) {
+                if (!has[c] && rings[c]->pop(head[c])) {
+                    has[c] = true;
+                    heap.push(Head(head[c].time,c));
+                    last[c] = head[c].time;
+                    if (last[c] > latest) latest = last[c];
+                }
+            }
+
+            if (heap.empty()) {
+                if (done) break;
+                usleep(100);
+                continue;
+            }
+
+            // a channel with nothing buffered may still deliver a hit earlier than the smallest head
+            const uint64_t next = heap.top().first;
+            bool ready = true, full = false;
+            for (size_t c = 0; c < nchans; c++) {
+                if (rings[c]->depth() == rings[c]->capacity()) full = true;
+                if (has[c] || finished[c] || last[c] >= next || latest - last[c] > max_lag) continue;
+                ready = false;
+            }
+            if (!ready && !done) {
+                if (!full) {
+                    usleep(10);
+                    continue;
+                }
+                forced++;
+            }
+
+            const size_t c = heap.top().second;
+            heap.pop();
+            has[c] = false;
+            const Hit &hit = head[c];
+            hits++;
+
+            if (hit.time < merged) late++;
+            else merged = hit.time;
+
+            if (!current.empty() && (hit.time < current_time || hit.time - current_time > window)) emit();
+            if (current.empty()) current_time = hit.time;
+            current.push_back(make_pair((uint16_t)c,hit.index));
+        }
+
+        if (!failed) {
+            if (!current.empty()) emit();
+            output.putEventBlock(block);
+            block = NULL;
+        }
+    } catch (runtime_error &e) {
+        error = e.what();
+        failed = true;
+    }
+}
+
+void EventBuilder::emit() {
+    events++;
+    if (coincidence_only) {
+        bool coincident = false;
+        for (size_t j = 1; j < current.size() && !coincident; j++) {
+            coincident = current[j].first != current[0].first;
+        }
+        if (!coincident) {
+            current.clear();
+            return;
+        }
+    }
+
+    const size_t capacity = min<size_t>(output.hitCapacity(),UINT16_MAX);
+    size_t nhits = current.size();
+    if (nhits > capacity) {
+        truncated += nhits - capacity;
+        nhits = capacity;
+    }
+    if (block->nevents == output.chunkEvents() || block->nhits + nhits > output.hitCapacity()) {
+        output.putEventBlock(block);
+        block = output.getEventBlock();
+    }
+
+    const size_t i = block->nevents++;
+    block->times[i] = current_time;
+    block->multiplicity[i] = nhits;
+    block->first[i] = hits_stored;
+    for (size_t j = 0; j < nhits; j++) {
+        block->channels[block->nhits] = current[j].first;
+        block->indices[block->nhits] = current[j].second;
+        block->nhits++;
+    }
+    hits_stored += nhits;
+    stored++;
+    current.clear();
+}
@@ -0,0 +1,110 @@
+/**
+ *  Copyright 2014 by Benjamin Land (a.k.a. BenLand100)
+ *
+ *  acquire is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  acquire is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with acquire. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __EVENTBUILDER__HH
+#define __EVENTBUILDER__HH
+
+#include "output.hh"
+#include "queue.hh"
+
+#include <atomic>
+#include <thread>
+#include <ostream>
+
+#include <unistd.h>
+
+// One stored event as seen by the builder
+typedef struct {
+    uint64_t time; // extended time stamp in ticks
+    uint64_t index; // row in its channel's datasets
+} Hit;
+
+//Builds time-ordered events across every channel of every board while the run
+//is going. Decode threads push each stored hit into a bounded ring for its
+//channel; the builder thread k-way merges the rings with a heap keyed on time
+//stamp and groups hits within window of an event's first hit into the
+///events table. A channel's next hit is never earlier than its last one, so the
+//builder only waits on a channel with an empty ring while its last hit is older
+//than the next hit to merge, and stops waiting once the channel has been quiet
+//for max_lag. If a ring fills while waiting, the merge goes ahead anyway and the
+//hit is counted as forced.
+class EventBuilder {
+
+    public:
+
+        // All output channels must share one time stamp period
+        EventBuilder(Output &output, const EventConfig &config);
+
+        // Stops the builder thread if close() was not called
+        ~EventBuilder();
+
+        // Starts the builder thread
+        void start();
+
+        // Queues a hit on output channel idx; only the decode thread storing idx may call this
+        inline void push(size_t idx, uint64_t time, uint64_t index) {
+            Hit hit = {time, index};
+            if (!rings[idx]->push(hit)) {
+                ring_stalls++;
+                while (!rings[idx]->push(hit)) {
+                    if (failed) throw std::runtime_error("Event builder failed: " + error);
+                    usleep(10);
+                }
+            }
+        }
+
+        // Tells the builder no more hits will come for output channel idx
+        inline void finish(size_t idx) { finished[idx] = true; }
+
+        // Builds the remaining hits once every channel is finished, then stops the thread. Throws if building failed.
+        void close();
+
+        // Prints the builder counters
+        void report(std::ostream &out) const;
+
+        // builder counters (valid after close)
+        size_t events, hits, stored; // events built, hits merged, events written
+        size_t forced; // hits merged without knowing every channel had caught up
+        size_t late; // hits earlier than a hit already merged
+        size_t truncated; // hits dropped from events too large for a table block
+        std::atomic<size_t> ring_stalls; // decode threads waited on a full ring
+
+    protected:
+
+        void build();
+
+        // Writes (or drops) the event in current
+        void emit();
+
+        Output &output;
+        const bool coincidence_only;
+        uint64_t window, max_lag; // in ticks
+
+        std::vector<BoundedQueue<Hit>*> rings; // per output channel
+        std::atomic<bool> *finished; // per output channel
+
+        std::vector<std::pair<uint16_t,uint64_t>> current; // (channel, index) of the open event's hits
+        uint64_t current_time; // time of its first hit
+        uint64_t hits_stored; // hits in the /events table so far
+        EventTableBlock *block;
+
+        std::thread thread;
+        std::atomic<bool> closing, failed;
+        std::string error;
+};
+
+#endif
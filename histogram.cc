@@ -0,0 +1,36 @@
+/**
+ *  Copyright 2014 by Benjamin Land (a.k.a. BenLand100)
+ *
+ *  acquire is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  acquire is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with acquire. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "histogram.hh"
+
+#include <algorithm>
+
+using namespace std;
+
+Histogram::Histogram(size_t idx, const HistogramConfig &config) :
+    idx(idx), psd_energy_bins(config.psd_energy_bins), psd_bins(config.psd_bins),
+    energy(config.energy_bins), psd((size_t)config.psd_energy_bins*config.psd_bins),
+    energy_scale(config.energy_bins/config.energy_max), psd_energy_scale(config.psd_energy_bins/config.energy_max),
+    psd_scale(config.psd_bins/config.psd_max) {
+    clear();
+}
+
+void Histogram::clear() {
+    events = energy_overflow = psd_overflow = 0;
+    fill_n(energy.begin(),energy.size(),0);
+    fill_n(psd.begin(),psd.size(),0);
+}
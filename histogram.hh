@@ -0,0 +1,60 @@
+/**
+ *  Copyright 2014 by Benjamin Land (a.k.a. BenLand100)
+ *
+ *  acquire is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  acquire is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with acquire. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __HISTOGRAM__HH
+#define __HISTOGRAM__HH
+
+#include "digitizer.hh"
+
+#include <cstdint>
+#include <vector>
+
+//Counts filled by one decode thread for one channel since the last snapshot:
+//a 1D qlong histogram and a 2D histogram of qlong (rows) against qshort/qlong
+//(columns). Only the owning thread fills it, so counts are plain integers and
+//the whole thing is handed to the Output to be merged, like an EventBlock.
+class Histogram {
+
+    public:
+
+        Histogram(size_t idx, const HistogramConfig &config);
+
+        inline void fill(uint16_t qshort, uint16_t qlong) {
+            events++;
+            const uint32_t e = (uint32_t)(qlong*energy_scale);
+            if (e < energy.size()) energy[e]++; else energy_overflow++;
+            const uint32_t x = (uint32_t)(qlong*psd_energy_scale);
+            const uint32_t y = qlong ? (uint32_t)((float)qshort/(float)qlong*psd_scale) : psd_bins;
+            if (x < psd_energy_bins && y < psd_bins) psd[x*psd_bins+y]++; else psd_overflow++;
+        }
+
+        // Zeroes every count
+        void clear();
+
+        const size_t idx; // output channel index
+        const uint32_t psd_energy_bins, psd_bins;
+
+        uint64_t events, energy_overflow, psd_overflow; // events outside each histogram's range are only counted
+        std::vector<uint32_t> energy, psd; // psd is psd_energy_bins rows of psd_bins
+
+    protected:
+
+        const float energy_scale, psd_energy_scale, psd_scale; // bins per unit
+
+};
+
+#endif
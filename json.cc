@@ -495,7 +495,7 @@ namespace json {
         throw parser_error(line,cur-lastbr,"Should never reach here. Probably hardware error.");
     }
 
-    Writer::Writer(std::ostream &stream) : out(stream) {
+    Writer::Writer(std::ostream &stream) : out(stream), keyed(false) {
         
     }
     
@@ -508,6 +508,76 @@ namespace json {
         out << '\n';
     }
     
+    void Writer::separate() {
+        if (keyed) {
+            keyed = false;
+        } else if (!empty.empty()) {
+            if (!empty.back()) out << ',';
+            empty.back() = false;
+        }
+    }
+    
+    void Writer::beginObject() {
+        separate();
+        out << '{';
+        empty.push_back(true);
+    }
+    
+    void Writer::endObject() {
+        empty.pop_back();
+        out << '}';
+        if (empty.empty()) out << '\n';
+    }
+    
+    void Writer::beginArray() {
+        separate();
+        out << '[';
+        empty.push_back(true);
+    }
+    
+    void Writer::endArray() {
+        empty.pop_back();
+        out << ']';
+        if (empty.empty()) out << '\n';
+    }
+    
+    void Writer::key(const std::string &name) {
+        separate();
+        out << '"' << escapeString(name) << "\":";
+        keyed = true;
+    }
+    
+    void Writer::putString(const std::string &string) {
+        separate();
+        out << '"' << escapeString(string) << '"';
+    }
+    
+    void Writer::putInteger(long long integer) {
+        separate();
+        out << integer;
+    }
+    
+    void Writer::putUInteger(unsigned long long uinteger) {
+        separate();
+        out << uinteger;
+    }
+    
+    void Writer::putReal(double real) {
+        separate();
+        out.precision(std::numeric_limits<double>::digits10);
+        out << real;
+    }
+    
+    void Writer::putBool(bool boolean) {
+        separate();
+        out << (boolean ? "true" : "false");
+    }
+    
+    void Writer::putNull() {
+        separate();
+        out << "null";
+    }
+
     //This could make prettier output
     void Writer::writeValue(Value value) {
         switch (value.type) {
@@ -557,6 +627,9 @@ namespace json {
 
     //https://tools.ietf.org/rfc/rfc7159.txt
     std::string Writer::escapeString(std::string unescaped) {
+        size_t check = 0, length = unescaped.length();
+        while (check < length && unescaped[check] >= 0x20 && unescaped[check] != '"' && unescaped[check] != '\\' && unescaped[check] != '/') check++;
+        if (check == length) return unescaped; //nothing to escape
         std::stringstream escaped;
         size_t last = 0, pos = 0, len = unescaped.length();
         while (pos < len) {
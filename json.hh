@@ -341,10 +341,31 @@ namespace json {
             //Writes a value to the stream
             void putValue(Value value);
             
+            //Streams standard JSON without building Values: open and close containers, name each
+            //member of an object with key(), and put the values, which are separated as needed
+            void beginObject();
+            void endObject();
+            void beginArray();
+            void endArray();
+            void key(const std::string &name);
+            void putString(const std::string &string);
+            void putInteger(long long integer);
+            void putUInteger(unsigned long long uinteger);
+            void putReal(double real);
+            void putBool(bool boolean);
+            void putNull();
+            
         protected:
             //The stream to write to
             std::ostream &out;
             
+            //Whether each open streamed container is still empty, and whether a key is waiting for its value
+            std::vector<bool> empty;
+            bool keyed;
+            
+            //Writes the comma before a streamed value or key if it needs one
+            void separate();
+            
             //Converts a literal string to its escaped representation
             std::string escapeString(std::string string);
             
@@ -0,0 +1,121 @@
+/**
+ *  Copyright 2014 by Benjamin Land (a.k.a. BenLand100)
+ *
+ *  acquire is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  acquire is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with acquire. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __LATENCY__HH
+#define __LATENCY__HH
+
+#include <cstdint>
+#include <cstring>
+#include <chrono>
+
+// Nanoseconds on the monotonic clock, for timestamping pipeline stages
+inline uint64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//Fixed-size log-linear histogram of nanosecond durations (HDR style): each
+//power of two is split into 16 linear sub-buckets, so percentiles are good to
+//about 6% from 1 ns to hours with no allocation. Not thread safe; keep one per
+//thread and merge.
+class LatencyHistogram {
+
+    public:
+
+        inline LatencyHistogram() { reset(); }
+
+        inline void reset() {
+            memset(counts,0,sizeof(counts));
+            total = 0;
+            sum = 0;
+            max = 0;
+        }
+
+        inline void record(uint64_t ns) {
+            counts[bucket(ns)]++;
+            total++;
+            sum += ns;
+            if (ns > max) max = ns;
+        }
+
+        inline void merge(const LatencyHistogram &other) {
+            for (int i = 0; i < nbuckets; i++) counts[i] += other.counts[i];
+            total += other.total;
+            sum += other.sum;
+            if (other.max > max) max = other.max;
+        }
+
+        // Leaves what was recorded since earlier, a copy of this histogram taken before. The maximum
+        // becomes the upper edge of the highest bucket still holding counts.
+        inline void subtract(const LatencyHistogram &earlier) {
+            int top = -1;
+            for (int i = 0; i < nbuckets; i++) {
+                counts[i] -= earlier.counts[i];
+                if (counts[i]) top = i;
+            }
+            total -= earlier.total;
+            sum -= earlier.sum;
+            if (top < 0) max = 0;
+            else if (upper(top) < max) max = upper(top);
+        }
+
+        inline uint64_t count() const { return total; }
+
+        inline uint64_t maximum() const { return max; }
+
+        inline double mean() const { return total ? (double)sum/total : 0.0; }
+
+        // Upper edge of the bucket holding the q-th quantile (0 <= q <= 1)
+        inline uint64_t percentile(double q) const {
+            if (!total) return 0;
+            uint64_t target = (uint64_t)(q*total);
+            if (target >= total) target = total-1;
+            uint64_t seen = 0;
+            for (int i = 0; i < nbuckets; i++) {
+                seen += counts[i];
+                if (seen > target) {
+                    const uint64_t edge = upper(i);
+                    return edge < max ? edge : max;
+                }
+            }
+            return max;
+        }
+
+    protected:
+
+        static const int subbits = 4;
+        static const int nsub = 1 << subbits;
+        static const int nbuckets = (64-subbits+1)*nsub;
+
+        static inline int bucket(uint64_t ns) {
+            if (ns < (uint64_t)nsub) return ns;
+            const int msb = 63 - __builtin_clzll(ns);
+            const int shift = msb - subbits;
+            return (shift+1)*nsub + (int)((ns >> shift) & (nsub-1));
+        }
+
+        static inline uint64_t upper(int bucket) {
+            if (bucket < nsub) return bucket;
+            const int shift = bucket/nsub - 1;
+            const uint64_t base = (uint64_t)(nsub + bucket%nsub) << shift;
+            return base + ((uint64_t)1 << shift) - 1;
+        }
+
+        uint64_t counts[nbuckets];
+        uint64_t total, sum, max;
+};
+
+#endif
@@ -0,0 +1,125 @@
+/**
+ *  Copyright 2014 by Benjamin Land (a.k.a. BenLand100)
+ *
+ *  acquire is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  acquire is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with acquire. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "metrics.hh"
+
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+#include <chrono>
+
+using namespace std;
+
+const char *metric_stage_names[METRIC_STAGES] = {"read", "decode", "handoff", "compress", "write"};
+const char *metric_counter_names[METRIC_COUNTERS] = {"transfers", "bytes", "events", "blocks", "written", "saturated_transfers", "board_full_reads", "outside_read_ns", "lost_events"};
+
+ThreadMetrics* Telemetry::thread() {
+    lock_guard<std::mutex> lock(mutex);
+    threads.push_back(unique_ptr<ThreadMetrics>(new ThreadMetrics()));
+    return threads.back().get();
+}
+
+void Telemetry::snapshot(Metrics &total) {
+    total.reset();
+    lock_guard<std::mutex> lock(mutex);
+    for (size_t i = 0; i < threads.size(); i++) threads[i]->read(total);
+}
+
+StatusLine::StatusLine(double interval, const string &fname) : interval(interval > 0.0 ? interval : 1.0), print(interval > 0.0) {
+    if (!fname.empty()) {
+        stats.open(fname);
+        if (!stats) throw runtime_error("Could not open stats file " + fname);
+        stats << "time";
+        for (int i = 0; i < METRIC_COUNTERS; i++) stats << '\t' << metric_counter_names[i];
+        for (int i = 0; i < METRIC_STAGES; i++) {
+            const string name = metric_stage_names[i];
+            stats << '\t' << name << "_count\t" << name << "_p50_us\t" << name << "_p99_us\t" << name << "_max_us";
+        }
+        stats << "\ttransfer_bytes_mean\ttransfer_events_mean" << endl;
+    }
+    telemetry = NULL;
+    start = last_time = now_ns();
+    stopping = false;
+    if (print || stats.is_open()) thread = std::thread(&StatusLine::run,this);
+}
+
+StatusLine::~StatusLine() {
+    {
+        lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+        if (telemetry) update();
+    }
+    wake.notify_all();
+    if (thread.joinable()) thread.join();
+}
+
+void StatusLine::watch(Telemetry *telemetry) {
+    lock_guard<std::mutex> lock(mutex);
+    if (this->telemetry) update(); // the rest of the old one
+    this->telemetry = telemetry;
+    last.reset();
+    last_time = now_ns();
+}
+
+void StatusLine::run() {
+    unique_lock<std::mutex> lock(mutex);
+    while (!stopping) {
+        wake.wait_for(lock, chrono::duration<double>(interval));
+        if (!stopping && telemetry) update();
+    }
+}
+
+// Called with mutex held
+void StatusLine::update() {
+    Metrics now;
+    telemetry->snapshot(now);
+    Metrics window = now;
+    window.subtract(last);
+    last = now;
+    const uint64_t time = now_ns();
+    const double seconds = (time - last_time)*1e-9;
+    last_time = time;
+    if (seconds <= 0.0) return;
+
+    if (print) {
+        ostringstream line;
+        line << fixed << setprecision(1) << "[" << (time-start)*1e-9 << " s] "
+             << window.counters[METRIC_BYTES]/seconds/1e6 << " MB/s read, "
+             << setprecision(0) << window.counters[METRIC_EVENTS]/seconds << " events/s decoded, "
+             << window.counters[METRIC_WRITTEN]/seconds << " events/s written";
+        if (window.counters[METRIC_LOST] || window.counters[METRIC_BOARD_FULL]) {
+            line << ", " << window.counters[METRIC_LOST] << " events lost, " << window.counters[METRIC_BOARD_FULL] << " reads of a full board";
+        }
+        line << " | p99";
+        line << setprecision(3);
+        for (int i = 0; i < METRIC_STAGES; i++) {
+            if (window.stages[i].count()) line << " " << metric_stage_names[i] << " " << window.stages[i].percentile(0.99)/1e6 << " ms";
+        }
+        cout << line.str() << endl;
+    }
+
+    if (stats.is_open()) {
+        stats << (time-start)*1e-9;
+        for (int i = 0; i < METRIC_COUNTERS; i++) stats << '\t' << window.counters[i];
+        for (int i = 0; i < METRIC_STAGES; i++) {
+            const LatencyHistogram &stage = window.stages[i];
+            stats << '\t' << stage.count() << '\t' << stage.percentile(0.5)/1e3 << '\t' << stage.percentile(0.99)/1e3 << '\t' << stage.maximum()/1e3;
+        }
+        stats << '\t' << window.transfer_bytes.mean() << '\t' << window.transfer_events.mean() << endl;
+    }
+}
@@ -0,0 +1,187 @@
+/**
+ *  Copyright 2014 by Benjamin Land (a.k.a. BenLand100)
+ *
+ *  acquire is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  acquire is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with acquire. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __METRICS__HH
+#define __METRICS__HH
+
+#include "latency.hh"
+#include "trace.hh"
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <fstream>
+#include <condition_variable>
+
+// Timed stages of the hot path
+enum MetricStage {
+    METRIC_READ, // one Backend::read
+    METRIC_DECODE, // one decode thread walking one transfer into its blocks
+    METRIC_HANDOFF, // handing a full block to the Output and getting the next (part of decode)
+    METRIC_COMPRESS, // one samples chunk on a compressor thread
+    METRIC_WRITE, // appending one block to the HDF5 file
+    METRIC_STAGES
+};
+
+// Running totals
+enum MetricCounter {
+    METRIC_TRANSFERS, // transfers read
+    METRIC_BYTES, // bytes read
+    METRIC_EVENTS, // events decoded (stored or histogrammed)
+    METRIC_BLOCKS, // blocks appended to the file
+    METRIC_WRITTEN, // events appended to the file
+    METRIC_SATURATED, // transfers that filled the host readout buffer (ReadoutPacer), a readout-side hint only
+    METRIC_BOARD_FULL, // reads that found the board's memory full (Backend::full), so it was dropping triggers
+    METRIC_OUTSIDE, // ns the readout spent outside Backend::read (waiting, or stalled on decoding)
+    METRIC_LOST, // events lost by the board, counted or estimated (DeadTimer)
+    METRIC_COUNTERS
+};
+
+extern const char *metric_stage_names[METRIC_STAGES];
+extern const char *metric_counter_names[METRIC_COUNTERS];
+
+//What one thread (or, merged, a whole run) has measured
+struct Metrics {
+    LatencyHistogram stages[METRIC_STAGES]; // ns per call
+    LatencyHistogram transfer_bytes, transfer_events; // per transfer read and decoded
+    uint64_t counters[METRIC_COUNTERS];
+
+    inline Metrics() { reset(); }
+
+    inline void reset() {
+        for (int i = 0; i < METRIC_STAGES; i++) stages[i].reset();
+        transfer_bytes.reset();
+        transfer_events.reset();
+        for (int i = 0; i < METRIC_COUNTERS; i++) counters[i] = 0;
+    }
+
+    inline void merge(const Metrics &other) {
+        for (int i = 0; i < METRIC_STAGES; i++) stages[i].merge(other.stages[i]);
+        transfer_bytes.merge(other.transfer_bytes);
+        transfer_events.merge(other.transfer_events);
+        for (int i = 0; i < METRIC_COUNTERS; i++) counters[i] += other.counters[i];
+    }
+
+    // Leaves what was measured since earlier
+    inline void subtract(const Metrics &earlier) {
+        for (int i = 0; i < METRIC_STAGES; i++) stages[i].subtract(earlier.stages[i]);
+        transfer_bytes.subtract(earlier.transfer_bytes);
+        transfer_events.subtract(earlier.transfer_events);
+        for (int i = 0; i < METRIC_COUNTERS; i++) counters[i] -= earlier.counters[i];
+    }
+};
+
+//Metrics of one thread. The thread records into local without locking or
+//atomics and calls publish() as it goes, which copies local to where
+//snapshots can read it at most every 100 ms.
+class ThreadMetrics {
+
+    public:
+
+        inline ThreadMetrics() : last(0) { }
+
+        Metrics local; // only touched by the owning thread
+
+        // Records the time since start (from now_ns) for a stage, and its span if tracing
+        inline void time(MetricStage stage, uint64_t start) {
+            const uint64_t end = now_ns();
+            local.stages[stage].record(end-start);
+            TraceEvent(metric_stage_names[stage],start,end);
+        }
+
+        inline void count(MetricCounter counter, uint64_t n = 1) { local.counters[counter] += n; }
+
+        // Makes local visible to snapshots if it has not been recently (or if force)
+        inline void publish(bool force = false) {
+            const uint64_t now = now_ns();
+            if (!force && now < last + 100000000ull) return;
+            std::lock_guard<std::mutex> lock(mutex);
+            shared = local;
+            last = now;
+        }
+
+        // Adds the last published values to total
+        inline void read(Metrics &total) {
+            std::lock_guard<std::mutex> lock(mutex);
+            total.merge(shared);
+        }
+
+    protected:
+
+        uint64_t last; // now_ns() of the last publish
+        std::mutex mutex;
+        Metrics shared;
+};
+
+//The ThreadMetrics of every thread working on one output file
+class Telemetry {
+
+    public:
+
+        // A new ThreadMetrics that lives as long as this Telemetry
+        ThreadMetrics* thread();
+
+        // Merges what every thread has published
+        void snapshot(Metrics &total);
+
+    protected:
+
+        std::mutex mutex;
+        std::vector<std::unique_ptr<ThreadMetrics>> threads;
+};
+
+//Prints a one line summary of a Telemetry every interval seconds and appends
+//the same numbers as a row of a tab separated stats file, from its own thread.
+//Rates and percentiles cover the time since the previous line.
+class StatusLine {
+
+    public:
+
+        // No line if interval is 0 (the file is still written every second), no file if fname is empty
+        StatusLine(double interval, const std::string &fname);
+
+        // Writes a last row and stops the thread
+        ~StatusLine();
+
+        // Follows telemetry from now on (NULL to pause). The previous one is not touched once this returns.
+        void watch(Telemetry *telemetry);
+
+    protected:
+
+        void run();
+
+        // Prints and saves the window since the last call
+        void update();
+
+        const double interval;
+        const bool print;
+        std::ofstream stats;
+
+        std::mutex mutex; // guards telemetry, last, and stopping
+        std::condition_variable wake;
+        Telemetry *telemetry;
+        Metrics last;
+        uint64_t start, last_time;
+        bool stopping;
+
+        std::thread thread;
+};
+
+#endif
@@ -0,0 +1,1024 @@
+/**
+ *  Copyright 2014 by Benjamin Land (a.k.a. BenLand100)
+ *
+ *  acquire is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  acquire is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with acquire. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "output.hh"
+#include "dpppsd.hh"
+#include "tracecodec.hh"
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <cstring>
+
+#include <unistd.h>
+#include <time.h>
+#include <zlib.h>
+
+using namespace H5;
+
+using namespace std;
+
+// Where the arrays of an EventBlock come from (see carve)
+struct HeapAlloc {
+    template <typename T> T* get(size_t n) { return new T[n]; }
+};
+
+struct ArenaAlloc {
+    Arena &arena;
+    template <typename T> T* get(size_t n) { return arena.alloc<T>(n); }
+};
+
+struct SizeAlloc {
+    size_t bytes;
+    template <typename T> T* get(size_t n) { bytes += Arena::footprint(sizeof(T),n); return NULL; }
+};
+
+// Space for a compressed chunk of nvalues samples, or 0 if chunks are not compressed ahead of the writer
+static size_t chunk_bound(const RunConfig &run, size_t nvalues) {
+    if (run.compress_threads <= 0 || run.compression == "none") return 0;
+    return run.compression == "trace" ? TraceEncodedBound(nvalues) : compressBound(nvalues*sizeof(uint16_t));
+}
+
+// Allocates the arrays of a block, the same way for every allocator
+template <typename Alloc>
+static void carve(EventBlock &block, Alloc &alloc, size_t chunk_events, uint32_t nsamples, bool finetime, bool psd, bool zs, bool sparse, size_t chunk_bytes) {
+    block.samples = alloc.template get<uint16_t>(chunk_events*nsamples);
+    block.baselines = alloc.template get<uint16_t>(chunk_events);
+    block.qshorts = alloc.template get<uint16_t>(chunk_events);
+    block.qlongs = alloc.template get<uint16_t>(chunk_events);
+    block.times = alloc.template get<uint64_t>(chunk_events);
+    block.finetimes = finetime ? alloc.template get<uint16_t>(chunk_events) : NULL;
+    block.psd.baselines = psd ? alloc.template get<uint16_t>(chunk_events) : NULL;
+    block.psd.qshorts = psd ? alloc.template get<int32_t>(chunk_events) : NULL;
+    block.psd.qlongs = psd ? alloc.template get<int32_t>(chunk_events) : NULL;
+    block.psd.tails = psd ? alloc.template get<float>(chunk_events) : NULL;
+    block.psd.peaks = psd ? alloc.template get<uint16_t>(chunk_events) : NULL;
+    block.offsets = zs ? alloc.template get<uint64_t>(chunk_events) : NULL;
+    block.roi_starts = zs ? alloc.template get<uint16_t>(chunk_events) : NULL;
+    block.waveform_rows = sparse ? alloc.template get<int64_t>(chunk_events) : NULL;
+    block.chunk = chunk_bytes ? alloc.template get<char>(chunk_bytes) : NULL;
+}
+
+// Boards in List mode store a table instead of per-channel datasets, unless run turns it off
+static bool list_board(const Settings &settings, const RunConfig &run) {
+    return run.list_table && settings.dppacqmode == CAEN_DGTZ_DPP_ACQ_MODE_List;
+}
+
+// A list block per write buffer, plus the one each decode thread is filling
+static size_t list_blocks(const RunConfig &run) {
+    return run.write_buffers + max(run.decode_threads,1);
+}
+
+size_t Output::storageBytes(const vector<Settings> &settings, const RunConfig &run) {
+    SizeAlloc sizer = {0};
+    for (size_t b = 0; b < settings.size(); b++) {
+        if (list_board(settings[b], run)) {
+            for (size_t j = 0; j < list_blocks(run); j++) sizer.get<ListRecord>(run.list_chunk_events);
+            continue;
+        }
+        for (size_t i = 0; i < settings[b].info.Channels; i++) {
+            const ChannelConfig &config = settings[b].chans[i];
+            if (!config.enabled) continue;
+            EventBlock block;
+            for (int j = 0; j < run.write_buffers; j++) {
+                const bool zs = config.zs_threshold > 0;
+                carve(block, sizer, run.chunk_events, config.samples, settings[b].extras == PSD_EXTRAS_FINETIME, config.software_psd, zs, SparseWaveforms(config), zs ? 0 : chunk_bound(run, (size_t)run.chunk_events*config.samples));
+            }
+        }
+    }
+    return sizer.bytes;
+}
+
+// CPU time used by the calling thread
+static double thread_cpu() {
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID,&ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+mutex Output::hdf5;
+
+Output::Output(const string &fname, vector<Settings> &settings, const vector<int> &boards, const RunConfig &run, const EventConfig &eventconfig, Arena *arena) :
+    fname(fname), chunk_events(run.chunk_events), list_events(run.list_chunk_events), flush_interval(run.flush_interval),
+    compression(run.compression), compression_level(run.compression_level), arena(arena), boards(boards) {
+
+    lock_guard<mutex> lock(hdf5); // the writer of a previous Output may still be finishing
+    file = H5File(fname, H5F_ACC_TRUNC);
+
+    const size_t nblocks = run.write_buffers;
+    if (chunk_events < 1 || nblocks < 1) throw runtime_error("chunk_events and write_buffers must be positive");
+    if (run.compress_threads < 0) throw runtime_error("compress_threads cannot be negative");
+    if (settings.size() != boards.size()) throw runtime_error("Output needs one Settings per board");
+    if (compression != "none" && compression != "deflate" && compression != "shuffle_deflate" && compression != "trace") {
+        throw runtime_error("Unknown compression " + compression);
+    }
+    if (compression == "trace") RegisterTraceFilter();
+
+    DataSpace scalar(0,NULL);
+
+    chan2idx.resize(settings.size());
+    lists.resize(settings.size());
+    readouts.assign(settings.size(),BoardReadout{0,0,0});
+    for (size_t b = 0; b < settings.size(); b++) {
+        lists[b].enabled = list_board(settings[b], run);
+        lists[b].nwritten = 0;
+        lists[b].free = NULL;
+        chan2idx[b].assign(settings[b].info.Channels,-1);
+        for (size_t i = 0; i < settings[b].info.Channels; i++) {
+            if (settings[b].chans[i].enabled) {
+                chan2idx[b][i] = chans.size();
+                chans.push_back(OutputChannel());
+                chans.back().board = b;
+                chans.back().chan = i;
+                chans.back().nsamples = settings[b].chans[i].samples;
+            }
+        }
+        if (boards[b] >= 0) {
+            Group group = file.createGroup("/board" + to_string(boards[b]));
+            Attribute serial = group.createAttribute("serial",PredType::NATIVE_UINT32,scalar);
+            serial.write(PredType::NATIVE_UINT32,&settings[b].info.SerialNumber);
+        }
+    }
+
+    CompType rowtype(sizeof(ListRecord));
+    rowtype.insertMember("time", HOFFSET(ListRecord,time), PredType::NATIVE_UINT64);
+    rowtype.insertMember("qshort", HOFFSET(ListRecord,qshort), PredType::NATIVE_UINT16);
+    rowtype.insertMember("qlong", HOFFSET(ListRecord,qlong), PredType::NATIVE_UINT16);
+    rowtype.insertMember("baseline", HOFFSET(ListRecord,baseline), PredType::NATIVE_UINT16);
+    rowtype.insertMember("pur", HOFFSET(ListRecord,pur), PredType::NATIVE_UINT8);
+    rowtype.insertMember("channel", HOFFSET(ListRecord,channel), PredType::NATIVE_UINT8);
+    for (size_t b = 0; b < settings.size(); b++) {
+        OutputList &list = lists[b];
+        if (!list.enabled) continue;
+        if (list_events < 1) throw runtime_error("list_chunk_events must be positive");
+        if (eventconfig.enabled) throw runtime_error("EVENTS needs per-channel datasets, so set list_table false to build events in List mode");
+        for (size_t i = 0; i < settings[b].info.Channels; i++) {
+            if (settings[b].chans[i].enabled && settings[b].chans[i].software_psd) throw runtime_error("software_psd needs waveforms, which List mode does not record");
+        }
+
+        // rows are only ever appended whole, and are small enough that filters would cost more than they save
+        hsize_t dimensions[1] = {0};
+        hsize_t maxdimensions[1] = {H5S_UNLIMITED};
+        hsize_t chunkdimensions[1] = {list_events};
+        DSetCreatPropList props;
+        props.setChunk(1, chunkdimensions);
+        const string name = boards[b] < 0 ? "/list" : "/board" + to_string(boards[b]) + "/list";
+        list.table = file.createDataSet(name, rowtype, DataSpace(1, dimensions, maxdimensions), props);
+
+        double ns_tick = settings[b].info.FamilyCode == 5 ? 1.0 : settings[b].info.FamilyCode == 11 ? 2.0 : 0.0;
+        Attribute tick_attr = list.table.createAttribute("ns_tick",PredType::NATIVE_DOUBLE,scalar);
+        tick_attr.write(PredType::NATIVE_DOUBLE,&ns_tick);
+
+        list.blocks.resize(list_blocks(run));
+        list.free = new BoundedQueue<ListBlock*>(pow2ceil(list.blocks.size()));
+        for (size_t j = 0; j < list.blocks.size(); j++) {
+            ListBlock &block = list.blocks[j];
+            block.board = b;
+            block.nevents = 0;
+            block.records = arena ? arena->alloc<ListRecord>(list_events) : new ListRecord[list_events];
+            list.free->push(&block);
+        }
+    }
+    list_pending = new BoundedQueue<ListBlock*>(pow2ceil(list_blocks(run)*settings.size()));
+
+    for (size_t i = 0; i < chans.size(); i++) {
+        OutputChannel &out = chans[i];
+        Settings &board = settings[out.board];
+        ChannelConfig &config = board.chans[out.chan];
+
+        double ns_sample = 0.0;
+        switch (board.info.FamilyCode) {
+            case 5:
+                ns_sample = 1.0;
+                break;
+            case 11:
+                ns_sample = 2.0;
+                break;
+        }
+        double ns_tick = ns_sample; // DPP-PSD time tags count samples on these boards
+        out.ns_tick = ns_tick;
+        out.finetime = board.extras == PSD_EXTRAS_FINETIME;
+        out.psd = config.software_psd;
+        out.gates = GatesFromConfig(config);
+        out.zs = config.zs_threshold > 0;
+        out.sparse = SparseWaveforms(config);
+        out.wave_prescale = config.waveform_prescale;
+        out.wave_cut = config.waveform_energy_cut;
+        out.quota = config.events;
+        out.dead = DeadTime();
+        out.roi = ROIFromConfig(config);
+        out.hist = config.hist;
+
+        string groupname = group(i);
+        Group group = file.createGroup(groupname);
+
+        Attribute bits = group.createAttribute("bits",PredType::NATIVE_UINT32,scalar);
+        bits.write(PredType::NATIVE_INT32,&board.info.ADC_NBits);
+
+        Attribute ns_sample_attr = group.createAttribute("ns_sample",PredType::NATIVE_DOUBLE,scalar);
+        ns_sample_attr.write(PredType::NATIVE_DOUBLE,&ns_sample);
+
+        Attribute tick_attr = group.createAttribute("ns_tick",PredType::NATIVE_DOUBLE,scalar);
+        tick_attr.write(PredType::NATIVE_DOUBLE,&ns_tick);
+
+        if (out.finetime) {
+            double ns_fine = ns_tick/1024.0;
+            Attribute fine_attr = group.createAttribute("ns_finetime",PredType::NATIVE_DOUBLE,scalar);
+            fine_attr.write(PredType::NATIVE_DOUBLE,&ns_fine);
+        }
+
+        Attribute offset = group.createAttribute("offset",PredType::NATIVE_UINT32,scalar);
+        offset.write(PredType::NATIVE_UINT32,&config.offset);
+
+        Attribute samples = group.createAttribute("samples",PredType::NATIVE_UINT32,scalar);
+        samples.write(PredType::NATIVE_UINT32,&config.samples);
+
+        Attribute presamples = group.createAttribute("presamples",PredType::NATIVE_UINT32,scalar);
+        presamples.write(PredType::NATIVE_UINT32,&config.presamples);
+
+        Attribute threshold = group.createAttribute("threshold",PredType::NATIVE_UINT32,scalar);
+        threshold.write(PredType::NATIVE_UINT32,&config.threshold);
+
+        Attribute chargesens = group.createAttribute("chargesens",PredType::NATIVE_UINT32,scalar);
+        chargesens.write(PredType::NATIVE_UINT32,&config.chargesens);
+
+        Attribute baseline = group.createAttribute("baseline",PredType::NATIVE_UINT32,scalar);
+        baseline.write(PredType::NATIVE_UINT32,&config.baseline);
+
+        Attribute coincidence = group.createAttribute("coincidence",PredType::NATIVE_UINT32,scalar);
+        coincidence.write(PredType::NATIVE_UINT32,&config.coincidence);
+
+        Attribute shortgate = group.createAttribute("shortgate",PredType::NATIVE_UINT32,scalar);
+        shortgate.write(PredType::NATIVE_UINT32,&config.shortgate);
+
+        Attribute longgate = group.createAttribute("longgate",PredType::NATIVE_UINT32,scalar);
+        longgate.write(PredType::NATIVE_UINT32,&config.longgate);
+
+        Attribute pregate = group.createAttribute("pregate",PredType::NATIVE_UINT32,scalar);
+        pregate.write(PredType::NATIVE_UINT32,&config.pregate);
+
+        if (out.psd) {
+            Attribute psd_baseline = group.createAttribute("psd_baseline_samples",PredType::NATIVE_UINT32,scalar);
+            psd_baseline.write(PredType::NATIVE_UINT32,&out.gates.baseline_samples);
+
+            Attribute psd_start = group.createAttribute("psd_gate_start",PredType::NATIVE_UINT32,scalar);
+            psd_start.write(PredType::NATIVE_UINT32,&out.gates.gate_start);
+        }
+
+        if (out.sparse) {
+            Attribute wave_prescale = group.createAttribute("waveform_prescale",PredType::NATIVE_INT32,scalar);
+            wave_prescale.write(PredType::NATIVE_INT32,&out.wave_prescale);
+
+            Attribute wave_cut = group.createAttribute("waveform_energy_cut",PredType::NATIVE_INT32,scalar);
+            wave_cut.write(PredType::NATIVE_INT32,&out.wave_cut);
+        }
+
+        if (out.zs) {
+            Attribute zs_threshold = group.createAttribute("zs_threshold",PredType::NATIVE_INT32,scalar);
+            zs_threshold.write(PredType::NATIVE_INT32,&out.roi.threshold);
+
+            Attribute zs_pad = group.createAttribute("zs_pad",PredType::NATIVE_UINT32,scalar);
+            zs_pad.write(PredType::NATIVE_UINT32,&out.roi.pad);
+        }
+
+        out.nwritten = 0;
+        out.samples_written = out.waves_written = 0;
+        out.queued = out.next = 0;
+        out.raw_bytes = out.chunk_bytes = 0;
+        out.compress_cpu = 0.0;
+        out.stored_bytes = 0;
+        out.free = NULL;
+
+        out.hist_events = out.energy_overflow = out.psd_overflow = 0;
+        out.hist_free = NULL;
+        if (out.hist.enabled) {
+            // fixed size, rewritten with the running totals at every snapshot
+            hsize_t energydims[1] = {out.hist.energy_bins};
+            hsize_t psddims[2] = {out.hist.psd_energy_bins, out.hist.psd_bins};
+            out.energy_hist = file.createDataSet(groupname+"/energy_hist", PredType::NATIVE_UINT64, DataSpace(1, energydims));
+            out.psd_hist = file.createDataSet(groupname+"/psd_hist", PredType::NATIVE_UINT64, DataSpace(2, psddims));
+
+            Attribute energy_max = out.energy_hist.createAttribute("qlong_max",PredType::NATIVE_DOUBLE,scalar);
+            energy_max.write(PredType::NATIVE_DOUBLE,&out.hist.energy_max);
+            Attribute psd_energy_max = out.psd_hist.createAttribute("qlong_max",PredType::NATIVE_DOUBLE,scalar);
+            psd_energy_max.write(PredType::NATIVE_DOUBLE,&out.hist.energy_max);
+            Attribute psd_max = out.psd_hist.createAttribute("ratio_max",PredType::NATIVE_DOUBLE,scalar);
+            psd_max.write(PredType::NATIVE_DOUBLE,&out.hist.psd_max);
+            Attribute prescale = group.createAttribute("hist_store_prescale",PredType::NATIVE_INT32,scalar);
+            prescale.write(PredType::NATIVE_INT32,&out.hist.prescale);
+            DataSet *sets[2] = {&out.energy_hist, &out.psd_hist};
+            for (int j = 0; j < 2; j++) {
+                sets[j]->createAttribute("events",PredType::NATIVE_UINT64,scalar);
+                sets[j]->createAttribute("overflow",PredType::NATIVE_UINT64,scalar);
+            }
+
+            out.energy_counts.assign(energydims[0],0);
+            out.psd_counts.assign(psddims[0]*psddims[1],0);
+            out.histograms.resize(2); // one filling, one being merged
+            out.hist_free = new BoundedQueue<Histogram*>(2);
+            for (size_t j = 0; j < out.histograms.size(); j++) {
+                out.histograms[j] = new Histogram(i, out.hist);
+                out.hist_free->push(out.histograms[j]);
+            }
+        }
+
+        if (list(out.board)) continue; // rows go to the board's list table
+
+        // datasets start empty and grow along the first dimension as blocks are appended
+        hsize_t dimensions[2] = {0, out.nsamples};
+        hsize_t maxdimensions[2] = {H5S_UNLIMITED, out.nsamples};
+        hsize_t chunkdimensions[2] = {chunk_events, out.nsamples};
+
+        DataSpace samplespace(2, dimensions, maxdimensions);
+        DataSpace metaspace(1, dimensions, maxdimensions);
+        if (out.zs) {
+            // one flat run of samples, chunked to hold a block of whole traces
+            chunkdimensions[0] *= out.nsamples;
+            samplespace = DataSpace(1, dimensions, maxdimensions);
+        }
+
+        DSetCreatPropList sampleprops, metaprops;
+        sampleprops.setChunk(out.zs ? 1 : 2, chunkdimensions);
+        if (compression == "shuffle_deflate") sampleprops.setShuffle();
+        if (compression == "deflate" || compression == "shuffle_deflate") sampleprops.setDeflate(compression_level);
+        if (compression == "trace") sampleprops.setFilter(H5Z_FILTER_TRACE, H5Z_FLAG_OPTIONAL);
+        chunkdimensions[0] = chunk_events;
+        metaprops.setChunk(1, chunkdimensions);
+
+        out.samples = file.createDataSet(groupname+"/samples", PredType::NATIVE_UINT16, samplespace, sampleprops);
+        out.baselines = file.createDataSet(groupname+"/baselines", PredType::NATIVE_UINT16, metaspace, metaprops);
+        out.qshorts = file.createDataSet(groupname+"/qshorts", PredType::NATIVE_UINT16, metaspace, metaprops);
+        out.qlongs = file.createDataSet(groupname+"/qlongs", PredType::NATIVE_UINT16, metaspace, metaprops);
+        out.times = file.createDataSet(groupname+"/times", PredType::NATIVE_UINT64, metaspace, metaprops);
+        if (out.finetime) out.finetimes = file.createDataSet(groupname+"/finetimes", PredType::NATIVE_UINT16, metaspace, metaprops);
+        if (out.sparse) out.waveform_rows = file.createDataSet(groupname+"/waveform_rows", PredType::NATIVE_INT64, metaspace, metaprops);
+        if (out.zs) {
+            out.offsets = file.createDataSet(groupname+"/offsets", PredType::NATIVE_UINT64, metaspace, metaprops);
+            out.roi_starts = file.createDataSet(groupname+"/roi_starts", PredType::NATIVE_UINT16, metaspace, metaprops);
+        }
+        if (out.psd) {
+            out.psd_baselines = file.createDataSet(groupname+"/psd_baselines", PredType::NATIVE_UINT16, metaspace, metaprops);
+            out.psd_qshorts = file.createDataSet(groupname+"/psd_qshorts", PredType::NATIVE_INT32, metaspace, metaprops);
+            out.psd_qlongs = file.createDataSet(groupname+"/psd_qlongs", PredType::NATIVE_INT32, metaspace, metaprops);
+            out.psd_tails = file.createDataSet(groupname+"/psd_tails", PredType::NATIVE_FLOAT, metaspace, metaprops);
+            out.psd_peaks = file.createDataSet(groupname+"/psd_peaks", PredType::NATIVE_UINT16, metaspace, metaprops);
+        }
+
+        out.blocks.resize(nblocks);
+        out.free = new BoundedQueue<EventBlock*>(pow2ceil(nblocks));
+        for (size_t j = 0; j < nblocks; j++) {
+            EventBlock &block = out.blocks[j];
+            block.idx = i;
+            block.nevents = 0;
+            const size_t bound = out.zs ? 0 : chunk_bound(run, chunk_events*out.nsamples); // suppressed chunks are not block aligned, so go through the filters
+            if (arena) {
+                ArenaAlloc alloc = {*arena};
+                carve(block, alloc, chunk_events, out.nsamples, out.finetime, out.psd, out.zs, out.sparse, bound);
+            } else {
+                HeapAlloc alloc;
+                carve(block, alloc, chunk_events, out.nsamples, out.finetime, out.psd, out.zs, out.sparse, bound);
+            }
+            block.chunk_bytes = 0;
+            out.free->push(&block);
+        }
+    }
+
+    pending = new BoundedQueue<EventBlock*>(pow2ceil(nblocks*chans.size()));
+    compressed = run.compress_threads > 0 && compression != "none" ? new BoundedQueue<EventBlock*>(pow2ceil(nblocks*chans.size())) : NULL;
+    hist_pending = new BoundedQueue<Histogram*>(pow2ceil(2*chans.size()));
+
+    events = eventconfig.enabled;
+    hit_capacity = 4*chunk_events;
+    events_written = hits_written = 0;
+    event_free = event_pending = NULL;
+    if (events) {
+        Group table = file.createGroup("/events");
+
+        Attribute window = table.createAttribute("window",PredType::NATIVE_DOUBLE,scalar);
+        window.write(PredType::NATIVE_DOUBLE,&eventconfig.window);
+
+        uint32_t only = eventconfig.coincidence_only ? 1 : 0;
+        Attribute coincidence_only = table.createAttribute("coincidence_only",PredType::NATIVE_UINT32,scalar);
+        coincidence_only.write(PredType::NATIVE_UINT32,&only);
+
+        // names the channel index stored with each hit
+        vector<string> names;
+        vector<const char*> cnames;
+        for (size_t i = 0; i < chans.size(); i++) names.push_back(group(i));
+        for (size_t i = 0; i < chans.size(); i++) cnames.push_back(names[i].c_str());
+        hsize_t nchans = chans.size();
+        StrType strtype(PredType::C_S1, H5T_VARIABLE);
+        Attribute groups = table.createAttribute("groups",strtype,DataSpace(1,&nchans));
+        if (nchans) groups.write(strtype,cnames.data());
+
+        hsize_t dimensions[1] = {0};
+        hsize_t maxdimensions[1] = {H5S_UNLIMITED};
+        hsize_t eventchunk[1] = {chunk_events};
+        hsize_t hitchunk[1] = {hit_capacity};
+        DataSpace space(1, dimensions, maxdimensions);
+        DSetCreatPropList eventprops, hitprops;
+        eventprops.setChunk(1, eventchunk);
+        hitprops.setChunk(1, hitchunk);
+
+        event_times = file.createDataSet("/events/times", PredType::NATIVE_UINT64, space, eventprops);
+        event_multiplicity = file.createDataSet("/events/multiplicity", PredType::NATIVE_UINT16, space, eventprops);
+        event_first = file.createDataSet("/events/first", PredType::NATIVE_UINT64, space, eventprops);
+        hit_channels = file.createDataSet("/events/channels", PredType::NATIVE_UINT16, space, hitprops);
+        hit_indices = file.createDataSet("/events/indices", PredType::NATIVE_UINT64, space, hitprops);
+
+        event_blocks.resize(nblocks);
+        event_free = new BoundedQueue<EventTableBlock*>(pow2ceil(nblocks));
+        event_pending = new BoundedQueue<EventTableBlock*>(pow2ceil(nblocks));
+        for (size_t j = 0; j < nblocks; j++) {
+            EventTableBlock &block = event_blocks[j];
+            block.nevents = block.nhits = 0;
+            block.times = new uint64_t[chunk_events];
+            block.multiplicity = new uint16_t[chunk_events];
+            block.first = new uint64_t[chunk_events];
+            block.channels = new uint16_t[hit_capacity];
+            block.indices = new uint64_t[hit_capacity];
+            event_free->push(&block);
+        }
+    }
+
+    closing = false;
+    drained = false;
+    failed = false;
+    block_stalls = 0;
+    write_metrics = metrics.thread();
+    thread = std::thread(&Output::writer,this);
+    if (compressed) {
+        for (int i = 0; i < run.compress_threads; i++) compressors.push_back(std::thread(&Output::compressor,this,i));
+    }
+}
+
+Output::~Output() {
+    if (thread.joinable()) {
+        closing = true;
+        for (size_t i = 0; i < compressors.size(); i++) compressors[i].join();
+        drained = true;
+        thread.join();
+    }
+    for (size_t i = 0; i < chans.size(); i++) {
+        for (size_t j = 0; !arena && j < chans[i].blocks.size(); j++) {
+            EventBlock &block = chans[i].blocks[j];
+            delete [] block.samples;
+            delete [] block.baselines;
+            delete [] block.qshorts;
+            delete [] block.qlongs;
+            delete [] block.times;
+            delete [] block.finetimes;
+            delete [] block.psd.baselines;
+            delete [] block.psd.qshorts;
+            delete [] block.psd.qlongs;
+            delete [] block.psd.tails;
+            delete [] block.psd.peaks;
+            delete [] block.offsets;
+            delete [] block.roi_starts;
+            delete [] block.waveform_rows;
+            delete [] block.chunk;
+        }
+        delete chans[i].free;
+        for (size_t j = 0; j < chans[i].histograms.size(); j++) {
+            delete chans[i].histograms[j];
+        }
+        delete chans[i].hist_free;
+    }
+    for (size_t b = 0; b < lists.size(); b++) {
+        for (size_t j = 0; !arena && j < lists[b].blocks.size(); j++) delete [] lists[b].blocks[j].records;
+        delete lists[b].free;
+    }
+    delete pending;
+    delete compressed;
+    delete hist_pending;
+    delete list_pending;
+    for (size_t j = 0; j < event_blocks.size(); j++) {
+        EventTableBlock &block = event_blocks[j];
+        delete [] block.times;
+        delete [] block.multiplicity;
+        delete [] block.first;
+        delete [] block.channels;
+        delete [] block.indices;
+    }
+    delete event_free;
+    delete event_pending;
+
+    // release every HDF5 object now, while holding the lock
+    lock_guard<mutex> lock(hdf5);
+    chans.clear();
+    lists.clear();
+    DataSet *tables[5] = {&event_times, &event_multiplicity, &event_first, &hit_channels, &hit_indices};
+    for (int i = 0; i < 5; i++) tables[i]->close();
+    file.close();
+}
+
+string Output::group(size_t idx) const {
+    const int board = boards[chans[idx].board];
+    string name = "/ch" + to_string(chans[idx].chan);
+    return board < 0 ? name : "/board" + to_string(board) + name;
+}
+
+EventBlock* Output::getBlock(size_t idx) {
+    EventBlock *block;
+    if (!chans[idx].free->pop(block)) {
+        block_stalls++;
+        while (!chans[idx].free->pop(block)) {
+            if (failed) throw runtime_error("Output writer failed: " + error);
+            usleep(100);
+        }
+    }
+    block->nevents = block->nwaves = 0;
+    block->nstored = 0;
+    return block;
+}
+
+void Output::putBlock(EventBlock *block) {
+    OutputChannel &out = chans[block->idx];
+    if (out.psd && block->nevents) ComputePSD(out.gates, block->samples, block->nevents, out.nsamples, block->psd);
+    block->seq = out.queued++;
+    pending->push(block); // sized to hold every block, so this cannot fail
+}
+
+ListBlock* Output::getListBlock(uint32_t board) {
+    ListBlock *block;
+    if (!lists[board].free->pop(block)) {
+        block_stalls++;
+        while (!lists[board].free->pop(block)) {
+            if (failed) throw runtime_error("Output writer failed: " + error);
+            usleep(100);
+        }
+    }
+    block->nevents = 0;
+    return block;
+}
+
+void Output::putListBlock(ListBlock *block) {
+    list_pending->push(block); // sized to hold every block, so this cannot fail
+}
+
+Histogram* Output::getHistogram(size_t idx) {
+    Histogram *histogram;
+    while (!chans[idx].hist_free->pop(histogram)) {
+        if (failed) throw runtime_error("Output writer failed: " + error);
+        usleep(100);
+    }
+    return histogram;
+}
+
+void Output::putHistogram(Histogram *histogram) {
+    hist_pending->push(histogram); // sized to hold every histogram, so this cannot fail
+}
+
+EventTableBlock* Output::getEventBlock() {
+    EventTableBlock *block;
+    while (!event_free->pop(block)) {
+        if (failed) throw runtime_error("Output writer failed: " + error);
+        usleep(100);
+    }
+    block->nevents = block->nhits = 0;
+    return block;
+}
+
+void Output::putEventBlock(EventTableBlock *block) {
+    event_pending->push(block); // sized to hold every block, so this cannot fail
+}
+
+void Output::close() {
+    if (!thread.joinable()) return;
+    closing = true;
+    for (size_t i = 0; i < compressors.size(); i++) compressors[i].join();
+    drained = true;
+    thread.join();
+    if (failed) throw runtime_error("Output writer failed: " + error);
+    lock_guard<mutex> lock(hdf5);
+    for (size_t i = 0; i < chans.size(); i++) {
+        if (!list(chans[i].board)) chans[i].stored_bytes = chans[i].samples.getStorageSize();
+    }
+    summarize();
+    file.close();
+}
+
+hsize_t Output::fileBytes() {
+    lock_guard<mutex> lock(hdf5);
+    return file.getFileSize();
+}
+
+// Called with the hdf5 lock held
+void Output::summarize() {
+    Metrics total;
+    metrics.snapshot(total);
+    DataSpace scalar(0,NULL);
+    Group group = file.createGroup("/telemetry");
+    auto save = [&](const string &name, const PredType &type, const void *value) {
+        Attribute attr = group.createAttribute(name,type,scalar);
+        attr.write(type,value);
+    };
+    for (int i = 0; i < METRIC_COUNTERS; i++) save(metric_counter_names[i],PredType::NATIVE_UINT64,&total.counters[i]);
+    // latencies in ns, sizes in bytes and events
+    auto summary = [&](const string &name, const LatencyHistogram &hist) {
+        const uint64_t count = hist.count(), p50 = hist.percentile(0.5), p99 = hist.percentile(0.99), max = hist.maximum();
+        const double mean = hist.mean();
+        save(name + "_count",PredType::NATIVE_UINT64,&count);
+        save(name + "_mean",PredType::NATIVE_DOUBLE,&mean);
+        save(name + "_p50",PredType::NATIVE_UINT64,&p50);
+        save(name + "_p99",PredType::NATIVE_UINT64,&p99);
+        save(name + "_max",PredType::NATIVE_UINT64,&max);
+    };
+    for (int i = 0; i < METRIC_STAGES; i++) summary(metric_stage_names[i],total.stages[i]);
+    summary("transfer_bytes",total.transfer_bytes);
+    summary("transfer_events",total.transfer_events);
+    summary("latency",write_latency);
+    
+    // what each channel missed, for correcting its rates
+    for (size_t i = 0; i < chans.size(); i++) {
+        const OutputChannel &chan = chans[i];
+        Group chgroup = file.openGroup(this->group(i));
+        auto put = [&](const string &name, const PredType &type, const void *value) {
+            Attribute attr = chgroup.createAttribute(name,type,scalar);
+            attr.write(type,value);
+        };
+        const double dead = chan.dead.gap_ticks*chan.ns_tick*1e-9;
+        const double live = (chan.dead.last-chan.dead.first)*chan.ns_tick*1e-9 - dead;
+        const uint64_t lost = chan.dead.counted ? chan.dead.lost : (uint64_t)(chan.dead.gap_lost+0.5);
+        const uint8_t estimated = !chan.dead.counted;
+        put("livetime_s",PredType::NATIVE_DOUBLE,&live);
+        put("dead_time_s",PredType::NATIVE_DOUBLE,&dead);
+        put("timestamp_gaps",PredType::NATIVE_UINT64,&chan.dead.gaps);
+        put("lost_events",PredType::NATIVE_UINT64,&lost);
+        put("lost_events_estimated",PredType::NATIVE_UINT8,&estimated);
+        if (chan.dead.counted) {
+            put("triggers",PredType::NATIVE_UINT64,&chan.dead.triggers);
+            put("lost_triggers",PredType::NATIVE_UINT64,&chan.dead.lost);
+        }
+        // shared by every channel of the board
+        const BoardReadout &readout = readouts[chan.board];
+        const double outside = readout.outside_ns*1e-9;
+        put("board_full_reads",PredType::NATIVE_UINT64,&readout.board_full_reads);
+        put("saturated_transfers",PredType::NATIVE_UINT64,&readout.saturated_transfers);
+        put("outside_read_s",PredType::NATIVE_DOUBLE,&outside);
+    }
+}
+
+void Output::account(size_t idx, const DeadTime &stretch) {
+    DeadTime &dead = chans[idx].dead;
+    if (!dead.events) {
+        dead.first = stretch.first;
+        dead.last = stretch.last;
+    } else if (stretch.events) {
+        dead.last = stretch.last;
+    }
+    dead.events += stretch.events;
+    dead.gaps += stretch.gaps;
+    dead.gap_ticks += stretch.gap_ticks;
+    dead.gap_lost += stretch.gap_lost;
+    dead.counted = dead.counted || stretch.counted;
+    dead.triggers += stretch.triggers;
+    dead.lost += stretch.lost;
+}
+
+void Output::readout(uint32_t board, bool full, bool saturated, uint64_t outside_ns) {
+    if (full) readouts[board].board_full_reads++;
+    if (saturated) readouts[board].saturated_transfers++;
+    readouts[board].outside_ns += outside_ns;
+}
+
+void Output::report(ostream &out) const {
+    out << "Writer: " << block_stalls << " decode stalls waiting on disk" << endl;
+    for (size_t b = 0; b < lists.size(); b++) {
+        if (!lists[b].enabled) continue;
+        out << "\t" << (boards[b] < 0 ? "/list" : "/board" + to_string(boards[b]) + "/list") << ": " << lists[b].nwritten << " rows, " << lists[b].nwritten*sizeof(ListRecord)/1e6 << " MB" << endl;
+    }
+    for (size_t i = 0; i < chans.size(); i++) {
+        const DeadTime &dead = chans[i].dead;
+        const double lost = dead.counted ? dead.lost : dead.gap_lost;
+        if (!dead.gaps && lost < 0.5) continue;
+        out << "\t" << group(i) << ": " << dead.gap_ticks*chans[i].ns_tick*1e-9 << " s dead in " << dead.gaps << " time stamp gaps, "
+            << (uint64_t)(lost+0.5) << " events lost" << (dead.counted ? " (board trigger counters)" : " (estimated)") << endl;
+    }
+    for (size_t i = 0; i < chans.size(); i++) {
+        const OutputChannel &chan = chans[i];
+        if (!chan.sparse || list(chan.board)) continue;
+        out << "\t" << group(i) << ": waveforms of " << chan.waves_written << " of " << chan.nwritten << " events" << endl;
+    }
+    for (size_t i = 0; i < chans.size(); i++) {
+        const OutputChannel &chan = chans[i];
+        if (!chan.zs || list(chan.board)) continue;
+        const uint64_t whole = chan.waves_written*chan.nsamples;
+        out << "\t" << group(i) << ": zero suppression kept " << chan.samples_written << " of " << whole << " samples, "
+            << (whole-chan.samples_written)*sizeof(uint16_t)/1e6 << " MB saved";
+        if (whole) out << " (" << setprecision(3) << 100.0*chan.samples_written/whole << setprecision(6) << "% kept)";
+        out << endl;
+    }
+    if (compression == "none") return;
+    out << "Compression (" << compression << (compressed ? ", " + to_string(compressors.size()) + " threads" : ", writer thread") << "):" << endl;
+    for (size_t i = 0; i < chans.size(); i++) {
+        const OutputChannel &chan = chans[i];
+        if (list(chan.board)) continue;
+        const double raw = (chan.zs ? chan.samples_written : chan.waves_written*chan.nsamples)*sizeof(uint16_t)/1e6, stored = chan.stored_bytes/1e6;
+        out << "\t" << group(i) << ": " << raw << " MB -> " << stored << " MB";
+        if (stored > 0) out << " (" << setprecision(3) << raw/stored << setprecision(6) << "x)";
+        out << ", " << chan.compress_cpu << " s CPU";
+        const double out_bytes = compressed && !chan.zs ? chan.chunk_bytes : chan.stored_bytes;
+        if (chan.compress_cpu > 0) out << " (" << chan.raw_bytes/1e6/chan.compress_cpu << " MB/s in, " << out_bytes/1e6/chan.compress_cpu << " MB/s out)";
+        out << endl;
+    }
+}
+
+void Output::fail(const string &message) {
+    call_once(failure, [&]() {
+        error = message;
+        failed = true;
+    });
+}
+
+void Output::compressor(int id) {
+    ThreadMetrics &metrics = *this->metrics.thread();
+    TraceThread("compress " + to_string(id) + " " + fname); // the next cycle's Output may be running alongside
+    vector<uint8_t> scratch;
+    try {
+        for (;;) {
+            const bool done = closing;
+            EventBlock *block;
+            if (pending->pop(block)) {
+                const uint64_t start = now_ns();
+                compress(block,scratch);
+                metrics.time(METRIC_COMPRESS,start);
+                metrics.publish();
+                compressed->push(block); // as large as pending
+            } else if (done) {
+                break;
+            } else {
+                usleep(100);
+            }
+        }
+    } catch (runtime_error &e) {
+        fail(e.what());
+    }
+    metrics.publish(true);
+}
+
+void Output::compress(EventBlock *block, vector<uint8_t> &scratch) {
+    block->chunk_bytes = 0;
+    block->filter_mask = 0;
+    block->cpu = 0.0;
+    // a partial chunk is left to the filters of the dataset, since its tail must not be written, as are zero suppressed samples
+    if (block->nwaves != chunk_events || !block->chunk) return;
+
+    const double start = thread_cpu();
+    const OutputChannel &out = chans[block->idx];
+    const size_t nvalues = chunk_events*out.nsamples, nbytes = nvalues*sizeof(uint16_t);
+    if (compression == "trace") {
+        block->chunk_bytes = EncodeTraces(block->samples, nvalues, block->chunk);
+        if (block->chunk_bytes >= nbytes) {
+            // what the optional filter does with incompressible data
+            memcpy(block->chunk, block->samples, nbytes);
+            block->chunk_bytes = nbytes;
+            block->filter_mask = 1;
+        }
+    } else {
+        const Bytef *source = (const Bytef*)block->samples;
+        if (compression == "shuffle_deflate") {
+            // the HDF5 shuffle filter for 2 byte elements: every low byte, then every high byte
+            scratch.resize(nbytes);
+            for (size_t i = 0; i < nvalues; i++) {
+                scratch[i] = block->samples[i] & 0xFF;
+                scratch[nvalues+i] = block->samples[i] >> 8;
+            }
+            source = scratch.data();
+        }
+        uLongf size = compressBound(nbytes);
+        if (compress2((Bytef*)block->chunk, &size, source, nbytes, compression_level) != Z_OK) {
+            throw runtime_error("Could not deflate a chunk of " + group(block->idx));
+        }
+        block->chunk_bytes = size;
+    }
+    block->cpu = thread_cpu() - start;
+}
+
+void Output::deliver(EventBlock *block) {
+    OutputChannel &out = chans[block->idx];
+    if (block->seq != out.next) {
+        out.parked.push_back(block);
+        return;
+    }
+    for (;;) {
+        const uint64_t start = now_ns();
+        append(block);
+        write_metrics->time(METRIC_WRITE,start);
+        write_metrics->count(METRIC_BLOCKS);
+        write_metrics->count(METRIC_WRITTEN,block->nevents);
+        if (block->nevents) write_latency.record(now_ns()-block->t_first);
+        out.free->push(block);
+        out.next++;
+        size_t i = 0;
+        while (i < out.parked.size() && out.parked[i]->seq != out.next) i++;
+        if (i == out.parked.size()) break;
+        block = out.parked[i];
+        out.parked.erase(out.parked.begin()+i);
+    }
+}
+
+void Output::writer() {
+    TraceThread("writer " + fname);
+    try {
+        chrono::steady_clock::time_point last_flush = chrono::steady_clock::now();
+        for (;;) {
+            // only set once no more blocks will be queued, so check before popping
+            const bool done = compressed ? (bool)drained : (bool)closing;
+            bool idle = true;
+            EventBlock *block;
+            if (compressed ? compressed->pop(block) : pending->pop(block)) {
+                lock_guard<mutex> lock(hdf5);
+                deliver(block);
+                idle = false;
+            }
+            Histogram *histogram;
+            if (hist_pending->pop(histogram)) {
+                lock_guard<mutex> lock(hdf5);
+                merge(histogram);
+                histogram->clear();
+                chans[histogram->idx].hist_free->push(histogram);
+                idle = false;
+            }
+            ListBlock *listblock;
+            if (list_pending->pop(listblock)) {
+                lock_guard<mutex> lock(hdf5);
+                const uint64_t start = now_ns();
+                append(listblock);
+                write_metrics->time(METRIC_WRITE,start);
+                write_metrics->count(METRIC_BLOCKS);
+                write_metrics->count(METRIC_WRITTEN,listblock->nevents);
+                if (listblock->nevents) write_latency.record(now_ns()-listblock->t_first);
+                lists[listblock->board].free->push(listblock);
+                idle = false;
+            }
+            EventTableBlock *eventblock;
+            if (events && event_pending->pop(eventblock)) {
+                lock_guard<mutex> lock(hdf5);
+                append(eventblock);
+                event_free->push(eventblock);
+                idle = false;
+            }
+            if (idle) {
+                if (done) break;
+                usleep(1000);
+            }
+            write_metrics->publish();
+
+            chrono::steady_clock::time_point now = chrono::steady_clock::now();
+            if (chrono::duration<double>(now-last_flush).count() >= flush_interval) {
+                lock_guard<mutex> lock(hdf5);
+                const uint64_t begin = now_ns();
+                file.flush(H5F_SCOPE_GLOBAL);
+                TraceEvent("flush",begin,now_ns());
+                last_flush = now;
+            }
+        }
+        lock_guard<mutex> lock(hdf5);
+        file.flush(H5F_SCOPE_GLOBAL);
+    } catch (Exception &e) {
+        fail(e.getFuncName() + ": " + e.getDetailMsg());
+    } catch (runtime_error &e) {
+        fail(e.what());
+    }
+    write_metrics->publish(true);
+}
+
+void Output::append(EventBlock *block) {
+    if (!block->nevents) return;
+
+    OutputChannel &out = chans[block->idx];
+
+    hsize_t offset[2] = {out.waves_written, 0};
+    hsize_t count[2] = {block->nwaves, out.nsamples};
+    hsize_t extent[2] = {out.waves_written + block->nwaves, out.nsamples};
+
+    if (out.zs) {
+        const double start = thread_cpu();
+        for (size_t i = 0; i < block->nwaves; i++) block->offsets[i] += out.samples_written;
+        if (block->nstored) extend(out.samples, block->samples, PredType::NATIVE_UINT16, out.samples_written, block->nstored);
+        if (block->nwaves) {
+            extend(out.offsets, block->offsets, PredType::NATIVE_UINT64, out.waves_written, block->nwaves);
+            extend(out.roi_starts, block->roi_starts, PredType::NATIVE_UINT16, out.waves_written, block->nwaves);
+        }
+        out.samples_written += block->nstored;
+        if (compression != "none") {
+            out.raw_bytes += block->nstored*sizeof(uint16_t);
+            out.compress_cpu += thread_cpu() - start;
+        }
+    } else if (!block->nwaves) {
+        // no waveforms kept in this block
+    } else if (block->chunk_bytes && out.waves_written % chunk_events == 0) {
+        out.samples.extend(extent);
+        // compressed ahead of time, so HDF5 only has to store it
+        if (H5Dwrite_chunk(out.samples.getId(), H5P_DEFAULT, block->filter_mask, offset, block->chunk_bytes, block->chunk) < 0) {
+            throw runtime_error("Could not write a chunk of " + group(block->idx));
+        }
+        out.raw_bytes += block->nwaves*out.nsamples*sizeof(uint16_t);
+        out.chunk_bytes += block->chunk_bytes;
+        out.compress_cpu += block->cpu;
+    } else {
+        out.samples.extend(extent);
+        const double start = thread_cpu();
+        DataSpace samplemem(2, count);
+        DataSpace samplespace = out.samples.getSpace();
+        samplespace.selectHyperslab(H5S_SELECT_SET, count, offset);
+        out.samples.write(block->samples, PredType::NATIVE_UINT16, samplemem, samplespace);
+        if (compression != "none" && !compressed) {
+            // includes the rest of the write, but the filters dominate it
+            out.raw_bytes += block->nwaves*out.nsamples*sizeof(uint16_t);
+            out.compress_cpu += thread_cpu() - start;
+        }
+    }
+    if (out.sparse) {
+        for (size_t i = 0; i < block->nevents; i++) {
+            if (block->waveform_rows[i] >= 0) block->waveform_rows[i] += out.waves_written;
+        }
+        extend(out.waveform_rows, block->waveform_rows, PredType::NATIVE_INT64, out.nwritten, block->nevents);
+    }
+    out.waves_written += block->nwaves;
+
+    extend(out.baselines, block->baselines, PredType::NATIVE_UINT16, out.nwritten, block->nevents);
+    extend(out.qshorts, block->qshorts, PredType::NATIVE_UINT16, out.nwritten, block->nevents);
+    extend(out.qlongs, block->qlongs, PredType::NATIVE_UINT16, out.nwritten, block->nevents);
+    extend(out.times, block->times, PredType::NATIVE_UINT64, out.nwritten, block->nevents);
+    if (out.finetime) extend(out.finetimes, block->finetimes, PredType::NATIVE_UINT16, out.nwritten, block->nevents);
+    if (out.psd) {
+        extend(out.psd_baselines, block->psd.baselines, PredType::NATIVE_UINT16, out.nwritten, block->nevents);
+        extend(out.psd_qshorts, block->psd.qshorts, PredType::NATIVE_INT32, out.nwritten, block->nevents);
+        extend(out.psd_qlongs, block->psd.qlongs, PredType::NATIVE_INT32, out.nwritten, block->nevents);
+        extend(out.psd_tails, block->psd.tails, PredType::NATIVE_FLOAT, out.nwritten, block->nevents);
+        extend(out.psd_peaks, block->psd.peaks, PredType::NATIVE_UINT16, out.nwritten, block->nevents);
+    }
+
+    out.nwritten += block->nevents;
+}
+
+void Output::append(EventTableBlock *block) {
+    if (block->nevents) {
+        extend(event_times, block->times, PredType::NATIVE_UINT64, events_written, block->nevents);
+        extend(event_multiplicity, block->multiplicity, PredType::NATIVE_UINT16, events_written, block->nevents);
+        extend(event_first, block->first, PredType::NATIVE_UINT64, events_written, block->nevents);
+        events_written += block->nevents;
+    }
+    if (block->nhits) {
+        extend(hit_channels, block->channels, PredType::NATIVE_UINT16, hits_written, block->nhits);
+        extend(hit_indices, block->indices, PredType::NATIVE_UINT64, hits_written, block->nhits);
+        hits_written += block->nhits;
+    }
+}
+
+void Output::append(ListBlock *block) {
+    if (!block->nevents) return;
+
+    OutputList &list = lists[block->board];
+    hsize_t offset = list.nwritten, count = block->nevents, extent = offset + count;
+    list.table.extend(&extent);
+    DataSpace space = list.table.getSpace();
+    space.selectHyperslab(H5S_SELECT_SET, &count, &offset);
+    DataSpace mem(1, &count);
+    list.table.write(block->records, list.table.getCompType(), mem, space);
+    list.nwritten += block->nevents;
+
+    const vector<int> &idx = chan2idx[block->board];
+    for (size_t i = 0; i < block->nevents; i++) chans[idx[block->records[i].channel]].nwritten++;
+}
+
+void Output::merge(Histogram *histogram) {
+    OutputChannel &out = chans[histogram->idx];
+    for (size_t i = 0; i < out.energy_counts.size(); i++) out.energy_counts[i] += histogram->energy[i];
+    for (size_t i = 0; i < out.psd_counts.size(); i++) out.psd_counts[i] += histogram->psd[i];
+    out.hist_events += histogram->events;
+    out.energy_overflow += histogram->energy_overflow;
+    out.psd_overflow += histogram->psd_overflow;
+
+    out.energy_hist.write(out.energy_counts.data(), PredType::NATIVE_UINT64);
+    out.energy_hist.openAttribute("events").write(PredType::NATIVE_UINT64,&out.hist_events);
+    out.energy_hist.openAttribute("overflow").write(PredType::NATIVE_UINT64,&out.energy_overflow);
+    out.psd_hist.write(out.psd_counts.data(), PredType::NATIVE_UINT64);
+    out.psd_hist.openAttribute("events").write(PredType::NATIVE_UINT64,&out.hist_events);
+    out.psd_hist.openAttribute("overflow").write(PredType::NATIVE_UINT64,&out.psd_overflow);
+}
+
+void Output::extend(DataSet &dataset, const void *data, const PredType &type, hsize_t offset, hsize_t count) {
+    hsize_t extent = offset + count;
+    dataset.extend(&extent);
+    DataSpace space = dataset.getSpace();
+    space.selectHyperslab(H5S_SELECT_SET, &count, &offset);
+    DataSpace mem(1, &count);
+    dataset.write(data, type, mem, space);
+}
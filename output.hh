@@ -0,0 +1,350 @@
+/**
+ *  Copyright 2014 by Benjamin Land (a.k.a. BenLand100)
+ *
+ *  acquire is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  acquire is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with acquire. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __OUTPUT__HH
+#define __OUTPUT__HH
+
+#include "digitizer.hh"
+#include "psd.hh"
+#include "dpppsd.hh"
+#include "histogram.hh"
+#include "arena.hh"
+#include "queue.hh"
+#include "latency.hh"
+#include "metrics.hh"
+
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <ostream>
+
+#include <H5Cpp.h>
+
+//A batch of consecutive events from one channel. Decode threads fill these and
+//the writer thread appends them to the output file, then recycles them.
+typedef struct {
+    size_t idx; // output channel index (across all boards)
+    size_t nevents; // events filled so far (at most chunk_events)
+    uint64_t t_first; // now_ns() when the transfer holding the first event was read
+    uint16_t *samples, *baselines, *qshorts, *qlongs;
+    uint64_t *times; // extended time stamps in ticks
+    uint16_t *finetimes; // NULL unless the board records fine time
+    PSDResults psd; // all NULL unless the channel has software_psd
+    size_t nwaves; // waveforms filled so far (nevents unless the channel keeps only some)
+    int64_t *waveform_rows; // waveform of each event in samples (file rows once written) or -1, NULL unless the channel keeps only some
+    // zero suppressed channels pack samples back to back instead of nsamples per waveform
+    size_t nstored; // samples filled so far
+    uint64_t *offsets; // first sample of each waveform in samples (file offsets once written), NULL unless suppressed
+    uint16_t *roi_starts; // position of that sample in the record
+    uint64_t seq; // blocks of the channel put before this one
+    char *chunk; // compressed samples (when compressing in parallel)
+    size_t chunk_bytes;
+    uint32_t filter_mask; // filters skipped for chunk, as for H5Dwrite_chunk
+    double cpu; // seconds spent compressing
+} EventBlock;
+
+//A batch of built events for the /events table. Event i has multiplicity[i]
+//hits, stored from first[i] in the flat per-hit arrays.
+typedef struct {
+    size_t nevents, nhits; // filled so far (at most chunk_events and hit_capacity)
+    uint64_t *times; // time stamp of the earliest hit
+    uint16_t *multiplicity;
+    uint64_t *first; // offset of the event's first hit in /events/channels and /events/indices
+    uint16_t *channels; // output channel index of each hit
+    uint64_t *indices; // row of each hit in its channel's datasets
+} EventTableBlock;
+
+//One row of a list mode table
+typedef struct {
+    uint64_t time; // extended time stamp in ticks
+    uint16_t qshort, qlong, baseline;
+    uint8_t pur; // pile-up rejection flag
+    uint8_t channel; // digitizer channel
+} ListRecord;
+
+//A batch of list mode records from the channels of one board that one decode
+//thread stores, in readout order.
+typedef struct {
+    size_t board; // index into the boards passed to Output
+    size_t nevents; // filled so far (at most listEvents())
+    uint64_t t_first; // now_ns() when the transfer holding the first record was read
+    ListRecord *records;
+} ListBlock;
+
+//The list mode table of a board and its recycled blocks
+typedef struct {
+    bool enabled; // board is in list mode, so its channels have no datasets of their own
+    H5::DataSet table;
+    hsize_t nwritten;
+    std::vector<ListBlock> blocks;
+    BoundedQueue<ListBlock*> *free;
+} OutputList;
+
+//Time a board's readout spent away from the board, which the board may have lost events in
+typedef struct {
+    uint64_t board_full_reads; // reads that found the board's memory full (Backend::full)
+    uint64_t saturated_transfers; // reads that filled the host readout buffer, a readout-side hint only
+    uint64_t outside_ns; // time between reads, while the board filled up unread
+} BoardReadout;
+
+//Per-channel datasets and recycled blocks
+typedef struct {
+    uint32_t board; // index into the boards passed to Output
+    uint32_t chan; // digitizer channel number
+    uint32_t nsamples;
+    double ns_tick; // time stamp period
+    bool finetime; // has a finetimes dataset
+    bool psd; // has psd_* datasets computed with gates
+    PSDGates gates;
+    bool zs; // samples are zero suppressed into a flat dataset indexed by offsets
+    ROIConfig roi;
+    bool sparse; // only some events keep waveforms, found through waveform_rows
+    int wave_prescale, wave_cut;
+    int quota; // events to take from the channel (0 for the run's events)
+    DeadTime dead; // accumulated from the stretches handed over by account()
+    H5::DataSet samples, baselines, qshorts, qlongs, times, finetimes;
+    H5::DataSet offsets, roi_starts, waveform_rows;
+    hsize_t samples_written; // length of a zero suppressed samples dataset
+    hsize_t waves_written; // waveforms in samples (nwritten unless sparse)
+    H5::DataSet psd_baselines, psd_qshorts, psd_qlongs, psd_tails, psd_peaks;
+    hsize_t nwritten;
+    std::vector<EventBlock> blocks;
+    BoundedQueue<EventBlock*> *free;
+    uint64_t queued; // blocks put so far, only touched by the thread filling the channel
+    uint64_t next; // seq of the next block to append, only touched by the writer thread
+    std::vector<EventBlock*> parked; // compressed ahead of their turn, likewise
+    uint64_t raw_bytes, chunk_bytes; // samples compressed and what they compressed to (chunk_bytes only counts the compressor threads)
+    double compress_cpu; // seconds compressing them, on the compressor threads or in the writer's filters
+    uint64_t stored_bytes; // samples dataset on disk, set by close
+    // charge histograms (only if hist.enabled), merged by the writer thread
+    HistogramConfig hist;
+    H5::DataSet energy_hist, psd_hist;
+    std::vector<uint64_t> energy_counts, psd_counts;
+    uint64_t hist_events, energy_overflow, psd_overflow;
+    std::vector<Histogram*> histograms;
+    BoundedQueue<Histogram*> *hist_free;
+} OutputChannel;
+
+//Streams events to an HDF5 file as extendible, chunked /chN datasets (or
+///boardN/chM when several boards share the file), or for boards in list mode
+//as one /list (/boardN/list) table of ListRecords. Memory use is bounded by
+//chunk_events*nblocks events per channel no matter how many events the run
+//records; filled blocks are written by a dedicated thread.
+class Output {
+
+    public:
+
+        // Creates the file, the per-channel groups, attributes and empty datasets, then starts the writer thread.
+        // boards holds the DIGITIZER[n] index of each settings (-1 for a single board written as /chN).
+        // Chunking, buffering, flushing and compression come from run (see RunConfig).
+        // If eventconfig is enabled an /events table is created for an EventBuilder to fill.
+        // The write buffers are carved from arena (which must have storageBytes free) if not NULL.
+        Output(const std::string &fname, std::vector<Settings> &settings, const std::vector<int> &boards, const RunConfig &run, const EventConfig &eventconfig, Arena *arena = NULL);
+
+        // Arena space the write buffers of an Output with these settings take
+        static size_t storageBytes(const std::vector<Settings> &settings, const RunConfig &run);
+
+        // Closes the file if close() was not called
+        ~Output();
+
+        // Maps a channel of a board (index into settings) to an output channel index (-1 if not stored)
+        inline int index(uint32_t board, uint32_t chan) const { return chan2idx[board][chan]; }
+
+        // Number of output channels
+        inline size_t size() const { return chans.size(); }
+
+        // Events per block
+        inline size_t chunkEvents() const { return chunk_events; }
+
+        // Board (index into settings) of an output channel
+        inline uint32_t board(size_t idx) const { return chans[idx].board; }
+
+        // Digitizer channel number of an output channel
+        inline uint32_t channel(size_t idx) const { return chans[idx].chan; }
+
+        // Group holding an output channel, e.g. /ch3 or /board1/ch3
+        std::string group(size_t idx) const;
+
+        // Samples per event for an output channel
+        inline uint32_t samples(size_t idx) const { return chans[idx].nsamples; }
+
+        // Whether the stored event with this index (counting from 0) and qlong keeps its waveform
+        inline bool waveform(size_t idx, uint64_t stored, uint16_t qlong) const {
+            const OutputChannel &out = chans[idx];
+            return !out.sparse || (out.wave_prescale && stored % out.wave_prescale == 0) || (out.wave_cut && qlong >= out.wave_cut);
+        }
+
+        // Zero suppression of an output channel, NULL if it stores whole traces
+        inline const ROIConfig* roi(size_t idx) const { return chans[idx].zs ? &chans[idx].roi : NULL; }
+
+        // Time stamp period of an output channel in ns
+        inline double tick(size_t idx) const { return chans[idx].ns_tick; }
+
+        // Returns an empty block for an output channel, waiting for the writer if none are free
+        EventBlock* getBlock(size_t idx);
+
+        // Queues a (possibly partially) filled block to be appended to the file, first
+        // computing its software PSD values on the calling thread if the channel has any
+        void putBlock(EventBlock *block);
+
+        // Whether a board (index into settings) stores a list mode table instead of per-channel datasets
+        inline bool list(uint32_t board) const { return lists[board].enabled; }
+
+        // Records per ListBlock
+        inline size_t listEvents() const { return list_events; }
+
+        // As getBlock and putBlock, for the list mode table of a board
+        ListBlock* getListBlock(uint32_t board);
+        void putListBlock(ListBlock *block);
+
+        // Whether an output channel fills histograms
+        inline bool histogram(size_t idx) const { return chans[idx].hist.enabled; }
+
+        // Keep 1 in prescale events of an output channel (none if 0)
+        inline int prescale(size_t idx) const { return chans[idx].hist.enabled ? chans[idx].hist.prescale : 1; }
+
+        // Adds a stretch of an output channel's dead time, written as attributes of its group at close.
+        // Only called by the thread filling the channel.
+        void account(size_t idx, const DeadTime &stretch);
+
+        // Adds a read of a board (index into settings) that came outside_ns after the previous one, written as
+        // board_full_reads, saturated_transfers and outside_read_s attributes of the board's channel groups at close.
+        // Only called by the board's readout thread.
+        void readout(uint32_t board, bool full, bool saturated, uint64_t outside_ns);
+
+        // Events an output channel takes before it is switched off (0 for the run's events)
+        inline int quota(size_t idx) const { return chans[idx].quota; }
+
+        // Seconds between histogram snapshots and HDF5 flushes
+        inline double flushInterval() const { return flush_interval; }
+
+        // As getBlock and putBlock, for the histograms of an output channel. The counts of a
+        // Histogram put back are added to the channel's totals, which are rewritten in the file.
+        Histogram* getHistogram(size_t idx);
+        void putHistogram(Histogram *histogram);
+
+        // Events histogrammed for an output channel (valid after close)
+        inline uint64_t histogrammed(size_t idx) const { return chans[idx].hist_events; }
+
+        // Hits an EventTableBlock can hold
+        inline size_t hitCapacity() const { return hit_capacity; }
+
+        // As getBlock and putBlock, for the /events table
+        EventTableBlock* getEventBlock();
+        void putEventBlock(EventTableBlock *block);
+
+        // Events and hits written to /events
+        inline hsize_t eventsWritten() const { return events_written; }
+        inline hsize_t hitsWritten() const { return hits_written; }
+
+        // Writes all queued blocks, stops the writer thread, and closes the file
+        void close();
+
+        // Size of the file so far
+        hsize_t fileBytes();
+
+        // Total events written for an output channel
+        inline hsize_t written(size_t idx) const { return chans[idx].nwritten; }
+
+        // Number of times getBlock had to wait on the writer
+        inline size_t stalls() const { return block_stalls; }
+
+        // Prints the writer counters and the compression done for each channel (valid after close)
+        void report(std::ostream &out) const;
+
+        // Time from readout of a block's first event until the block was in the file (valid after close)
+        inline const LatencyHistogram& latency() const { return write_latency; }
+
+        // Counters and stage latencies of every thread working on this file (pipelines add theirs),
+        // summarized in a /telemetry group by close()
+        inline Telemetry& telemetry() { return metrics; }
+
+    protected:
+
+        void writer();
+
+        // Compresses the samples of blocks from pending for the writer, on compress_threads threads
+        void compressor(int id);
+
+        void compress(EventBlock *block, std::vector<uint8_t> &scratch);
+
+        // Appends a block and any parked blocks of its channel that follow it, parking it if it is early
+        void deliver(EventBlock *block);
+
+        void append(EventBlock *block);
+
+        void append(EventTableBlock *block);
+
+        void append(ListBlock *block);
+
+        // Records the first failure of the writer or a compressor for the other threads
+        void fail(const std::string &message);
+
+        void merge(Histogram *histogram);
+
+        // Writes the /telemetry group and the dead time attributes of each channel
+        void summarize();
+
+        // Appends count values to an extendible 1D dataset at offset
+        void extend(H5::DataSet &dataset, const void *data, const H5::PredType &type, hsize_t offset, hsize_t count);
+
+        H5::H5File file;
+        const std::string fname;
+
+        const size_t chunk_events, list_events;
+        const double flush_interval;
+        const std::string compression;
+        const int compression_level;
+        Arena *arena; // owns the block arrays if not NULL
+
+        // Held for every HDF5 call, so the writer of one cycle's Output can finish while the next one fills
+        static std::mutex hdf5;
+
+        std::vector<int> boards;
+        std::vector<std::vector<int>> chan2idx;
+        std::vector<OutputChannel> chans;
+        std::vector<OutputList> lists; // per board
+        std::vector<BoardReadout> readouts; // per board
+
+        BoundedQueue<EventBlock*> *pending;
+        BoundedQueue<EventBlock*> *compressed; // blocks from the compressors, NULL without them
+        BoundedQueue<Histogram*> *hist_pending;
+        BoundedQueue<ListBlock*> *list_pending;
+
+        // /events table (only if events are being built)
+        bool events;
+        size_t hit_capacity;
+        H5::DataSet event_times, event_multiplicity, event_first, hit_channels, hit_indices;
+        hsize_t events_written, hits_written;
+        std::vector<EventTableBlock> event_blocks;
+        BoundedQueue<EventTableBlock*> *event_free, *event_pending;
+
+        std::thread thread;
+        std::vector<std::thread> compressors;
+        std::atomic<bool> closing, drained, failed; // drained once the compressors have finished
+        std::once_flag failure;
+        std::string error;
+
+        std::atomic<size_t> block_stalls;
+
+        LatencyHistogram write_latency; // only touched by the writer thread
+
+        Telemetry metrics;
+        ThreadMetrics *write_metrics; // of the writer thread
+};
+
+#endif
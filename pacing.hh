@@ -0,0 +1,115 @@
+/**
+ *  Copyright 2014 by Benjamin Land (a.k.a. BenLand100)
+ *
+ *  acquire is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  acquire is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with acquire. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __PACING__HH
+#define __PACING__HH
+
+#include "digitizer.hh"
+#include "latency.hh"
+
+#include <cstdint>
+#include <algorithm>
+#include <ostream>
+
+//Chooses how long a readout thread waits between transfers. In adaptive mode
+//the wait is scaled each transfer by how the smoothed occupancy (bytes read
+//over buffer capacity, which is what the board had buffered) compares to the
+//target, between 100 us and transfer_wait; a transfer that fills the buffer
+//means more is waiting on the board, so the next read is immediate. In fixed
+//mode it always waits transfer_wait. Not thread safe; one per readout thread.
+class ReadoutPacer {
+
+    public:
+
+        inline ReadoutPacer(const RunConfig &run) :
+            adaptive(run.pacing == "adaptive"), max_us(std::max(run.transfer_wait,0)*1000ull), target(run.pacing_target) {
+            if (run.pacing != "adaptive" && run.pacing != "fixed") throw std::runtime_error("Unknown pacing " + run.pacing);
+            if (target <= 0.0 || target >= 1.0) throw std::runtime_error("pacing_target must be between 0 and 1");
+            reset(1);
+        }
+
+        // Starts over for buffers of capacity bytes
+        inline void reset(uint32_t capacity) {
+            this->capacity = std::max<uint32_t>(capacity,1);
+            interval = std::min<uint64_t>(1000,max_us);
+            smoothed = peak = 0.0;
+            transfers = saturated = 0;
+            waited = 0;
+            first = last = 0;
+        }
+
+        // Accounts for a transfer of size bytes, returning the microseconds to wait before the next read
+        inline uint64_t next(uint32_t size) {
+            last = now_ns();
+            if (!first) first = last;
+            const double occupancy = (double)size/capacity;
+            smoothed += 0.25*(occupancy - smoothed);
+            peak = std::max(peak,occupancy);
+            transfers++;
+            const bool filled = occupancy >= 0.95;
+            if (filled) saturated++;
+            uint64_t wait = max_us;
+            if (adaptive) {
+                if (filled) {
+                    interval /= 2;
+                    wait = 0;
+                } else {
+                    const double scale = std::min(std::max(target/std::max(smoothed,0.01),0.5),2.0);
+                    interval = std::min<uint64_t>(std::max<uint64_t>(interval*scale,std::min<uint64_t>(100,max_us)),max_us);
+                    wait = interval;
+                }
+            }
+            waited += wait;
+            return wait;
+        }
+
+        // Smoothed and largest occupancy of the transfers so far (0 to 1)
+        inline double occupancy() const { return smoothed; }
+        inline double maxOccupancy() const { return peak; }
+
+        // Wait chosen for the last transfer, and on average, in microseconds
+        inline uint64_t lastWait() const { return adaptive ? interval : max_us; }
+        inline double meanWait() const { return transfers ? (double)waited/transfers : 0.0; }
+
+        // Mean time from one read to the next in microseconds, shorter than the wait if interrupts cut it short
+        inline double meanPeriod() const { return transfers > 1 ? (last-first)/1e3/(transfers-1) : 0.0; }
+
+        // Transfers that filled the host buffer: more data was waiting than one transfer carries, which
+        // is a readout-side hint, not a sign the board's memory was full (Backend::full)
+        inline uint64_t saturatedTransfers() const { return saturated; }
+
+        inline void report(std::ostream &out) const {
+            out << "Pacing: " << (adaptive ? "adaptive" : "fixed") << ", mean wait " << meanWait()/1e3 << " ms (now " << lastWait()/1e3 << " ms), "
+                << "read every " << meanPeriod()/1e3 << " ms, "
+                << "occupancy " << 100.0*smoothed << "% (target " << 100.0*target << "%, max " << 100.0*peak << "%), "
+                << saturated << " saturated transfers" << std::endl;
+        }
+
+    protected:
+
+        const bool adaptive;
+        const uint64_t max_us;
+        const double target;
+
+        uint32_t capacity;
+        uint64_t interval; // current adaptive wait in us
+        double smoothed, peak;
+        uint64_t transfers, saturated, waited;
+        uint64_t first, last; // now_ns() of the first and latest reads
+};
+
+#endif
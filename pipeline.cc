@@ -0,0 +1,472 @@
+/**
+ *  Copyright 2014 by Benjamin Land (a.k.a. BenLand100)
+ *
+ *  acquire is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  acquire is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with acquire. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "pipeline.hh"
+#include "dpppsd.hh"
+
+#include <iostream>
+#include <thread>
+
+#include <unistd.h>
+
+using namespace std;
+
+// Receives events from DecodeAggregates and unpacks them straight into the
+// output blocks of the channels owned by one decode thread, or into one list
+// block for all of them if the board is in list mode.
+struct BlockSink {
+    Pipeline &pipeline;
+    Output *output; // the file being filled, which changes when the pipeline rotates
+    const size_t chunk_events, list_events;
+    uint32_t chmask; // channels still being stored by this thread
+    uint64_t time; // read time of the transfer being decoded
+    ListBlock *list; // NULL unless the board is in list mode
+    ThreadMetrics *metrics; // of the decode thread, in output's Telemetry
+    uint64_t events; // decoded so far
+    uint64_t latest; // largest time stamp decoded so far
+
+    BlockSink(Pipeline &pipeline, uint32_t chmask) : pipeline(pipeline), output(&pipeline.output), chunk_events(output->chunkEvents()), list_events(output->listEvents()), chmask(chmask), time(0), list(NULL), metrics(NULL), events(0), latest(0) { }
+
+    inline void operator()(const PSDEvent &ev) {
+        if (!(chmask & (1 << ev.ch))) return; // filled during this transfer
+
+        const int idx = output->index(pipeline.board,ev.ch);
+
+        const uint64_t stamp = pipeline.clocks[idx].extend(ev.timestamp,PSDTimeBits(ev.format)); // every event, to follow rollovers
+        if (stamp > latest) latest = stamp;
+        pipeline.timers[idx].event(stamp,ev);
+
+        Histogram *histogram = pipeline.histograms[idx];
+        if (histogram) {
+            histogram->fill(ev.qshort,ev.qlong);
+            const int prescale = output->prescale(idx);
+            if (!prescale || pipeline.grabbed[idx] % prescale) {
+                count(ev.ch,idx);
+                return;
+            }
+        }
+
+        if (list) {
+            if (!list->nevents) list->t_first = time;
+            ListRecord &record = list->records[list->nevents++];
+            record.time = stamp;
+            record.qshort = ev.qshort;
+            record.qlong = ev.qlong;
+            record.baseline = ev.baseline;
+            record.pur = ev.pur;
+            record.channel = ev.ch;
+            pipeline.stored[idx]++;
+            if (list->nevents == list_events) {
+                const uint64_t start = now_ns();
+                output->putListBlock(list);
+                list = output->getListBlock(pipeline.board);
+                metrics->time(METRIC_HANDOFF,start);
+            }
+            count(ev.ch,idx);
+            return;
+        }
+
+        const uint32_t nsamples = output->samples(idx);
+        EventBlock *&block = pipeline.blocks[idx];
+        if (!block->nevents) block->t_first = time;
+        const size_t i = block->nevents++;
+        const bool wave = output->waveform(idx,pipeline.stored[idx],ev.qlong);
+        if (block->waveform_rows) block->waveform_rows[i] = wave ? (int64_t)block->nwaves : -1;
+        const size_t w = wave ? block->nwaves++ : 0;
+        const ROIConfig *roi = output->roi(idx);
+        if (!wave) {
+            // the waveform is never unpacked
+        } else if (roi) {
+            // unpack after the samples kept so far (which leaves room for a whole trace), then keep the region of interest
+            uint16_t *dest = block->samples+block->nstored;
+            uint32_t begin = 0, end = 0;
+            if (ev.waveform) {
+                if (ev.nsamples != nsamples) throw runtime_error(output->group(idx) + " record length " + to_string(ev.nsamples) + " does not match " + to_string(nsamples));
+                UnpackSamples(ev,dest);
+                FindROI(*roi,dest,nsamples,ev.baseline,begin,end);
+                if (begin) memmove(dest,dest+begin,sizeof(uint16_t)*(end-begin));
+            }
+            block->offsets[w] = block->nstored;
+            block->roi_starts[w] = begin;
+            block->nstored += end-begin;
+        } else if (ev.waveform) {
+            if (ev.nsamples != nsamples) throw runtime_error(output->group(idx) + " record length " + to_string(ev.nsamples) + " does not match " + to_string(nsamples));
+            UnpackSamples(ev,block->samples+nsamples*w);
+        } else {
+            memset(block->samples+nsamples*w,0,sizeof(uint16_t)*nsamples);
+        }
+        block->baselines[i] = ev.baseline;
+        block->qshorts[i] = ev.qshort;
+        block->qlongs[i] = ev.qlong;
+        block->times[i] = stamp;
+        if (block->finetimes) block->finetimes[i] = ev.finetime;
+        if (pipeline.builder) pipeline.builder->push(idx,stamp,pipeline.stored[idx]);
+        pipeline.stored[idx]++;
+
+        if (block->nevents == chunk_events) {
+            const uint64_t start = now_ns();
+            output->putBlock(block);
+            block = output->getBlock(idx);
+            metrics->time(METRIC_HANDOFF,start);
+        }
+
+        count(ev.ch,idx);
+    }
+
+    // Counts a decoded event against the channel's quota
+    inline void count(uint32_t ch, size_t idx) {
+        events++;
+        if (++pipeline.grabbed[idx] == pipeline.quotas[idx]) {
+            chmask &= ~(1 << ch);
+            pipeline.finished |= 1 << ch;
+            pipeline.remaining--;
+            if (pipeline.builder) pipeline.builder->finish(idx);
+        }
+    }
+};
+
+Pipeline::Pipeline(Backend &dgtz, Output &output, uint32_t board, int ngrabs, int nbuffers, int ndecoders, const ReadoutPacer &pacer) :
+    dgtz(dgtz), output(output), board(board), ngrabs(ngrabs), nbuffers(nbuffers), ndecoders(ndecoders), pacer(pacer),
+    buffers(nbuffers), pool(pow2ceil(nbuffers)) {
+
+    if (nbuffers < 1 || ndecoders < 1) throw runtime_error("readout_buffers and decode_threads must be positive");
+
+    for (size_t idx = 0; idx < output.size(); idx++) {
+        if (output.board(idx) == board) owned.push_back(idx);
+    }
+
+    uint32_t size;
+    for (int i = 0; i < nbuffers; i++) {
+        buffers[i].data = dgtz.allocBuffer(size);
+        pool.push(&buffers[i]);
+    }
+    this->pacer.reset(size);
+    for (int i = 0; i < ndecoders; i++) {
+        queues.push_back(new BoundedQueue<Transfer*>(pow2ceil(nbuffers+1))); // room for every buffer plus the end marker
+    }
+
+    builder = NULL;
+    transfers = bytes = pool_stalls = max_depth = 0;
+    outside_ns = 0;
+    idle_polls = 0;
+    failed = false;
+    stopping = false;
+    done = false;
+    next_output = &output;
+    attached = lagging = 0;
+}
+
+Pipeline::~Pipeline() {
+    if (reader.joinable()) {
+        failed = true; // unwinding without finish(), so stop everything
+        reader.join();
+        for (size_t i = 0; i < decoders.size(); i++) decoders[i].join();
+    }
+    for (int i = 0; i < ndecoders; i++) {
+        delete queues[i];
+    }
+    for (int i = 0; i < nbuffers; i++) {
+        dgtz.freeBuffer(buffers[i].data);
+    }
+}
+
+void Pipeline::start() {
+    blocks.assign(output.size(),NULL);
+    histograms.assign(output.size(),NULL);
+    for (size_t i = 0; i < owned.size(); i++) {
+        if (builder && !output.prescale(owned[i])) builder->finish(owned[i]); // never has hits, so never wait on it
+    }
+    quotas.assign(output.size(),UINT64_MAX);
+    for (size_t i = 0; i < owned.size(); i++) {
+        const int quota = output.quota(owned[i]);
+        quotas[owned[i]] = quota > 0 ? quota : (ngrabs > 0 ? ngrabs : UINT64_MAX);
+    }
+    grabbed.assign(output.size(),0);
+    stored.assign(output.size(),0);
+    clocks.assign(output.size(),TimeExtender());
+    timers.assign(output.size(),DeadTimer());
+    remaining = owned.size();
+    finished = 0;
+    disabled = 0;
+    taken_events = clock_ns = 0;
+    stopping = false;
+    done = false;
+    next_output = &output;
+    attached = ndecoders;
+    lagging = 0;
+
+    dgtz.disable(0); // channels an earlier cycle switched off at their quota
+    dgtz.start();
+
+    for (int i = 0; i < ndecoders; i++) {
+        decoders.push_back(thread(&Pipeline::decode,this,i));
+    }
+    reader = thread(&Pipeline::readout,this);
+}
+
+void Pipeline::rotate(Output &next) {
+    if (builder) throw runtime_error("Cannot rotate the output of a pipeline building events");
+    lock_guard<mutex> lock(rotation);
+    if (lagging) throw runtime_error("Previous rotation has not finished");
+    lagging = attached;
+    next_output = &next;
+}
+
+bool Pipeline::rotated() {
+    lock_guard<mutex> lock(rotation);
+    return !lagging;
+}
+
+void Pipeline::finish() {
+    reader.join();
+    for (size_t i = 0; i < decoders.size(); i++) {
+        decoders[i].join();
+    }
+    decoders.clear();
+
+    if (failed) throw runtime_error(error);
+}
+
+void Pipeline::report(ostream &out) const {
+    uint64_t rollovers = 0;
+    for (size_t i = 0; i < owned.size() && owned[i] < clocks.size(); i++) rollovers += clocks[owned[i]].count();
+    out << "Readout: " << transfers << " transfers, " << bytes << " bytes, "
+        << "max queue depth " << max_depth << "/" << nbuffers << ", "
+        << pool_stalls << " readout stalls, "
+        << outside_ns*1e-9 << " s outside reads, "
+        << idle_polls << " idle decode polls, "
+        << rollovers << " time tag rollovers, "
+        << __builtin_popcount(disabled) << " channels switched off at their quota" << endl;
+    pacer.report(out);
+}
+
+// Moves raw transfers from the digitizer into pooled buffers and hands them to
+// the decode threads until every channel has enough events, then stops the
+// board and tells the decode threads the cycle is over.
+void Pipeline::readout() {
+    readloop();
+    try {
+        dgtz.stop();
+    } catch (runtime_error &e) {
+        error = e.what();
+        failed = true;
+    }
+    for (int i = 0; i < ndecoders; i++) {
+        while (!queues[i]->push(NULL)) usleep(100);
+    }
+    done = true;
+}
+
+void Pipeline::readloop() {
+    Output *target = &output; // stamped on each transfer
+    uint64_t last_read = 0; // now_ns() when the previous read returned
+    ThreadMetrics *metrics = output.telemetry().thread();
+    TraceThread("board " + to_string(board) + " readout");
+    try {
+        while (remaining > 0 && !failed && !stopping && !dgtz.finished()) {
+
+            bool moved = false;
+            Output *next = next_output;
+            if (next != target) {
+                metrics->publish(true);
+                target = next;
+                metrics = target->telemetry().thread();
+                moved = true; // even if it is empty, the next transfer tells the decode threads to move
+            }
+
+            // channels that have their events stop using the link, while the rest keep going
+            const uint32_t off = finished;
+            if (off != disabled && remaining > 0) {
+                dgtz.disable(off);
+                disabled = off;
+            }
+
+            Transfer *transfer;
+            if (!pool.pop(transfer)) {
+                pool_stalls++;
+                while (!pool.pop(transfer)) {
+                    if (failed) return;
+                    usleep(100);
+                }
+            }
+
+            const uint64_t start = now_ns();
+            const uint64_t outside = last_read ? start-last_read : 0; // the board fills up unread meanwhile
+            if (outside) {
+                outside_ns += outside;
+                metrics->count(METRIC_OUTSIDE,outside);
+            }
+            const bool board_full = dgtz.full(); // before the read drains the board's memory
+            if (board_full) metrics->count(METRIC_BOARD_FULL);
+            dgtz.read(transfer->data, transfer->size);
+            transfer->time = last_read = now_ns();
+            transfer->output = target;
+            metrics->time(METRIC_READ,start);
+            metrics->publish();
+
+            const uint64_t saturated = pacer.saturatedTransfers();
+            const uint64_t wait = pacer.next(transfer->size);
+            const bool filled = pacer.saturatedTransfers() != saturated;
+            if (filled) metrics->count(METRIC_SATURATED);
+            target->readout(board,board_full,filled,outside);
+            if (wait) {
+                const uint64_t begin = now_ns();
+                if (!dgtz.wait(wait)) usleep(wait);
+                TraceEvent("wait",begin,now_ns());
+            }
+
+            if (!transfer->size && !moved) {
+                pool.push(transfer);
+                continue;
+            }
+
+            transfers++;
+            bytes += transfer->size;
+            metrics->count(METRIC_TRANSFERS);
+            metrics->count(METRIC_BYTES,transfer->size);
+            metrics->local.transfer_bytes.record(transfer->size);
+            transfer->events = 0;
+            transfer->pending = ndecoders;
+            for (int i = 0; i < ndecoders; i++) {
+                queues[i]->push(transfer); // queues are sized to hold the whole pool
+                max_depth = max(max_depth,queues[i]->depth());
+            }
+        }
+    } catch (runtime_error &e) {
+        error = e.what();
+        failed = true;
+    }
+    metrics->publish(true);
+}
+
+
+// Decodes every transfer in its queue, but only stores every ndecoders-th channel of the
+// board starting at id, so that each channel is written by exactly one thread in transfer order.
+// When transfers arrive for another Output (the pipeline rotated) the thread's channels move
+// to it between two transfers.
+void Pipeline::decode(size_t id) {
+    TraceThread("board " + to_string(board) + " decode " + to_string(id));
+    uint32_t chmask = 0;
+    for (size_t i = id; i < owned.size(); i += ndecoders) {
+        chmask |= 1 << output.channel(owned[i]);
+    }
+    BlockSink sink(*this,chmask);
+    try {
+        BoundedQueue<Transfer*> &queue = *queues[id];
+
+        attach(id,sink,&output);
+
+        const uint64_t interval = output.flushInterval()*1e9;
+        uint64_t last_snapshot = now_ns();
+
+        for (;;) {
+            Transfer *transfer;
+            if (!queue.pop(transfer)) {
+                idle_polls++;
+                usleep(100);
+                continue;
+            }
+            if (!transfer) break; // end of cycle
+
+            if (transfer->output != sink.output) {
+                detach(id,sink);
+                attach(id,sink,transfer->output);
+                lock_guard<mutex> lock(rotation);
+                lagging--;
+            }
+
+            if (sink.chmask) {
+                sink.time = transfer->time;
+                const uint64_t start = now_ns(), before = sink.events, lost = this->lost(id);
+                DecodeAggregates(transfer->data, transfer->size, sink.chmask, sink); //walks the raw buffer, unpacking events directly into blocks
+                sink.metrics->time(METRIC_DECODE,start);
+                sink.metrics->count(METRIC_EVENTS,sink.events-before);
+                sink.metrics->count(METRIC_LOST,this->lost(id)-lost);
+                transfer->events += sink.events-before;
+                taken_events += sink.events-before;
+                const uint64_t ns = sink.latest*sink.output->tick(owned[id]); // every channel of a board counts the same clock
+                for (uint64_t last = clock_ns; ns > last && !clock_ns.compare_exchange_weak(last,ns); ) { }
+            }
+
+            const uint64_t time = transfer->time;
+            if (--transfer->pending == 0) {
+                sink.metrics->local.transfer_events.record(transfer->events); // the last thread done with it
+                pool.push(transfer);
+            }
+            sink.metrics->publish();
+
+            if (time >= last_snapshot + interval) {
+                snapshot(id,*sink.output,false);
+                last_snapshot = time;
+            }
+        }
+
+        detach(id,sink);
+        for (size_t i = id; i < owned.size(); i += ndecoders) {
+            if (builder) builder->finish(owned[i]);
+        }
+    } catch (runtime_error &e) {
+        error = e.what();
+        failed = true;
+    }
+    if (sink.metrics) sink.metrics->publish(true);
+
+    // a rotation this thread never saw does not wait on it
+    lock_guard<mutex> lock(rotation);
+    attached--;
+    if (lagging && sink.output != next_output) lagging--;
+}
+
+void Pipeline::attach(size_t id, BlockSink &sink, Output *out) {
+    sink.output = out;
+    sink.metrics = out->telemetry().thread();
+    if (out->list(board)) sink.list = out->getListBlock(board);
+    for (size_t i = id; i < owned.size(); i += ndecoders) {
+        const size_t idx = owned[i];
+        if (!out->list(board)) blocks[idx] = out->getBlock(idx);
+        if (out->histogram(idx)) histograms[idx] = out->getHistogram(idx);
+        stored[idx] = 0;
+        timers[idx].reset();
+    }
+}
+
+void Pipeline::detach(size_t id, BlockSink &sink) {
+    snapshot(id,*sink.output,true);
+    if (sink.list) sink.output->putListBlock(sink.list); // partially filled tail of the board
+    sink.list = NULL;
+    for (size_t i = id; i < owned.size(); i += ndecoders) {
+        if (blocks[owned[i]]) sink.output->putBlock(blocks[owned[i]]); // partially filled tail of each channel
+        blocks[owned[i]] = NULL;
+        sink.output->account(owned[i],timers[owned[i]].stretch());
+    }
+    sink.metrics->publish(true);
+}
+
+uint64_t Pipeline::lost(size_t id) const {
+    uint64_t total = 0;
+    for (size_t i = id; i < owned.size(); i += ndecoders) total += timers[owned[i]].lostEvents();
+    return total;
+}
+
+void Pipeline::snapshot(size_t id, Output &out, bool last) {
+    for (size_t i = id; i < owned.size(); i += ndecoders) {
+        Histogram *&histogram = histograms[owned[i]];
+        if (!histogram) continue;
+        out.putHistogram(histogram);
+        histogram = last ? NULL : out.getHistogram(owned[i]);
+    }
+}
@@ -0,0 +1,170 @@
+/**
+ *  Copyright 2014 by Benjamin Land (a.k.a. BenLand100)
+ *
+ *  acquire is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  acquire is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with acquire. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __PIPELINE__HH
+#define __PIPELINE__HH
+
+#include "backend.hh"
+#include "output.hh"
+#include "queue.hh"
+#include "dpppsd.hh"
+#include "eventbuilder.hh"
+#include "pacing.hh"
+
+#include <atomic>
+#include <thread>
+#include <mutex>
+
+// Raw transfer from the digitizer, shared by every decode thread
+typedef struct {
+    char *data; // allocated by Backend::allocBuffer
+    uint32_t size;
+    uint64_t time; // now_ns() when the read completed
+    std::atomic<int> pending; // decode threads that have not yet released this buffer
+    std::atomic<uint32_t> events; // decoded from it so far, by every decode thread
+    Output *output; // where its events go
+} Transfer;
+
+struct BlockSink;
+
+//The acquisition pipeline of one board for one cycle: a readout thread reads
+//transfers into a pool of reusable buffers and hands them to decode threads
+//through bounded lock-free queues. Each decode thread owns a subset of the
+//board's output channels so every channel is filled by a single thread in
+//transfer order, and hands full EventBlocks to the Output, which may be
+//shared with the pipelines of other boards. The Output can be replaced while
+//the board runs (rotate), switching files between two transfers.
+class Pipeline {
+
+    friend struct BlockSink;
+
+    public:
+
+        // Allocates nbuffers readout buffers from the backend, which is board (index into the Output's settings).
+        // Transfers are paced by a copy of pacer. Each channel takes its quota (Output::quota) or ngrabs
+        // events and is then switched off on the board; ngrabs <= 0 leaves channels without a quota
+        // taking events until stop().
+        Pipeline(Backend &dgtz, Output &output, uint32_t board, int ngrabs, int nbuffers, int ndecoders, const ReadoutPacer &pacer);
+
+        // Frees the readout buffers
+        ~Pipeline();
+
+        // Starts the board and the readout and decode threads, which run until every
+        // channel of the board has its events (or stop), then stop the board
+        void start();
+
+        // Ends the cycle after the transfer being read
+        inline void stop() { stopping = true; }
+
+        // Whether the readout has ended (finish will not wait on the board)
+        inline bool stopped() const { return done; }
+
+        // Sends every transfer read from now on to next, an Output with the same settings, without
+        // stopping the board. The blocks and histograms filled so far go to the current Output.
+        // Not with an EventBuilder.
+        void rotate(Output &next);
+
+        // Whether every decode thread has moved to the Output of the last rotate (or ended),
+        // after which the one before can be closed
+        bool rotated();
+
+        // Waits for readout and decoding to finish. Throws if any stage failed.
+        void finish();
+
+        // start() then finish()
+        inline void run() { start(); finish(); }
+
+        // Prints the readout and pacing counters
+        void report(std::ostream &out) const;
+
+        // Events taken from the board so far, over every channel
+        inline uint64_t taken() const { return taken_events; }
+
+        // Seconds of the board's clock covered by the events decoded so far
+        inline double clockTime() const { return clock_ns*1e-9; }
+
+        // Pacing of the readout (valid after finish)
+        inline const ReadoutPacer& pacing() const { return pacer; }
+
+        // receives every stored hit if not NULL
+        EventBuilder *builder;
+
+        // readout counters
+        size_t transfers, bytes;
+        size_t pool_stalls; // readout had no free buffer because decoding fell behind
+        uint64_t outside_ns; // readout time spent outside Backend::read
+        size_t max_depth; // deepest decode queue seen after a push
+        std::atomic<size_t> idle_polls; // decode threads found nothing to do
+
+    protected:
+
+        void readout();
+
+        void readloop();
+
+        void decode(size_t id);
+
+        // Hands the histograms of the channels decoded by thread id to out and starts new ones
+        void snapshot(size_t id, Output &out, bool last);
+
+        // Points the channels of decode thread id at out, taking their first blocks and histograms
+        void attach(size_t id, BlockSink &sink, Output *out);
+
+        // Hands what decode thread id has filled to its Output
+        void detach(size_t id, BlockSink &sink);
+
+        // Events lost by the channels of decode thread id in their current stretch
+        uint64_t lost(size_t id) const;
+
+        Backend &dgtz;
+        Output &output; // the first Output, which every later one is laid out like
+        const uint32_t board;
+        const int ngrabs;
+        const int nbuffers, ndecoders;
+
+        ReadoutPacer pacer; // only touched by the readout thread
+
+        std::vector<size_t> owned; // output channels of this board
+
+        std::thread reader;
+        std::vector<std::thread> decoders;
+
+        std::vector<Transfer> buffers;
+        BoundedQueue<Transfer*> pool; // empty buffers ready for readout
+        std::vector<BoundedQueue<Transfer*>*> queues; // filled buffers, one queue per decode thread
+
+        std::vector<EventBlock*> blocks; // block being filled per output channel (of this board)
+        std::vector<Histogram*> histograms; // histogram being filled per output channel, NULL if it has none
+        std::vector<uint64_t> quotas; // events to take per output channel
+        std::vector<uint64_t> grabbed; // each element only touched by the owning decode thread
+        std::vector<uint64_t> stored; // events kept in each channel's datasets, likewise
+        std::vector<TimeExtender> clocks; // time stamp rollovers per output channel, likewise
+        std::vector<DeadTimer> timers; // dead time per output channel, likewise
+        std::atomic<int> remaining; // channels that have not reached their quota
+        std::atomic<uint32_t> finished; // board channels that have, for the readout to switch off
+        uint32_t disabled; // board channels switched off, only touched by the readout thread
+        std::atomic<uint64_t> taken_events, clock_ns; // totals of the decode threads
+
+        std::atomic<bool> failed, stopping, done;
+        std::string error;
+
+        std::atomic<Output*> next_output; // where the readout sends transfers
+        std::mutex rotation; // guards attached and lagging
+        int attached, lagging; // decode threads running, and those yet to move to next_output
+};
+
+#endif
@@ -0,0 +1,254 @@
+/**
+ *  Copyright 2014 by Benjamin Land (a.k.a. BenLand100)
+ *
+ *  acquire is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  acquire is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with acquire. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "psd.hh"
+
+#include <algorithm>
+#include <stdexcept>
+
+#include <immintrin.h>
+
+using namespace std;
+
+/* Each kernel only differs in how it sums and finds the extremes of a run of
+ * samples; everything per event is integer arithmetic done the same way, so
+ * the kernels agree exactly. The event loop is a macro so that each copy is
+ * compiled with its own target and the range helpers inline into it.
+ */
+
+#define PSD_EVENT_LOOP(sum,minmax) \
+    for (size_t ev = 0; ev < nevents; ev++) { \
+        const uint16_t *trace = samples + ev*nsamples; \
+        const uint32_t nbl = g.baseline_samples; \
+        const uint32_t baseline = nbl ? sum(trace,nbl)/nbl : 0; \
+        const uint32_t sshort = sum(trace+g.gate_start,g.shortgate); \
+        const uint32_t slong = sum(trace+g.gate_start,g.longgate); \
+        uint16_t lo = 0xFFFF, hi = 0; \
+        minmax(trace+g.gate_start,g.longgate,lo,hi); \
+        int32_t qshort = (int32_t)sshort - (int32_t)(baseline*g.shortgate); \
+        int32_t qlong = (int32_t)slong - (int32_t)(baseline*g.longgate); \
+        int32_t peak = g.longgate ? (int32_t)hi - (int32_t)baseline : 0; \
+        if (g.negative) { \
+            qshort = -qshort; \
+            qlong = -qlong; \
+            peak = g.longgate ? (int32_t)baseline - (int32_t)lo : 0; \
+        } \
+        results.baselines[ev] = baseline; \
+        results.qshorts[ev] = qshort; \
+        results.qlongs[ev] = qlong; \
+        results.tails[ev] = qlong ? (float)(qlong-qshort)/(float)qlong : 0.0f; \
+        results.peaks[ev] = peak > 0 ? (peak < 0xFFFF ? peak : 0xFFFF) : 0; \
+    }
+
+static inline uint32_t sum_scalar(const uint16_t *p, size_t n) {
+    uint32_t s = 0;
+    for (size_t i = 0; i < n; i++) s += p[i];
+    return s;
+}
+
+static inline void minmax_scalar(const uint16_t *p, size_t n, uint16_t &lo, uint16_t &hi) {
+    for (size_t i = 0; i < n; i++) {
+        lo = min(lo,p[i]);
+        hi = max(hi,p[i]);
+    }
+}
+
+static void psd_scalar(const PSDGates &g, const uint16_t *samples, size_t nevents, uint32_t nsamples, PSDResults &results) {
+    PSD_EVENT_LOOP(sum_scalar,minmax_scalar)
+}
+
+__attribute__((target("avx2")))
+static inline uint32_t sum_avx2(const uint16_t *p, size_t n) {
+    const __m256i ones = _mm256_set1_epi16(1);
+    __m256i acc = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        acc = _mm256_add_epi32(acc,_mm256_madd_epi16(_mm256_loadu_si256((const __m256i*)(p+i)),ones));
+    }
+    __m128i s = _mm_add_epi32(_mm256_castsi256_si128(acc),_mm256_extracti128_si256(acc,1));
+    s = _mm_add_epi32(s,_mm_shuffle_epi32(s,_MM_SHUFFLE(1,0,3,2)));
+    s = _mm_add_epi32(s,_mm_shuffle_epi32(s,_MM_SHUFFLE(2,3,0,1)));
+    uint32_t total = _mm_cvtsi128_si32(s);
+    for (; i < n; i++) total += p[i];
+    return total;
+}
+
+__attribute__((target("avx2")))
+static inline void minmax_avx2(const uint16_t *p, size_t n, uint16_t &lo, uint16_t &hi) {
+    size_t i = 0;
+    if (n >= 16) {
+        __m256i vlo = _mm256_set1_epi16((short)0xFFFF), vhi = _mm256_setzero_si256();
+        for (; i + 16 <= n; i += 16) {
+            const __m256i v = _mm256_loadu_si256((const __m256i*)(p+i));
+            vlo = _mm256_min_epu16(vlo,v);
+            vhi = _mm256_max_epu16(vhi,v);
+        }
+        __m128i l = _mm_min_epu16(_mm256_castsi256_si128(vlo),_mm256_extracti128_si256(vlo,1));
+        __m128i h = _mm_max_epu16(_mm256_castsi256_si128(vhi),_mm256_extracti128_si256(vhi,1));
+        lo = min<uint16_t>(lo,_mm_extract_epi16(_mm_minpos_epu16(l),0));
+        // minpos of the complement finds the maximum
+        hi = max<uint16_t>(hi,0xFFFF - _mm_extract_epi16(_mm_minpos_epu16(_mm_xor_si128(h,_mm_set1_epi16((short)0xFFFF))),0));
+    }
+    for (; i < n; i++) {
+        lo = min(lo,p[i]);
+        hi = max(hi,p[i]);
+    }
+}
+
+__attribute__((target("avx2")))
+static void psd_avx2(const PSDGates &g, const uint16_t *samples, size_t nevents, uint32_t nsamples, PSDResults &results) {
+    PSD_EVENT_LOOP(sum_avx2,minmax_avx2)
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static inline uint32_t sum_avx512(const uint16_t *p, size_t n) {
+    const __m512i ones = _mm512_set1_epi16(1);
+    __m512i acc = _mm512_setzero_si512();
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        acc = _mm512_add_epi32(acc,_mm512_madd_epi16(_mm512_loadu_si512((const void*)(p+i)),ones));
+    }
+    if (i < n) {
+        const __mmask32 tail = (__mmask32)((1ull << (n-i)) - 1);
+        acc = _mm512_add_epi32(acc,_mm512_madd_epi16(_mm512_maskz_loadu_epi16(tail,p+i),ones));
+    }
+    return _mm512_reduce_add_epi32(acc);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static inline void minmax_avx512(const uint16_t *p, size_t n, uint16_t &lo, uint16_t &hi) {
+    __m512i vlo = _mm512_set1_epi16((short)0xFFFF), vhi = _mm512_setzero_si512();
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        const __m512i v = _mm512_loadu_si512((const void*)(p+i));
+        vlo = _mm512_min_epu16(vlo,v);
+        vhi = _mm512_max_epu16(vhi,v);
+    }
+    if (i < n) {
+        // masked lanes load as 0 (harmless for the max) or keep 0xFFFF (harmless for the min)
+        const __mmask32 tail = (__mmask32)((1ull << (n-i)) - 1);
+        vlo = _mm512_mask_min_epu16(vlo,tail,vlo,_mm512_maskz_loadu_epi16(tail,p+i));
+        vhi = _mm512_max_epu16(vhi,_mm512_maskz_loadu_epi16(tail,p+i));
+    }
+    __m256i l = _mm256_min_epu16(_mm512_castsi512_si256(vlo),_mm512_extracti64x4_epi64(vlo,1));
+    __m256i h = _mm256_max_epu16(_mm512_castsi512_si256(vhi),_mm512_extracti64x4_epi64(vhi,1));
+    __m128i l2 = _mm_min_epu16(_mm256_castsi256_si128(l),_mm256_extracti128_si256(l,1));
+    __m128i h2 = _mm_max_epu16(_mm256_castsi256_si128(h),_mm256_extracti128_si256(h,1));
+    lo = min<uint16_t>(lo,_mm_extract_epi16(_mm_minpos_epu16(l2),0));
+    hi = max<uint16_t>(hi,0xFFFF - _mm_extract_epi16(_mm_minpos_epu16(_mm_xor_si128(h2,_mm_set1_epi16((short)0xFFFF))),0));
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void psd_avx512(const PSDGates &g, const uint16_t *samples, size_t nevents, uint32_t nsamples, PSDResults &results) {
+    PSD_EVENT_LOOP(sum_avx512,minmax_avx512)
+}
+
+PSDGates GatesFromConfig(const ChannelConfig &config) {
+    PSDGates gates;
+    const uint32_t trigger = config.presamples;
+    gates.gate_start = trigger > (uint32_t)config.pregate ? trigger - config.pregate : 0;
+    gates.baseline_samples = min<uint32_t>(4u << min(config.baseline,5),gates.gate_start); // baseline_flag choices are 4..128 samples
+    gates.shortgate = config.shortgate;
+    gates.longgate = config.longgate;
+    gates.negative = config.pulsepol == CAEN_DGTZ_PulsePolarityNegative;
+    return gates;
+}
+
+ROIConfig ROIFromConfig(const ChannelConfig &config) {
+    ROIConfig roi;
+    roi.threshold = config.zs_threshold;
+    roi.pad = config.zs_pad;
+    roi.baseline_samples = max<uint32_t>(GatesFromConfig(config).baseline_samples,1);
+    roi.negative = config.pulsepol == CAEN_DGTZ_PulsePolarityNegative;
+    return roi;
+}
+
+void FindROI(const ROIConfig &roi, const uint16_t *trace, uint32_t nsamples, uint16_t baseline, uint32_t &begin, uint32_t &end) {
+    int base = baseline;
+    if (!base) {
+        const uint32_t n = min(roi.baseline_samples,nsamples);
+        uint32_t sum = 0;
+        for (uint32_t i = 0; i < n; i++) sum += trace[i];
+        base = n ? sum/n : 0;
+    }
+    // the pulse is usually near the trigger, so scan in from both ends and stop at it
+    const int low = base - roi.threshold, high = base + roi.threshold;
+    uint32_t first = 0, last = nsamples;
+    if (roi.negative) {
+        while (first < nsamples && trace[first] >= low) first++;
+        while (last > first && trace[last-1] >= low) last--;
+    } else {
+        while (first < nsamples && trace[first] <= high) first++;
+        while (last > first && trace[last-1] <= high) last--;
+    }
+    if (first == last) {
+        begin = end = 0;
+        return;
+    }
+    begin = first > roi.pad ? first - roi.pad : 0;
+    end = min(last + roi.pad, nsamples);
+}
+
+bool PSDKernelSupported(PSDKernel kernel) {
+    switch (kernel) {
+        case PSD_KERNEL_BEST:
+        case PSD_KERNEL_SCALAR:
+            return true;
+        case PSD_KERNEL_AVX2:
+            return __builtin_cpu_supports("avx2");
+        case PSD_KERNEL_AVX512:
+            return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+    }
+    return false;
+}
+
+const char* PSDKernelName(PSDKernel kernel) {
+    switch (kernel) {
+        case PSD_KERNEL_BEST: return "best";
+        case PSD_KERNEL_SCALAR: return "scalar";
+        case PSD_KERNEL_AVX2: return "avx2";
+        case PSD_KERNEL_AVX512: return "avx512";
+    }
+    return "unknown";
+}
+
+void ComputePSD(const PSDGates &gates, const uint16_t *samples, size_t nevents, uint32_t nsamples, PSDResults &results, PSDKernel kernel) {
+    if (kernel == PSD_KERNEL_BEST) {
+        static const PSDKernel best = PSDKernelSupported(PSD_KERNEL_AVX512) ? PSD_KERNEL_AVX512 : PSDKernelSupported(PSD_KERNEL_AVX2) ? PSD_KERNEL_AVX2 : PSD_KERNEL_SCALAR;
+        kernel = best;
+    } else if (!PSDKernelSupported(kernel)) {
+        throw runtime_error(string("PSD kernel ") + PSDKernelName(kernel) + " is not supported on this CPU");
+    }
+
+    // clip the gates to the trace once so the kernels never check bounds
+    PSDGates g = gates;
+    g.baseline_samples = min(g.baseline_samples,nsamples);
+    g.gate_start = min(g.gate_start,nsamples);
+    g.shortgate = min(g.shortgate,nsamples-g.gate_start);
+    g.longgate = min(g.longgate,nsamples-g.gate_start);
+
+    switch (kernel) {
+        case PSD_KERNEL_AVX512:
+            psd_avx512(g,samples,nevents,nsamples,results);
+            break;
+        case PSD_KERNEL_AVX2:
+            psd_avx2(g,samples,nevents,nsamples,results);
+            break;
+        default:
+            psd_scalar(g,samples,nevents,nsamples,results);
+    }
+}
@@ -0,0 +1,78 @@
+/**
+ *  Copyright 2014 by Benjamin Land (a.k.a. BenLand100)
+ *
+ *  acquire is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  acquire is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with acquire. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __PSD__HH
+#define __PSD__HH
+
+#include "digitizer.hh"
+
+#include <cstdint>
+#include <cstddef>
+
+// Where the software PSD looks in each trace (all in samples)
+typedef struct {
+    uint32_t baseline_samples; // averaged from the start of the trace for the baseline
+    uint32_t gate_start; // first sample integrated
+    uint32_t shortgate, longgate; // samples integrated from gate_start
+    bool negative; // pulses go below the baseline
+} PSDGates;
+
+// Per-event results, one array element per event
+typedef struct {
+    uint16_t *baselines; // mean of the baseline samples (rounded down)
+    int32_t *qshorts, *qlongs; // baseline subtracted integrals over each gate, positive for pulses
+    float *tails; // (qlong-qshort)/qlong, 0 if qlong is 0
+    uint16_t *peaks; // largest excursion from the baseline within the long gate
+} PSDResults;
+
+// Implementations of ComputePSD; every one gives bit-identical results
+enum PSDKernel {
+    PSD_KERNEL_BEST, // the fastest one this CPU supports
+    PSD_KERNEL_SCALAR,
+    PSD_KERNEL_AVX2,
+    PSD_KERNEL_AVX512
+};
+
+// Gates matching what a channel was programmed with: baseline_flag samples before the gate, which opens pregate samples before the trigger
+PSDGates GatesFromConfig(const ChannelConfig &config);
+
+// Where zero suppression keeps samples of a trace
+typedef struct {
+    int threshold; // excursion from the baseline that marks a pulse
+    uint32_t pad; // samples kept before the first and after the last excursion
+    uint32_t baseline_samples; // averaged from the start of the trace when the board gives no baseline
+    bool negative; // pulses go below the baseline
+} ROIConfig;
+
+// Zero suppression of a channel (zs_threshold, zs_pad), with the baseline samples of its gates
+ROIConfig ROIFromConfig(const ChannelConfig &config);
+
+// Sets [begin,end) to the samples of a trace within pad of an excursion past threshold, or
+// begin == end if there is none. baseline is the board's (0 to average baseline_samples instead).
+void FindROI(const ROIConfig &roi, const uint16_t *trace, uint32_t nsamples, uint16_t baseline, uint32_t &begin, uint32_t &end);
+
+// True if kernel can run on this CPU
+bool PSDKernelSupported(PSDKernel kernel);
+
+const char* PSDKernelName(PSDKernel kernel);
+
+// Computes baselines, short and long integrals, tail fractions and peaks for nevents
+// traces of nsamples stored back to back (as in the samples datasets). Samples must
+// be below 32768, which holds for every 14 bit digitizer. Gates are clipped to nsamples.
+void ComputePSD(const PSDGates &gates, const uint16_t *samples, size_t nevents, uint32_t nsamples, PSDResults &results, PSDKernel kernel = PSD_KERNEL_BEST);
+
+#endif
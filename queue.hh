@@ -0,0 +1,119 @@
+/**
+ *  Copyright 2014 by Benjamin Land (a.k.a. BenLand100)
+ *
+ *  acquire is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  acquire is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with acquire. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __QUEUE__HH
+#define __QUEUE__HH
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+
+//Bounded lock-free multi-producer multi-consumer queue (Vyukov style). Each
+//slot carries a sequence number that tells producers and consumers whether it
+//is free to write or ready to read, so no thread ever blocks another.
+template <typename T> class BoundedQueue {
+
+    public:
+
+        // Capacity must be a power of two
+        BoundedQueue(size_t capacity) : mask(capacity-1), slots(new Slot[capacity]), head(0), tail(0) {
+            if (capacity < 2 || (capacity & mask)) throw std::runtime_error("BoundedQueue capacity must be a power of two");
+            for (size_t i = 0; i < capacity; i++) slots[i].seq.store(i,std::memory_order_relaxed);
+        }
+
+        ~BoundedQueue() { delete [] slots; }
+
+        // Returns false if the queue is full
+        bool push(const T &value) {
+            size_t pos = tail.load(std::memory_order_relaxed);
+            for (;;) {
+                Slot &slot = slots[pos & mask];
+                const size_t seq = slot.seq.load(std::memory_order_acquire);
+                const intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+                if (diff == 0) {
+                    if (tail.compare_exchange_weak(pos,pos+1,std::memory_order_relaxed)) {
+                        slot.value = value;
+                        slot.seq.store(pos+1,std::memory_order_release);
+                        return true;
+                    }
+                } else if (diff < 0) {
+                    return false;
+                } else {
+                    pos = tail.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        // Returns false if the queue is empty
+        bool pop(T &value) {
+            size_t pos = head.load(std::memory_order_relaxed);
+            for (;;) {
+                Slot &slot = slots[pos & mask];
+                const size_t seq = slot.seq.load(std::memory_order_acquire);
+                const intptr_t diff = (intptr_t)seq - (intptr_t)(pos+1);
+                if (diff == 0) {
+                    if (head.compare_exchange_weak(pos,pos+1,std::memory_order_relaxed)) {
+                        value = slot.value;
+                        slot.seq.store(pos+mask+1,std::memory_order_release);
+                        return true;
+                    }
+                } else if (diff < 0) {
+                    return false;
+                } else {
+                    pos = head.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        // Approximate number of queued elements (exact when quiescent)
+        inline size_t depth() const {
+            const size_t t = tail.load(std::memory_order_relaxed), h = head.load(std::memory_order_relaxed);
+            return t > h ? t - h : 0;
+        }
+
+        inline size_t capacity() const { return mask+1; }
+
+    protected:
+
+        struct Slot {
+            std::atomic<size_t> seq;
+            T value;
+        };
+
+        BoundedQueue(const BoundedQueue &other);
+        BoundedQueue& operator=(const BoundedQueue &other);
+
+        const size_t mask;
+        Slot *slots;
+
+        // head and tail padded onto separate cache lines to avoid false sharing
+        char pad0[64];
+        std::atomic<size_t> head;
+        char pad1[64];
+        std::atomic<size_t> tail;
+        char pad2[64];
+};
+
+// Smallest power of two not less than n (for sizing BoundedQueues)
+inline size_t pow2ceil(size_t n) {
+    size_t p = 2;
+    while (p < n) p <<= 1;
+    return p;
+}
+
+#endif
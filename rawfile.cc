@@ -0,0 +1,330 @@
+/**
+ *  Copyright 2014 by Benjamin Land (a.k.a. BenLand100)
+ *
+ *  acquire is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  acquire is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with acquire. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "rawfile.hh"
+#include "dpppsd.hh"
+#include "latency.hh"
+
+#include <iostream>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std;
+
+static const char raw_magic[8] = {'A','C','Q','R','A','W','\n',0};
+
+static inline size_t align_up(size_t n, size_t align) {
+    return (n + align - 1) / align * align;
+}
+
+RawWriter::RawWriter(const string &fname, Settings &settings, int board, uint32_t buffer_size, size_t chunk_bytes, size_t nchunks, size_t prealloc_bytes) :
+    odirect(true), chunk_bytes(align_up(max<size_t>(chunk_bytes,1),raw_align)), prealloc_bytes(prealloc_bytes), length(0), current(NULL) {
+
+    if (nchunks < 2) throw runtime_error("raw_buffers must be at least 2");
+
+    fd = ::open(fname.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+    if (fd < 0 && errno == EINVAL) {
+        odirect = false; // e.g. tmpfs
+        fd = ::open(fname.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+    if (fd < 0) throw runtime_error("Could not create " + fname + ": " + strerror(errno));
+
+    chunks.resize(nchunks);
+    free = new BoundedQueue<Chunk*>(pow2ceil(nchunks));
+    full = new BoundedQueue<Chunk*>(pow2ceil(nchunks));
+    for (size_t i = 0; i < nchunks; i++) {
+        void *data;
+        if (posix_memalign(&data,raw_align,this->chunk_bytes)) throw runtime_error("Could not allocate raw chunks");
+        chunks[i].data = (char*)data;
+        chunks[i].used = 0;
+        free->push(&chunks[i]);
+    }
+
+    closing = false;
+    failed = false;
+    chunk_stalls = 0;
+    thread = std::thread(&RawWriter::writer,this);
+
+    RawFileHeader header;
+    memset(&header,0,sizeof(header));
+    memcpy(header.magic,raw_magic,sizeof(raw_magic));
+    header.version = raw_version;
+    header.board = board;
+    header.info_bytes = sizeof(CAEN_DGTZ_BoardInfo_t);
+    header.chan_bytes = sizeof(ChannelConfig);
+    header.nchans = settings.chans.size();
+    header.extras = settings.extras;
+    header.buffer_size = buffer_size;
+    header.header_bytes = align_up(sizeof(header) + header.info_bytes + header.nchans*header.chan_bytes, raw_align);
+
+    put(&header,sizeof(header));
+    put(&settings.info,sizeof(settings.info));
+    if (header.nchans) put(settings.chans.data(),header.nchans*sizeof(ChannelConfig));
+    const vector<char> zeros(header.header_bytes - length, 0);
+    put(zeros.data(),zeros.size());
+}
+
+RawWriter::~RawWriter() {
+    if (thread.joinable()) {
+        closing = true;
+        thread.join();
+    }
+    if (fd >= 0) ::close(fd);
+    for (size_t i = 0; i < chunks.size(); i++) {
+        ::free(chunks[i].data);
+    }
+    delete free;
+    delete full;
+}
+
+void RawWriter::put(const void *data, size_t bytes) {
+    const char *src = (const char*)data;
+    while (bytes) {
+        if (!current) {
+            if (!free->pop(current)) {
+                chunk_stalls++;
+                while (!free->pop(current)) {
+                    if (failed) throw runtime_error("Raw writer failed: " + error);
+                    usleep(100);
+                }
+            }
+            current->used = 0;
+        }
+        const size_t n = min(bytes,chunk_bytes-current->used);
+        memcpy(current->data+current->used,src,n);
+        current->used += n;
+        length += n;
+        src += n;
+        bytes -= n;
+        if (current->used == chunk_bytes) submit();
+    }
+}
+
+void RawWriter::submit() {
+    full->push(current); // sized to hold every chunk, so this cannot fail
+    current = NULL;
+}
+
+void RawWriter::write(const char *data, uint32_t size, uint64_t time) {
+    if (failed) throw runtime_error("Raw writer failed: " + error);
+    RawFrame frame = {raw_frame_magic, size, time};
+    put(&frame,sizeof(frame));
+    put(data,size);
+    static const char zeros[8] = {0};
+    if (size % 8) put(zeros,8 - size % 8);
+}
+
+void RawWriter::close() {
+    if (!thread.joinable()) return;
+    if (current) {
+        // O_DIRECT only writes whole blocks, so pad the tail and trim the file afterwards
+        const size_t padded = align_up(current->used,raw_align);
+        memset(current->data+current->used,0,padded-current->used);
+        current->used = padded;
+        submit();
+    }
+    closing = true;
+    thread.join();
+    if (!failed && ftruncate(fd,length)) {
+        error = string("ftruncate: ") + strerror(errno);
+        failed = true;
+    }
+    if (::close(fd) && !failed) {
+        error = string("close: ") + strerror(errno);
+        failed = true;
+    }
+    fd = -1;
+    if (failed) throw runtime_error("Raw writer failed: " + error);
+}
+
+void RawWriter::writer() {
+    uint64_t offset = 0, allocated = 0;
+    bool can_allocate = prealloc_bytes > 0;
+    for (;;) {
+        const bool done = closing; // only set once no more chunks will be queued, so check before popping
+        Chunk *chunk;
+        if (!full->pop(chunk)) {
+            if (done) break;
+            usleep(100);
+            continue;
+        }
+        if (!failed) {
+            if (can_allocate && offset + chunk->used > allocated) {
+                if (fallocate(fd,0,allocated,prealloc_bytes) == 0) {
+                    allocated += prealloc_bytes;
+                } else {
+                    can_allocate = false; // not supported here; just write
+                }
+            }
+            size_t written = 0;
+            while (written < chunk->used) {
+                const ssize_t n = pwrite(fd,chunk->data+written,chunk->used-written,offset+written);
+                if (n < 0) {
+                    if (errno == EINTR) continue;
+                    error = string("pwrite: ") + strerror(errno);
+                    failed = true;
+                    break;
+                }
+                written += n;
+            }
+            offset += chunk->used;
+        }
+        free->push(chunk);
+    }
+}
+
+RawReader::RawReader(const string &fname) : iobuf(1 << 22), frames(0) {
+    file = fopen(fname.c_str(),"rb");
+    if (!file) throw runtime_error("Could not open " + fname + ": " + strerror(errno));
+    setvbuf(file,iobuf.data(),_IOFBF,iobuf.size());
+
+    if (fread(&header,sizeof(header),1,file) != 1 || memcmp(header.magic,raw_magic,sizeof(raw_magic))) {
+        fclose(file);
+        throw runtime_error(fname + " is not a raw dump file");
+    }
+    if (header.version != raw_version || header.info_bytes != sizeof(CAEN_DGTZ_BoardInfo_t) || header.chan_bytes != sizeof(ChannelConfig)) {
+        fclose(file);
+        throw runtime_error(fname + " was written by an incompatible version of acquire");
+    }
+    chans.resize(header.nchans);
+    if (fread(&info,sizeof(info),1,file) != 1 || (header.nchans && fread(chans.data(),sizeof(ChannelConfig),header.nchans,file) != header.nchans) || fseek(file,header.header_bytes,SEEK_SET)) {
+        fclose(file);
+        throw runtime_error(fname + " has a truncated header");
+    }
+}
+
+RawReader::~RawReader() {
+    fclose(file);
+}
+
+void RawReader::settings(Settings &settings) const {
+    settings.info = info;
+    settings.chans = chans;
+    settings.extras = header.extras;
+}
+
+bool RawReader::next(char *buffer, uint32_t &size, uint64_t &time) {
+    RawFrame frame;
+    const size_t n = fread(&frame,1,sizeof(frame),file);
+    if (n == 0) return false;
+    if (n != sizeof(frame) || frame.magic != raw_frame_magic) throw runtime_error("Bad raw frame " + to_string(frames));
+    if (frame.size > header.buffer_size) throw runtime_error("Raw frame " + to_string(frames) + " larger than the readout buffer");
+    const size_t padded = (frame.size+7)/8*8;
+    if (fread(buffer,1,frame.size,file) != frame.size || fseek(file,padded-frame.size,SEEK_CUR)) throw runtime_error("Truncated raw frame " + to_string(frames));
+    size = frame.size;
+    time = frame.time;
+    frames++;
+    return true;
+}
+
+ReplayBackend::ReplayBackend(const string &fname) : reader(fname), done(false) {
+}
+
+void ReplayBackend::getInfo(CAEN_DGTZ_BoardInfo_t &info) {
+    Settings settings;
+    reader.settings(settings);
+    info = settings.info;
+}
+
+void ReplayBackend::program(Settings &settings) {
+    reader.settings(settings);
+}
+
+char* ReplayBackend::allocBuffer(uint32_t &size) {
+    size = reader.bufferSize();
+    return new char[size];
+}
+
+void ReplayBackend::freeBuffer(char *buffer) {
+    delete [] buffer;
+}
+
+void ReplayBackend::read(char *buffer, uint32_t &size) {
+    uint64_t time;
+    size = 0;
+    if (!done && !reader.next(buffer,size,time)) done = true;
+}
+
+RawRecorder::RawRecorder(Backend &dgtz, Settings &settings, int board, const string &fname, const RunConfig &run, size_t nevents) :
+    dgtz(dgtz), nevents(nevents), pacer(run) {
+
+    uint32_t size;
+    buffer = dgtz.allocBuffer(size);
+    pacer.reset(size);
+    try {
+        writer.reset(new RawWriter(fname, settings, board, size, (size_t)run.raw_chunk_mb << 20, run.raw_buffers, (size_t)run.raw_prealloc_mb << 20));
+    } catch (runtime_error &e) {
+        dgtz.freeBuffer(buffer);
+        throw;
+    }
+
+    transfers = bytes = events = 0;
+    failed = false;
+}
+
+RawRecorder::~RawRecorder() {
+    if (thread.joinable()) {
+        failed = true; // unwinding without finish(), so stop reading
+        thread.join();
+    }
+    dgtz.freeBuffer(buffer);
+}
+
+void RawRecorder::start() {
+    dgtz.start();
+    thread = std::thread(&RawRecorder::readout,this);
+}
+
+void RawRecorder::finish() {
+    thread.join();
+    writer->close();
+    if (failed) throw runtime_error(error);
+}
+
+void RawRecorder::report(ostream &out) const {
+    out << "Raw readout: " << transfers << " transfers, " << bytes << " bytes, "
+        << events << " events, "
+        << writer->stalls() << " stalls waiting on disk"
+        << (writer->direct() ? "" : " (O_DIRECT unavailable)") << endl;
+    pacer.report(out);
+}
+
+void RawRecorder::readout() {
+    try {
+        while (events < nevents && !failed) {
+            uint32_t size;
+            dgtz.read(buffer, size);
+            const uint64_t time = now_ns();
+
+            const uint64_t wait = pacer.next(size);
+            if (wait && !dgtz.wait(wait)) usleep(wait);
+
+            if (!size) continue;
+
+            writer->write(buffer, size, time);
+            transfers++;
+            bytes += size;
+            events += CountAggregateEvents(buffer, size);
+        }
+        dgtz.stop();
+    } catch (runtime_error &e) {
+        error = e.what();
+        failed = true;
+    }
+}
@@ -0,0 +1,222 @@
+/**
+ *  Copyright 2014 by Benjamin Land (a.k.a. BenLand100)
+ *
+ *  acquire is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  acquire is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with acquire. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __RAWFILE__HH
+#define __RAWFILE__HH
+
+#include "backend.hh"
+#include "queue.hh"
+#include "pacing.hh"
+
+#include <atomic>
+#include <thread>
+#include <memory>
+#include <ostream>
+#include <cstdio>
+
+/* Raw dump file (.raw), native byte order
+ *
+ * RawFileHeader, the CAEN_DGTZ_BoardInfo_t and nchans ChannelConfigs as applied
+ * to the board, zero padded to header_bytes (a multiple of raw_align)
+ *
+ * Frames, one per ReadData transfer, each a RawFrame followed by size bytes of
+ * untouched readout data zero padded to a multiple of 8 bytes
+ */
+
+static const size_t raw_align = 4096; // O_DIRECT alignment for offsets, lengths and buffers
+static const uint32_t raw_version = 1;
+static const uint32_t raw_frame_magic = 0xF4A3E5A1;
+
+typedef struct {
+    char magic[8]; // "ACQRAW\n" and a 0
+    uint32_t version;
+    int32_t board; // DIGITIZER[n] index, -1 for a single board
+    uint32_t info_bytes, chan_bytes, nchans; // sizes of the structs that follow, to catch mismatched builds
+    uint32_t extras; // Settings::extras
+    uint32_t buffer_size; // largest transfer the board can return
+    uint32_t header_bytes; // offset of the first frame
+} RawFileHeader;
+
+typedef struct {
+    uint32_t magic; // raw_frame_magic
+    uint32_t size; // bytes of readout data that follow
+    uint64_t time; // now_ns() when the read completed
+} RawFrame;
+
+//Streams frames to a raw dump file through a few large aligned chunks that a
+//background thread writes with O_DIRECT (falling back to buffered writes where
+//the filesystem refuses it), preallocating the file ahead of the data so the
+//filesystem is not allocating blocks on every write.
+class RawWriter {
+
+    public:
+
+        // Creates the file and writes the header; chunk_bytes is rounded up to raw_align
+        RawWriter(const std::string &fname, Settings &settings, int board, uint32_t buffer_size, size_t chunk_bytes, size_t nchunks, size_t prealloc_bytes);
+
+        // Stops the writer thread and closes the file if close() was not called
+        ~RawWriter();
+
+        // Appends one transfer, waiting if every chunk is queued for writing. Not thread safe.
+        void write(const char *data, uint32_t size, uint64_t time);
+
+        // Writes everything, trims the file to its length, and closes it. Throws if writing failed.
+        void close();
+
+        // Bytes in the file so far, including headers and padding
+        inline uint64_t size() const { return length; }
+
+        // Number of times write() had to wait on the disk
+        inline size_t stalls() const { return chunk_stalls; }
+
+        // Whether O_DIRECT is in use
+        inline bool direct() const { return odirect; }
+
+    protected:
+
+        typedef struct {
+            char *data;
+            size_t used;
+        } Chunk;
+
+        // Copies bytes into the stream of chunks
+        void put(const void *data, size_t bytes);
+
+        // Hands the current chunk to the writer thread
+        void submit();
+
+        void writer();
+
+        int fd;
+        bool odirect;
+        const size_t chunk_bytes, prealloc_bytes;
+        uint64_t length; // logical length of the file
+
+        std::vector<Chunk> chunks;
+        BoundedQueue<Chunk*> *free, *full;
+        Chunk *current;
+
+        std::thread thread;
+        std::atomic<bool> closing, failed;
+        std::string error;
+        size_t chunk_stalls;
+};
+
+//Reads back the frames of a raw dump file in order.
+class RawReader {
+
+    public:
+
+        // Opens the file and checks its header, throwing if it is not a raw dump from this build
+        RawReader(const std::string &fname);
+
+        ~RawReader();
+
+        inline int board() const { return header.board; }
+
+        inline uint32_t bufferSize() const { return header.buffer_size; }
+
+        // The settings the board was programmed with
+        void settings(Settings &settings) const;
+
+        // Reads the next frame into buffer (of at least bufferSize() bytes); returns false at the end of the file
+        bool next(char *buffer, uint32_t &size, uint64_t &time);
+
+    protected:
+
+        FILE *file;
+        std::vector<char> iobuf;
+        RawFileHeader header;
+        CAEN_DGTZ_BoardInfo_t info;
+        std::vector<ChannelConfig> chans;
+        size_t frames;
+};
+
+//A Backend that replays a raw dump file as fast as it can be read, so the
+//normal decode and output path can run on recorded transfers.
+class ReplayBackend : public Backend {
+
+    public:
+
+        ReplayBackend(const std::string &fname);
+
+        virtual ~ReplayBackend() { }
+
+        virtual void open() { }
+
+        virtual void getInfo(CAEN_DGTZ_BoardInfo_t &info);
+
+        // Replaces settings with those recorded in the file
+        virtual void program(Settings &settings);
+
+        virtual void start() { }
+        virtual void stop() { }
+        virtual char* allocBuffer(uint32_t &size);
+        virtual void freeBuffer(char *buffer);
+        virtual void read(char *buffer, uint32_t &size);
+
+        virtual bool finished() const { return done; }
+
+        inline int board() const { return reader.board(); }
+
+    protected:
+
+        RawReader reader;
+        bool done;
+};
+
+//Readout without decoding: a thread per board reads transfers and hands them
+//untouched to a RawWriter until the aggregate headers show the board has
+//delivered enough events.
+class RawRecorder {
+
+    public:
+
+        // Creates the raw file for the board; stops after nevents events from all channels together
+        RawRecorder(Backend &dgtz, Settings &settings, int board, const std::string &fname, const RunConfig &run, size_t nevents);
+
+        ~RawRecorder();
+
+        // Starts the board and the readout thread
+        void start();
+
+        // Waits for the readout thread and closes the file. Throws if either failed.
+        void finish();
+
+        // Prints the readout counters
+        void report(std::ostream &out) const;
+
+        // readout counters
+        size_t transfers, bytes, events;
+
+    protected:
+
+        void readout();
+
+        Backend &dgtz;
+        const size_t nevents;
+        ReadoutPacer pacer;
+
+        char *buffer;
+        std::unique_ptr<RawWriter> writer;
+
+        std::thread thread;
+        std::atomic<bool> failed;
+        std::string error;
+};
+
+#endif
@@ -0,0 +1,147 @@
+/**
+ *  Copyright 2014 by Benjamin Land (a.k.a. BenLand100)
+ *
+ *  acquire is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  acquire is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with acquire. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "digitizer.hh"
+#include "rawfile.hh"
+#include "output.hh"
+#include "pipeline.hh"
+#include "eventbuilder.hh"
+
+#include <iostream>
+#include <chrono>
+#include <memory>
+#include <climits>
+#include <thread>
+
+#include <unistd.h>
+#include <sys/wait.h>
+
+using namespace std;
+
+// Decodes one raw dump file into the HDF5 file acquire would have written for it
+void ReplayFile(const string &fname, RunConfig &run, EventConfig &eventconfig) {
+    ReplayBackend dgtz(fname);
+    vector<Settings> settings(1);
+    InitSettings(dgtz,settings[0]);
+    dgtz.program(settings[0]);
+    const vector<int> boards(1,dgtz.board());
+
+    string outname = fname;
+    if (outname.size() > 4 && outname.substr(outname.size()-4) == ".raw") outname.resize(outname.size()-4);
+    outname += ".h5";
+
+    Output output(outname, settings, boards, run, eventconfig);
+    unique_ptr<EventBuilder> builder(eventconfig.enabled ? new EventBuilder(output, eventconfig) : NULL);
+    RunConfig unpaced = run;
+    unpaced.pacing = "fixed";
+    unpaced.transfer_wait = 0; // read the file as fast as it decodes
+    Pipeline pipeline(dgtz, output, 0, INT_MAX, run.readout_buffers, run.decode_threads, ReadoutPacer(unpaced));
+    pipeline.builder = builder.get();
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    if (builder) builder->start();
+    pipeline.run();
+    if (builder) builder->close();
+    output.close();
+    const double elapsed = chrono::duration<double>(chrono::steady_clock::now()-start).count();
+
+    size_t nevents = 0;
+    for (size_t i = 0; i < output.size(); i++) nevents += output.written(i);
+    cout << fname << " -> " << outname << ": " << nevents << " events in " << elapsed << " s ("
+         << nevents/elapsed << " events/s, " << pipeline.bytes/elapsed/1e6 << " MB/s)" << endl;
+}
+
+int main(int argc, char **argv) {
+
+    size_t jobs = max(1u,std::thread::hardware_concurrency());
+    string settings;
+    int opt;
+    while ((opt = getopt(argc, argv, "j:s:")) != -1) {
+        switch (opt) {
+            case 'j':
+                jobs = max(1,atoi(optarg));
+                break;
+            case 's':
+                settings = optarg;
+                break;
+            default:
+                optind = argc+1;
+        }
+    }
+    if (optind >= argc) {
+        cout << "./acquire-replay [-j jobs] [-s settings.json] file.raw [file.raw ...]" << endl;
+        cout << "\tdecodes each file into file.h5, using RUN output options and EVENTS from settings.json if given" << endl;
+        return -1;
+    }
+
+    map<string,json::Value> db;
+    if (!settings.empty()) db = ReadDB(settings);
+    RunConfig run;
+    RunConfigFromDB(db,run); // the defaults of an acquire settings file with no output options if there is no RUN table
+    EventConfig eventconfig;
+    EventConfigFromDB(db,eventconfig);
+
+    H5::Exception::dontPrint();
+
+    vector<string> files(argv+optind,argv+argc);
+    if (jobs == 1 || files.size() == 1) {
+        int failed = 0;
+        for (size_t i = 0; i < files.size(); i++) {
+            try {
+                ReplayFile(files[i],run,eventconfig);
+            } catch (runtime_error &e) {
+                cout << files[i] << ": " << e.what() << endl;
+                failed++;
+            }
+        }
+        return failed ? 1 : 0;
+    }
+
+    // HDF5 is not thread safe, so files are decoded in parallel by separate processes
+    size_t next = 0, running = 0;
+    int failed = 0;
+    while (next < files.size() || running) {
+        if (next < files.size() && running < jobs) {
+            cout.flush();
+            const pid_t pid = fork();
+            if (pid < 0) {
+                cout << "fork failed" << endl;
+                return 1;
+            }
+            if (pid == 0) {
+                try {
+                    ReplayFile(files[next],run,eventconfig);
+                } catch (runtime_error &e) {
+                    cout << files[next] << ": " << e.what() << endl;
+                    _exit(1);
+                }
+                cout.flush();
+                _exit(0);
+            }
+            next++;
+            running++;
+        } else {
+            int status;
+            if (wait(&status) > 0) {
+                running--;
+                if (!WIFEXITED(status) || WEXITSTATUS(status)) failed++;
+            }
+        }
+    }
+    if (failed) cout << failed << " of " << files.size() << " files failed" << endl;
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,299 @@
+/**
+ *  Copyright 2014 by Benjamin Land (a.k.a. BenLand100)
+ *
+ *  acquire is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  acquire is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with acquire. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "simulator.hh"
+#include "dpppsd.hh"
+
+#include <cmath>
+#include <algorithm>
+#include <thread>
+
+using namespace std;
+
+static const size_t sim_bank_size = 64; // distinct pulses per channel
+static const double sim_ns_tick = 2.0; // V1730 time tag resolution
+
+SimBackend::SimBackend(json::Value &sim, int board) : rng((sim.isMember("seed") ? sim["seed"].cast<int>() : 5489) + board) {
+    memset(&info,0,sizeof(info));
+    strncpy(info.ModelName,"V1730",sizeof(info.ModelName)-1);
+    strncpy(info.ROC_FirmwareRel,"simulated",sizeof(info.ROC_FirmwareRel)-1);
+    strncpy(info.AMC_FirmwareRel,"simulated DPP-PSD",sizeof(info.AMC_FirmwareRel)-1);
+    info.Channels = sim.isMember("channels") ? sim["channels"].cast<int>() : 16;
+    info.FamilyCode = 11;
+    info.ADC_NBits = 14;
+    if (info.Channels < 2 || info.Channels > MAX_DPP_PSD_CHANNEL_SIZE || info.Channels % 2) throw runtime_error("SIMULATION channels must be even and at most 16");
+
+    rate = sim["trigger_rate"].cast<double>();
+    pileup = sim.isMember("pileup_fraction") ? sim["pileup_fraction"].cast<double>() : 0.0;
+    neutrons = sim.isMember("neutron_fraction") ? sim["neutron_fraction"].cast<double>() : 0.0;
+    realtime = sim.isMember("realtime") ? sim["realtime"].cast<bool>() : true;
+    events_per_transfer = sim.isMember("events_per_transfer") ? sim["events_per_transfer"].cast<int>() : 4096;
+    buffer_events = sim.isMember("buffer_events") ? sim["buffer_events"].cast<int>() : 16384;
+    if (sim.isMember("channel_weights")) {
+        weights = sim["channel_weights"].toVector<double>();
+    }
+    weights.resize(info.Channels,weights.empty() ? 1.0 : 0.0);
+    if (rate <= 0.0 || buffer_events < 1 || events_per_transfer < 1) throw runtime_error("SIMULATION trigger_rate, buffer_events, and events_per_transfer must be positive");
+
+    running = false;
+    clock = 0;
+    aggregates = 0;
+    nlost = ngenerated = 0;
+    disabled = 0;
+}
+
+SimBackend::~SimBackend() {
+}
+
+void SimBackend::getInfo(CAEN_DGTZ_BoardInfo_t &info) {
+    info = this->info;
+}
+
+void SimBackend::program(Settings &settings) {
+    // record length is set per pair in multiples of 8 samples, like the real firmware
+    for (size_t i = 0; i < settings.info.Channels; i++) {
+        if (!settings.chans[i].enabled) continue;
+        if (i % 2 && settings.chans[i-1].enabled) {
+            settings.chans[i].samples = settings.chans[i-1].samples;
+        } else {
+            settings.chans[i].samples = (settings.chans[i].samples+7)/8*8;
+        }
+        if (settings.chans[i].presamples >= settings.chans[i].samples) settings.chans[i].presamples = settings.chans[i].samples/2;
+    }
+    this->settings = settings;
+    disabled = 0; // programming writes the whole enable mask
+
+    double total = 0.0;
+    for (size_t i = 0; i < info.Channels; i++) {
+        if (settings.chans[i].enabled) total += weights[i];
+    }
+    if (total <= 0.0) throw runtime_error("SIMULATION channel_weights leave no enabled channel triggering");
+    chan_rate.assign(info.Channels,0.0);
+    carry.assign(info.Channels,0.0);
+    pulses.assign(info.Channels,vector<SimPulse>());
+    for (size_t i = 0; i < info.Channels; i++) {
+        if (!settings.chans[i].enabled) continue;
+        chan_rate[i] = rate*weights[i]/total;
+        makePulses(i);
+    }
+}
+
+void SimBackend::makePulses(uint32_t ch) {
+    const ChannelConfig &config = settings.chans[ch];
+    const bool negative = config.pulsepol == CAEN_DGTZ_PulsePolarityNegative;
+    const double baseline = negative ? 14000.0 : 1000.0;
+    const int trigger = config.presamples;
+
+    exponential_distribution<double> energy(1.0/800.0);
+    uniform_real_distribution<double> uniform(0.0,1.0);
+    normal_distribution<double> noise(0.0,3.0);
+
+    vector<double> trace(config.samples);
+    for (size_t p = 0; p < sim_bank_size; p++) {
+        SimPulse pulse;
+        pulse.pur = p < pileup*sim_bank_size;
+        const bool neutron = uniform(rng) < neutrons;
+        const double amplitude = min(energy(rng)+50.0,12000.0);
+
+        for (size_t s = 0; s < config.samples; s++) {
+            double v = 0.0;
+            if ((int)s >= trigger) {
+                const double t = s - trigger;
+                v = amplitude*(neutron ? 0.75*exp(-t/4.0) + 0.25*exp(-t/40.0) : exp(-t/4.0));
+            }
+            if (pulse.pur) {
+                const int second = trigger + 2 + (p*7) % max<int>(1,config.samples-trigger-2);
+                if ((int)s >= second) v += 0.5*amplitude*exp(-(double)(s-second)/4.0);
+            }
+            trace[s] = v;
+        }
+
+        // integrate from the pregate like the firmware, 1 LSB per 8 ADC counts*samples
+        double qshort = 0.0, qlong = 0.0;
+        for (int s = max(0,trigger-config.pregate); s < (int)config.samples; s++) {
+            const int t = s - (trigger-config.pregate);
+            if (t < config.shortgate) qshort += trace[s];
+            if (t < config.longgate) qlong += trace[s];
+        }
+        pulse.qshort = (uint16_t)min(qshort/8.0,32767.0);
+        pulse.qlong = (uint16_t)min(qlong/8.0,65535.0);
+        pulse.baseline = (uint16_t)baseline;
+
+        pulse.samples.resize(config.samples);
+        for (size_t s = 0; s < config.samples; s++) {
+            const double v = baseline + (negative ? -trace[s] : trace[s]) + noise(rng);
+            pulse.samples[s] = (uint16_t)max(0.0,min(v,16383.0));
+        }
+        pulses[ch].push_back(pulse);
+    }
+}
+
+void SimBackend::start() {
+    running = true;
+    clock = 0;
+    aggregates = 0;
+    for (size_t i = 0; i < carry.size(); i++) carry[i] = 0.0;
+    triggers.assign(info.Channels,0);
+    dropped.assign(info.Channels,0);
+    last_read = chrono::steady_clock::now();
+}
+
+void SimBackend::stop() {
+    running = false;
+}
+
+void SimBackend::disable(uint32_t chmask) {
+    disabled = chmask;
+}
+
+char* SimBackend::allocBuffer(uint32_t &size) {
+    size_t maxwords = 0;
+    for (size_t i = 0; i < info.Channels; i++) {
+        const uint32_t nsamples = settings.chans.size() && settings.chans[i].enabled ? settings.chans[i].samples : 0;
+        maxwords = max(maxwords,AggregateEncoder::eventWords(AggregateEncoder::format(nsamples,true,settings.extras,true)));
+    }
+    size = buffer_bytes = (buffer_events*maxwords + 4 + 2*info.Channels)*4;
+    return new char[size];
+}
+
+void SimBackend::freeBuffer(char *buffer) {
+    delete [] buffer;
+}
+
+bool SimBackend::wait(uint64_t timeout) {
+    if (!settings.config_inter) return false;
+    if (!realtime || !running) return true; // a full batch is always ready
+    // the interrupt fires once irq_events have accumulated since the last read
+    const chrono::duration<double> due(settings.inter.event_number/rate);
+    const chrono::steady_clock::time_point fire = last_read + chrono::duration_cast<chrono::steady_clock::duration>(due);
+    const chrono::steady_clock::time_point limit = chrono::steady_clock::now() + chrono::microseconds(timeout);
+    this_thread::sleep_until(min(fire,limit));
+    return true;
+}
+
+bool SimBackend::full() {
+    if (!running) return false;
+    // as read() will count the events, without taking them
+    const double dt = realtime ? chrono::duration<double>(chrono::steady_clock::now()-last_read).count() : events_per_transfer/rate;
+    double total = 0.0;
+    for (size_t i = 0; i < info.Channels; i++) {
+        if (chan_rate[i] && !(disabled & (1 << i))) total += chan_rate[i]*dt + carry[i];
+    }
+    return total > buffer_events; // read() drops what does not fit
+}
+
+void SimBackend::read(char *buffer, uint32_t &size) {
+    size = 0;
+    if (!running) return;
+
+    // how much simulated time this transfer covers
+    double dt;
+    if (realtime) {
+        chrono::steady_clock::time_point now = chrono::steady_clock::now();
+        dt = chrono::duration<double>(now-last_read).count();
+        last_read = now;
+    } else {
+        dt = events_per_transfer/rate;
+    }
+    const uint64_t start = clock;
+    const uint64_t ticks = (uint64_t)(dt*1e9/sim_ns_tick);
+    clock += ticks;
+
+    vector<size_t> counts(info.Channels,0);
+    size_t total = 0;
+    for (size_t i = 0; i < info.Channels; i++) {
+        if (!chan_rate[i] || disabled & (1 << i)) continue;
+        const double expected = chan_rate[i]*dt + carry[i];
+        counts[i] = (size_t)expected;
+        carry[i] = expected - counts[i];
+        total += counts[i];
+    }
+    double span = 1.0; // of the transfer's time that triggered into the board buffer
+    if (total > buffer_events) {
+        // the board buffer filled up; the newest events never make it out
+        const double keep = span = (double)buffer_events/total;
+        size_t kept = 0;
+        for (size_t i = 0; i < info.Channels; i++) {
+            const size_t n = (size_t)(counts[i]*keep);
+            nlost += counts[i] - n;
+            dropped[i] += counts[i] - n;
+            triggers[i] += counts[i] - n;
+            counts[i] = n;
+            kept += n;
+        }
+        total = kept;
+    }
+    if (!total) return;
+
+    uniform_real_distribution<double> jitter(0.0,1.0);
+    uniform_int_distribution<uint32_t> pick(0,sim_bank_size-1);
+
+    AggregateEncoder enc(buffer,buffer_bytes);
+    enc.beginBoard(0,aggregates++,(uint32_t)start);
+    for (uint32_t pair = 0; pair < info.Channels/2; pair++) {
+        if (!counts[2*pair] && !counts[2*pair+1]) continue;
+
+        // evenly spaced triggers with jitter, so each channel is time ordered (in 1/1024 ticks for the fine time),
+        // leaving a gap at the end of the transfer when the buffer was full
+        for (int c = 0; c < 2; c++) {
+            const uint32_t ch = 2*pair+c;
+            times[c].resize(counts[ch]);
+            picks[c].resize(counts[ch]);
+            const double spacing = counts[ch] ? ticks*span/counts[ch] : 0.0;
+            for (size_t k = 0; k < counts[ch]; k++) {
+                times[c][k] = (start << 10) + (uint64_t)((k+jitter(rng))*spacing*1024.0);
+                picks[c][k] = pick(rng);
+            }
+        }
+
+        const uint32_t ref = settings.chans[2*pair].enabled ? 2*pair : 2*pair+1;
+        const bool waveforms = settings.dppacqmode != CAEN_DGTZ_DPP_ACQ_MODE_List;
+        enc.beginPair(pair,AggregateEncoder::format(waveforms ? settings.chans[ref].samples : 0,true,settings.extras,true));
+        size_t a = 0, b = 0;
+        while (a < times[0].size() || b < times[1].size()) {
+            const int c = (b >= times[1].size() || (a < times[0].size() && times[0][a] <= times[1][b])) ? 0 : 1;
+            const size_t k = c ? b++ : a++;
+            const uint32_t ch = 2*pair+c;
+            const SimPulse &pulse = pulses[ch][picks[c][k]];
+            const uint64_t t = times[c][k] >> 10;
+            const uint32_t exttime = (uint32_t)(((t >> 31) & 0xFFFF) << 16);
+            uint32_t extras = 0;
+            switch (settings.extras) {
+                case PSD_EXTRAS_BASELINE:
+                    extras = exttime | ((pulse.baseline*4) & 0xFFFF);
+                    break;
+                case PSD_EXTRAS_FLAGS:
+                    extras = exttime;
+                    break;
+                case PSD_EXTRAS_FINETIME:
+                    extras = exttime | (times[c][k] & 0x3FF);
+                    break;
+                case PSD_EXTRAS_COUNTERS:
+                    extras = (uint32_t)((dropped[ch] & 0xFFFF) << 16) | ((triggers[ch]+k+1) & 0xFFFF);
+                    break;
+            }
+            enc.addEvent(ch,(uint32_t)(t & 0x7FFFFFFF),extras,pulse.qshort,pulse.qlong,pulse.pur,pulse.samples.data());
+        }
+        enc.endPair();
+        triggers[2*pair] += counts[2*pair];
+        triggers[2*pair+1] += counts[2*pair+1];
+    }
+    enc.endBoard();
+
+    ngenerated += total;
+    size = enc.size();
+}
@@ -0,0 +1,106 @@
+/**
+ *  Copyright 2014 by Benjamin Land (a.k.a. BenLand100)
+ *
+ *  acquire is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  acquire is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with acquire. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SIMULATOR__HH
+#define __SIMULATOR__HH
+
+#include "backend.hh"
+
+#include <chrono>
+#include <random>
+
+//Pre-generated trace and charges for one simulated pulse
+typedef struct {
+    std::vector<uint16_t> samples;
+    uint16_t qshort, qlong, baseline;
+    bool pur;
+} SimPulse;
+
+//Software V1730 running DPP-PSD firmware. Produces aggregate buffers with
+//gamma- and neutron-like pulses at a configured total trigger rate, split
+//between enabled channels by relative weights, with a fraction of piled-up
+//events. In realtime mode each read returns the events that would have
+//accumulated since the last read; otherwise every read returns a full batch
+//immediately, which is what throughput benchmarks want.
+class SimBackend : public Backend {
+
+    public:
+
+        // Configured from a SIMULATION table; board offsets the random seed
+        SimBackend(json::Value &sim, int board = 0);
+
+        virtual ~SimBackend();
+
+        virtual void open() { }
+
+        virtual void getInfo(CAEN_DGTZ_BoardInfo_t &info);
+        virtual void program(Settings &settings);
+        virtual void start();
+        virtual void stop();
+        virtual void disable(uint32_t chmask);
+        virtual char* allocBuffer(uint32_t &size);
+        virtual void freeBuffer(char *buffer);
+        virtual void read(char *buffer, uint32_t &size);
+
+        // Sleeps until irq_events would have triggered, in realtime mode
+        virtual bool wait(uint64_t timeout);
+
+        // Whether the events accumulated since the last read no longer fit in one transfer
+        virtual bool full();
+
+        // Events dropped because they did not fit in one transfer (board buffer full)
+        inline size_t lost() const { return nlost; }
+
+        // Events delivered so far
+        inline size_t generated() const { return ngenerated; }
+
+    protected:
+
+        // Builds the pulse bank for one channel
+        void makePulses(uint32_t ch);
+
+        CAEN_DGTZ_BoardInfo_t info;
+        Settings settings;
+
+        double rate; // total triggers per second
+        std::vector<double> weights; // relative rate per channel
+        double pileup; // fraction of events with a second pulse
+        double neutrons; // fraction of events with a slow component
+        bool realtime;
+        size_t events_per_transfer;
+        size_t buffer_events; // events one transfer can hold
+        size_t buffer_bytes; // size of buffers from allocBuffer
+
+        std::mt19937 rng;
+        std::vector<std::vector<SimPulse>> pulses; // per channel bank
+        std::vector<double> carry; // fractional events owed per channel
+        std::vector<double> chan_rate; // triggers per second per channel
+
+        bool running;
+        std::chrono::steady_clock::time_point last_read;
+        uint64_t clock; // 2 ns ticks since start
+        uint32_t aggregates;
+        size_t nlost, ngenerated;
+        std::vector<uint64_t> triggers, dropped; // per channel counters for PSD_EXTRAS_COUNTERS
+        uint32_t disabled; // channels cleared from the enable mask, which like a board's persists across start()
+
+        // scratch for merging the two channels of a pair
+        std::vector<uint64_t> times[2];
+        std::vector<uint32_t> picks[2];
+};
+
+#endif
@@ -0,0 +1,293 @@
+/**
+ *  Copyright 2014 by Benjamin Land (a.k.a. BenLand100)
+ *
+ *  acquire is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  acquire is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with acquire. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "dpppsd.hh"
+
+#include <iostream>
+#include <vector>
+#include <cstring>
+
+using namespace std;
+
+// Checks DecodeAggregates against buffers built with AggregateEncoder. Exits non-zero on any failure.
+
+static int failures = 0;
+
+#define CHECK(cond) do { if (!(cond)) { cout << __FILE__ << ":" << __LINE__ << ": failed: " #cond << endl; failures++; } } while (0)
+
+// An event as encoded, and as it should decode
+typedef struct {
+    uint32_t ch, timetag, extras;
+    uint16_t qshort, qlong;
+    bool pur;
+    vector<uint16_t> samples;
+} TestEvent;
+
+// A decoded event with its trace unpacked
+typedef struct {
+    PSDEvent ev;
+    vector<uint16_t> samples;
+} Decoded;
+
+struct CollectSink {
+    vector<Decoded> events;
+    inline void operator()(const PSDEvent &ev) {
+        Decoded d;
+        d.ev = ev;
+        d.samples.resize(ev.waveform ? ev.nsamples : 0);
+        if (ev.waveform) UnpackSamples(ev,d.samples.data());
+        events.push_back(d);
+    }
+};
+
+static TestEvent MakeEvent(uint32_t ch, uint32_t n, uint32_t nsamples, uint32_t extras_option) {
+    TestEvent t;
+    t.ch = ch;
+    t.timetag = (0x7FFFFF00 + 1000*n + ch) & 0x7FFFFFFF;
+    switch (extras_option) {
+        case PSD_EXTRAS_BASELINE: t.extras = (0x1234u << 16) | ((1000+n) << 2); break;
+        case PSD_EXTRAS_FINETIME: t.extras = (0x0042u << 16) | ((n*37) & 0x3FF); break;
+        case PSD_EXTRAS_COUNTERS: t.extras = ((n/2) << 16) | (n+1); break;
+        default: t.extras = 0;
+    }
+    t.qshort = (100*ch + n) & 0x7FFF;
+    t.qlong = 5000 + 10*n + ch;
+    t.pur = n % 3 == 0;
+    t.samples.resize(nsamples);
+    for (uint32_t s = 0; s < nsamples; s++) t.samples[s] = (1000*ch + 7*n + s) & 0x3FFF;
+    return t;
+}
+
+// Encodes events per pair (each pair's events in order) into one board aggregate
+static vector<char> Encode(const vector<vector<TestEvent>> &pairs, const vector<uint32_t> &formats) {
+    size_t words = 4;
+    for (size_t p = 0; p < pairs.size(); p++) words += 2 + pairs[p].size()*AggregateEncoder::eventWords(formats[p]);
+    vector<char> buffer(words*4);
+    AggregateEncoder enc(buffer.data(),buffer.size());
+    enc.beginBoard(3,7,12345);
+    for (size_t p = 0; p < pairs.size(); p++) {
+        if (formats[p] == 0) continue; // pair not in the aggregate
+        enc.beginPair(p,formats[p]);
+        for (size_t i = 0; i < pairs[p].size(); i++) {
+            const TestEvent &t = pairs[p][i];
+            enc.addEvent(t.ch,t.timetag,t.extras,t.qshort,t.qlong,t.pur,t.samples.data());
+        }
+        enc.endPair();
+    }
+    enc.endBoard();
+    buffer.resize(enc.size());
+    return buffer;
+}
+
+static void CheckEvent(const Decoded &d, const TestEvent &t, uint32_t format) {
+    const PSDEvent &ev = d.ev;
+    CHECK(ev.ch == t.ch);
+    CHECK(ev.format == format);
+    CHECK(ev.timetag == t.timetag);
+    const bool charge = PSDHasCharge(format);
+    CHECK(ev.qshort == (charge ? t.qshort : 0));
+    CHECK(ev.qlong == (charge ? t.qlong : 0));
+    CHECK(ev.pur == (charge && t.pur));
+    const bool extras = PSDHasExtras(format);
+    CHECK(ev.extras == (extras ? t.extras : 0));
+    const uint64_t timestamp = PSDHasExtendedTime(format) ? ((uint64_t)(t.extras >> 16) << 31) | t.timetag : t.timetag;
+    CHECK(ev.timestamp == timestamp);
+    CHECK(ev.finetime == (PSDHasFineTime(format) ? (t.extras & 0x3FF) : 0));
+    CHECK(ev.baseline == (extras && PSDExtrasOption(format) == PSD_EXTRAS_BASELINE ? (t.extras & 0xFFFF) >> 2 : 0));
+    CHECK(ev.nsamples == t.samples.size());
+    CHECK((ev.waveform != NULL) == !t.samples.empty());
+    if (PSDDualTrace(format)) {
+        // the second trace is dropped and the first repeated
+        bool same = d.samples.size() == t.samples.size();
+        for (size_t s = 0; same && s < t.samples.size(); s++) same = d.samples[s] == t.samples[s & ~(size_t)1];
+        CHECK(same);
+    } else {
+        CHECK(d.samples == t.samples);
+    }
+}
+
+// Encodes n events on each enabled channel of every pair with format and checks decoding under chmask
+static void CheckFormat(uint32_t format, uint32_t chmask, uint32_t n, uint32_t extras_option) {
+    const uint32_t nsamples = PSDHasSamples(format) ? PSDSamples(format) : 0;
+    vector<vector<TestEvent>> pairs(8);
+    vector<uint32_t> formats(8,format);
+    for (uint32_t p = 0; p < 8; p++) {
+        for (uint32_t i = 0; i < n; i++) {
+            pairs[p].push_back(MakeEvent(2*p + i%2,i,nsamples,extras_option)); // channels of a pair interleaved
+        }
+    }
+    vector<char> buffer = Encode(pairs,formats);
+    CHECK(CountAggregateEvents(buffer.data(),buffer.size()) == 8*n);
+
+    CollectSink sink;
+    const size_t decoded = DecodeAggregates(buffer.data(),buffer.size(),chmask,sink);
+    CHECK(decoded == sink.events.size());
+
+    vector<const TestEvent*> expected;
+    for (uint32_t p = 0; p < 8; p++) {
+        for (size_t i = 0; i < pairs[p].size(); i++) {
+            if (chmask & (1 << pairs[p][i].ch)) expected.push_back(&pairs[p][i]);
+        }
+    }
+    CHECK(sink.events.size() == expected.size());
+    for (size_t i = 0; i < sink.events.size() && i < expected.size(); i++) CheckEvent(sink.events[i],*expected[i],format);
+}
+
+// True if decoding buffer throws a runtime_error (and so did not read past it)
+static bool Throws(const vector<char> &buffer) {
+    // copy into an exactly sized allocation so an overrun would be caught by sanitizers
+    char *copy = new char[buffer.size()];
+    memcpy(copy,buffer.data(),buffer.size());
+    CollectSink sink;
+    bool threw = false;
+    try {
+        DecodeAggregates(copy,buffer.size(),0xFFFF,sink);
+    } catch (runtime_error &e) {
+        threw = true;
+    }
+    delete [] copy;
+    return threw;
+}
+
+static void SetWord(vector<char> &buffer, size_t word, uint32_t value) {
+    memcpy(buffer.data()+4*word,&value,4);
+}
+
+static uint32_t GetWord(const vector<char> &buffer, size_t word) {
+    uint32_t value;
+    memcpy(&value,buffer.data()+4*word,4);
+    return value;
+}
+
+int main() {
+    const uint32_t options[3] = {PSD_EXTRAS_BASELINE, PSD_EXTRAS_FINETIME, PSD_EXTRAS_COUNTERS};
+    const uint32_t masks[4] = {0xFFFF, 0x5555, 0xAAAA, 0x0001 | 0x0008 | 0x0030}; // all, even or odd of each pair, mixed
+    for (int o = 0; o < 3; o++) {
+        for (int dual = 0; dual < 2; dual++) {
+            for (int m = 0; m < 4; m++) {
+                uint32_t format = AggregateEncoder::format(16,true,options[o],true);
+                if (dual) format |= 0x80000000;
+                CheckFormat(format,masks[m],5,options[o]);
+            }
+        }
+    }
+    // no waveforms, no extras, no charge
+    CheckFormat(AggregateEncoder::format(0,true,PSD_EXTRAS_FINETIME,true),0xFFFF,4,PSD_EXTRAS_FINETIME);
+    CheckFormat(AggregateEncoder::format(8,false,0,true),0x00FF,3,PSD_EXTRAS_FLAGS);
+    CheckFormat(AggregateEncoder::format(8,true,PSD_EXTRAS_COUNTERS,false),0xFF00,3,PSD_EXTRAS_COUNTERS);
+    // no channels in the mask decodes nothing
+    CheckFormat(AggregateEncoder::format(8,true,PSD_EXTRAS_BASELINE,true),0,3,PSD_EXTRAS_BASELINE);
+
+    const uint32_t format = AggregateEncoder::format(8,true,PSD_EXTRAS_BASELINE,true);
+
+    // empty board aggregate, empty channel aggregates, and pairs left out of the aggregate
+    {
+        vector<vector<TestEvent>> pairs(8);
+        vector<char> none = Encode(pairs,vector<uint32_t>(8,0));
+        CHECK(none.size() == 16);
+        CollectSink sink;
+        CHECK(DecodeAggregates(none.data(),none.size(),0xFFFF,sink) == 0);
+
+        vector<char> empty = Encode(pairs,vector<uint32_t>(8,format));
+        CHECK(empty.size() == 4*(4+8*2));
+        CHECK(DecodeAggregates(empty.data(),empty.size(),0xFFFF,sink) == 0);
+        CHECK(CountAggregateEvents(empty.data(),empty.size()) == 0);
+
+        vector<uint32_t> some(8,0);
+        some[2] = some[5] = format;
+        pairs[2].push_back(MakeEvent(5,0,8,PSD_EXTRAS_BASELINE));
+        pairs[5].push_back(MakeEvent(10,1,8,PSD_EXTRAS_BASELINE));
+        pairs[5].push_back(MakeEvent(11,2,8,PSD_EXTRAS_BASELINE));
+        vector<char> sparse = Encode(pairs,some);
+        CHECK(DecodeAggregates(sparse.data(),sparse.size(),0xFFFF,sink) == 3);
+        CHECK(sink.events.size() == 3);
+        if (sink.events.size() == 3) {
+            CheckEvent(sink.events[0],pairs[2][0],format);
+            CheckEvent(sink.events[1],pairs[5][0],format);
+            CheckEvent(sink.events[2],pairs[5][1],format);
+        }
+
+        // two board aggregates back to back
+        vector<char> twice = sparse;
+        twice.insert(twice.end(),sparse.begin(),sparse.end());
+        CollectSink both;
+        CHECK(DecodeAggregates(twice.data(),twice.size(),0xFFFF,both) == 6);
+    }
+
+    // malformed buffers throw rather than read past the end
+    {
+        vector<vector<TestEvent>> pairs(8);
+        vector<uint32_t> formats(8,0);
+        formats[0] = formats[1] = format;
+        for (uint32_t i = 0; i < 3; i++) {
+            pairs[0].push_back(MakeEvent(i%2,i,8,PSD_EXTRAS_BASELINE));
+            pairs[1].push_back(MakeEvent(2+i%2,i,8,PSD_EXTRAS_BASELINE));
+        }
+        const vector<char> good = Encode(pairs,formats);
+        CHECK(!Throws(good));
+        const size_t evwords = AggregateEncoder::eventWords(format);
+        const size_t pair1 = 4 + 2 + 3*evwords; // first word of the second channel aggregate
+
+        vector<char> bad = good;
+        bad.resize(good.size()-4); // truncated transfer
+        CHECK(Throws(bad));
+
+        bad = good;
+        SetWord(bad,0,GetWord(good,0)+1); // board size past the buffer
+        CHECK(Throws(bad));
+
+        bad = good;
+        SetWord(bad,0,0xA0000000 | 3); // board size smaller than its header
+        CHECK(Throws(bad));
+
+        bad = good;
+        SetWord(bad,0,0xB0000000 | (GetWord(good,0) & 0x0FFFFFFF)); // not a board header
+        CHECK(Throws(bad));
+
+        bad = good;
+        SetWord(bad,4,0x80000000 | 0x3FFFFF); // channel size past the board
+        CHECK(Throws(bad));
+
+        bad = good;
+        SetWord(bad,4,0x80000000 | 1); // channel size smaller than its header
+        CHECK(Throws(bad));
+
+        bad = good;
+        SetWord(bad,pair1,GetWord(good,pair1)-1); // channel size not a whole number of events
+        CHECK(Throws(bad));
+
+        bad = good;
+        SetWord(bad,4,GetWord(good,4)+evwords); // first channel overlaps the second
+        CHECK(Throws(bad));
+
+        bad = good;
+        SetWord(bad,1,GetWord(good,1) | 0x04); // pair 2 claimed but missing
+        CHECK(Throws(bad));
+
+        bad = good;
+        bad.resize(12); // not even a whole board header
+        SetWord(bad,0,0xA0000000 | 4);
+        CHECK(Throws(bad));
+    }
+
+    if (failures) {
+        cout << failures << " checks failed" << endl;
+        return 1;
+    }
+    cout << "All decode checks passed" << endl;
+    return 0;
+}
@@ -0,0 +1,110 @@
+/**
+ *  Copyright 2014 by Benjamin Land (a.k.a. BenLand100)
+ *
+ *  acquire is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  acquire is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with acquire. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "trace.hh"
+#include "json.hh"
+
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+
+using namespace std;
+
+TraceRing *trace_ring = NULL;
+
+thread_local uint32_t trace_tid = 0;
+
+static mutex trace_mutex; // guards the names
+static map<string,uint32_t> trace_names; // tid of each thread name
+static uint64_t trace_origin; // now_ns() at TraceStart
+
+TraceRing::TraceRing(size_t capacity) : next(0) {
+    size_t size = 1;
+    while (size < capacity) size <<= 1;
+    spans = new TraceSpan[size];
+    mask = size-1;
+}
+
+TraceRing::~TraceRing() {
+    delete [] spans;
+}
+
+void TraceStart(size_t capacity) {
+    if (trace_ring) throw runtime_error("Already tracing");
+    trace_origin = now_ns();
+    trace_ring = new TraceRing(capacity);
+}
+
+void TraceThread(const string &name) {
+    lock_guard<mutex> lock(trace_mutex);
+    map<string,uint32_t>::iterator it = trace_names.find(name);
+    if (it == trace_names.end()) it = trace_names.insert(make_pair(name,(uint32_t)trace_names.size()+1)).first;
+    trace_tid = it->second;
+}
+
+void TraceWrite(const string &fname) {
+    if (!trace_ring) return;
+    unique_ptr<TraceRing> ring(trace_ring);
+    trace_ring = NULL;
+
+    ofstream out(fname);
+    if (!out) throw runtime_error("Could not open trace file " + fname);
+    json::Writer writer(out);
+    writer.beginObject();
+    writer.key("displayTimeUnit");
+    writer.putString("ns");
+    writer.key("traceEvents");
+    writer.beginArray();
+
+    lock_guard<mutex> lock(trace_mutex);
+    for (map<string,uint32_t>::iterator it = trace_names.begin(); it != trace_names.end(); ++it) {
+        writer.beginObject();
+        writer.key("name"); writer.putString("thread_name");
+        writer.key("ph"); writer.putString("M");
+        writer.key("pid"); writer.putInteger(1);
+        writer.key("tid"); writer.putUInteger(it->second);
+        writer.key("args");
+        writer.beginObject();
+        writer.key("name"); writer.putString(it->first);
+        writer.endObject();
+        writer.endObject();
+    }
+
+    // complete events, in us from TraceStart
+    for (size_t i = 0; i < ring->held(); i++) {
+        const TraceSpan &span = ring->span(i);
+        writer.beginObject();
+        writer.key("name"); writer.putString(span.name);
+        writer.key("ph"); writer.putString("X");
+        writer.key("pid"); writer.putInteger(1);
+        writer.key("tid"); writer.putUInteger(span.tid);
+        writer.key("ts"); writer.putReal((span.begin-trace_origin)/1e3);
+        writer.key("dur"); writer.putReal((span.end-span.begin)/1e3);
+        writer.endObject();
+    }
+
+    writer.endArray();
+    writer.key("otherData");
+    writer.beginObject();
+    writer.key("spans_recorded"); writer.putUInteger(ring->recorded());
+    writer.key("spans_overwritten"); writer.putUInteger(ring->recorded()-ring->held());
+    writer.endObject();
+    writer.endObject();
+    if (!out) throw runtime_error("Could not write trace file " + fname);
+}
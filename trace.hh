@@ -0,0 +1,89 @@
+/**
+ *  Copyright 2014 by Benjamin Land (a.k.a. BenLand100)
+ *
+ *  acquire is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  acquire is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with acquire. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TRACE__HH
+#define __TRACE__HH
+
+#include "latency.hh"
+
+#include <cstdint>
+#include <string>
+#include <atomic>
+
+// One span of one thread
+typedef struct {
+    uint64_t begin, end; // now_ns()
+    const char *name; // must outlive the trace (a literal)
+    uint32_t tid; // from TraceThread
+} TraceSpan;
+
+//Preallocated ring of the latest spans of every thread. Recording is one
+//relaxed fetch_add and a store into the claimed slot, so threads never wait
+//on each other; once the ring wraps the oldest spans are overwritten.
+class TraceRing {
+
+    public:
+
+        // Room for capacity spans (rounded up to a power of 2)
+        TraceRing(size_t capacity);
+
+        ~TraceRing();
+
+        inline void record(const char *name, uint64_t begin, uint64_t end, uint32_t tid) {
+            TraceSpan &span = spans[next.fetch_add(1,std::memory_order_relaxed) & mask];
+            span.begin = begin;
+            span.end = end;
+            span.name = name;
+            span.tid = tid;
+        }
+
+        // Spans recorded in total, and those still held
+        inline uint64_t recorded() const { return next; }
+        inline size_t held() const { return next < mask+1 ? (size_t)next : mask+1; }
+
+        // The i-th oldest span held
+        inline const TraceSpan& span(size_t i) const { return spans[(next - held() + i) & mask]; }
+
+    protected:
+
+        TraceSpan *spans;
+        size_t mask;
+        std::atomic<uint64_t> next;
+};
+
+// The ring being recorded into, NULL unless TraceStart was called
+extern TraceRing *trace_ring;
+
+// Id of the calling thread in the trace (0 until TraceThread is called)
+extern thread_local uint32_t trace_tid;
+
+// Starts recording spans into a ring of capacity spans
+void TraceStart(size_t capacity);
+
+// Names the calling thread. Threads given the same name share a track in the trace.
+void TraceThread(const std::string &name);
+
+// Records a span of the calling thread from begin to end (now_ns), if tracing
+inline void TraceEvent(const char *name, uint64_t begin, uint64_t end) {
+    if (trace_ring) trace_ring->record(name,begin,end,trace_tid);
+}
+
+// Writes the spans held as Chrome trace event JSON (for chrome://tracing or ui.perfetto.dev)
+// and stops tracing. The traced threads must be done.
+void TraceWrite(const std::string &fname);
+
+#endif
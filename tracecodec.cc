@@ -0,0 +1,291 @@
+/**
+ *  Copyright 2014 by Benjamin Land (a.k.a. BenLand100)
+ *
+ *  acquire is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  acquire is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with acquire. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "tracecodec.hh"
+
+#include <cstring>
+#include <stdexcept>
+
+#include <emmintrin.h>
+
+using namespace std;
+
+static const uint32_t trace_version = 1;
+
+/* Vertical bit packing of a block as 16 rows of 8 lanes: row r holds values
+ * 8r..8r+7 and lane l of the output words is a bit stream of the values of
+ * lane l, so every row is packed with the same shifts in one SSE2 register.
+ * Templated on the width so each one unrolls with constant shifts.
+ */
+
+template <int B>
+static void pack(const uint16_t *in, char *out) {
+    const __m128i mask = _mm_set1_epi16((short)((1u << B) - 1));
+    __m128i *words = (__m128i*)out;
+    __m128i acc = _mm_setzero_si128();
+    int bits = 0;
+#pragma GCC unroll 16
+    for (int r = 0; r < 16; r++) {
+        const __m128i v = _mm_and_si128(_mm_loadu_si128((const __m128i*)(in+8*r)),mask);
+        acc = _mm_or_si128(acc,_mm_slli_epi16(v,bits));
+        bits += B;
+        if (bits >= 16) {
+            _mm_storeu_si128(words++,acc);
+            bits -= 16;
+            acc = bits ? _mm_srli_epi16(v,B-bits) : _mm_setzero_si128();
+        }
+    }
+}
+
+template <int B>
+static void unpack(const char *in, uint16_t *out) {
+    const __m128i mask = _mm_set1_epi16((short)((1u << B) - 1));
+    const __m128i *words = (const __m128i*)in;
+    __m128i cur = _mm_setzero_si128();
+    int bits = 16;
+#pragma GCC unroll 16
+    for (int r = 0; r < 16; r++) {
+        if (B == 0) {
+            _mm_storeu_si128((__m128i*)(out+8*r),cur);
+            continue;
+        }
+        if (bits == 16) {
+            cur = _mm_loadu_si128(words++);
+            bits = 0;
+        }
+        __m128i v = _mm_srli_epi16(cur,bits);
+        if (bits + B > 16) {
+            cur = _mm_loadu_si128(words++);
+            v = _mm_or_si128(v,_mm_slli_epi16(cur,16-bits));
+            bits += B - 16;
+        } else {
+            bits += B;
+        }
+        _mm_storeu_si128((__m128i*)(out+8*r),_mm_and_si128(v,mask));
+    }
+}
+
+typedef void (*PackFn)(const uint16_t*, char*);
+typedef void (*UnpackFn)(const char*, uint16_t*);
+
+static const PackFn packers[17] = {
+    pack<0>, pack<1>, pack<2>, pack<3>, pack<4>, pack<5>, pack<6>, pack<7>, pack<8>,
+    pack<9>, pack<10>, pack<11>, pack<12>, pack<13>, pack<14>, pack<15>, pack<16>
+};
+
+static const UnpackFn unpackers[17] = {
+    unpack<0>, unpack<1>, unpack<2>, unpack<3>, unpack<4>, unpack<5>, unpack<6>, unpack<7>, unpack<8>,
+    unpack<9>, unpack<10>, unpack<11>, unpack<12>, unpack<13>, unpack<14>, unpack<15>, unpack<16>
+};
+
+static inline int width(uint16_t value) {
+    return value ? 32 - __builtin_clz(value) : 0;
+}
+
+size_t TraceEncodedBound(size_t nvalues) {
+    const size_t nblocks = (nvalues + trace_block - 1) / trace_block;
+    return sizeof(TraceHeader) + nblocks*(2 + 2*trace_block); // never worse than 16 bits without exceptions
+}
+
+size_t EncodeTraces(const uint16_t *samples, size_t nvalues, char *out) {
+    TraceHeader header = {trace_magic, trace_version, (uint32_t)nvalues, 0};
+    memcpy(out,&header,sizeof(header));
+    char *p = out + sizeof(header);
+
+    uint16_t z[trace_block];
+    uint16_t prev = 0;
+    for (size_t start = 0; start < nvalues; start += trace_block) {
+        const size_t n = min(trace_block,nvalues-start);
+        const uint16_t *in = samples + start;
+
+        // zig-zag of the differences, 8 at a time; the first row borrows the previous sample
+        size_t i = 0;
+        if (n == trace_block) {
+            __m128i last = _mm_set1_epi16((short)prev);
+            for (; i < trace_block; i += 8) {
+                const __m128i v = _mm_loadu_si128((const __m128i*)(in+i));
+                const __m128i shifted = _mm_or_si128(_mm_slli_si128(v,2),_mm_srli_si128(last,14));
+                const __m128i d = _mm_sub_epi16(v,shifted);
+                _mm_storeu_si128((__m128i*)(z+i),_mm_xor_si128(_mm_slli_epi16(d,1),_mm_srai_epi16(d,15)));
+                last = v;
+            }
+            prev = in[trace_block-1];
+        } else {
+            for (; i < n; i++) {
+                const int16_t d = in[i] - prev;
+                z[i] = (uint16_t)((d << 1) ^ (d >> 15));
+                prev = in[i];
+            }
+            for (; i < trace_block; i++) z[i] = 0;
+        }
+
+        size_t widths[17] = {0};
+        for (i = 0; i < trace_block; i++) widths[width(z[i])]++;
+        int top = 16;
+        while (top > 0 && !widths[top]) top--;
+
+        // narrowest width for the bits, counting a position byte and the high bits of each exception
+        int best = top;
+        size_t best_cost = trace_block*top, exceptions = 0, best_exceptions = 0;
+        for (int b = top-1; b >= 0; b--) {
+            exceptions += widths[b+1];
+            const size_t cost = trace_block*b + exceptions*(8+top-b) + 8;
+            if (cost < best_cost) {
+                best = b;
+                best_cost = cost;
+                best_exceptions = exceptions;
+            }
+        }
+
+        *p++ = (char)best;
+        *p++ = (char)best_exceptions;
+        packers[best](z,p);
+        p += 16*best;
+        if (best_exceptions) {
+            const int e = top - best;
+            *p++ = (char)e;
+            uint8_t *positions = (uint8_t*)p;
+            uint8_t *highs = positions + best_exceptions;
+            memset(highs,0,(best_exceptions*e+7)/8);
+            size_t bit = 0;
+            for (i = 0; i < trace_block; i++) {
+                const uint32_t high = z[i] >> best;
+                if (!high) continue;
+                *positions++ = i;
+                const uint32_t shifted = high << (bit & 7);
+                for (size_t byte = bit >> 3; byte < ((bit + e + 7) >> 3); byte++) highs[byte] |= shifted >> (8*(byte - (bit >> 3)));
+                bit += e;
+            }
+            p = (char*)highs + (bit+7)/8;
+        }
+    }
+    return p - out;
+}
+
+size_t TraceDecodedValues(const char *in, size_t size) {
+    TraceHeader header;
+    if (size < sizeof(header)) return 0;
+    memcpy(&header,in,sizeof(header));
+    if (header.magic != trace_magic || header.version != trace_version) return 0;
+    return header.nvalues;
+}
+
+bool DecodeTraces(const char *in, size_t size, uint16_t *samples) {
+    const size_t nvalues = TraceDecodedValues(in,size);
+    if (!nvalues) return false;
+    const char *p = in + sizeof(TraceHeader), *end = in + size;
+
+    const __m128i one = _mm_set1_epi16(1);
+    uint16_t z[trace_block], tail[trace_block];
+    __m128i carry = _mm_setzero_si128(); // previous sample in every lane
+    for (size_t start = 0; start < nvalues; start += trace_block) {
+        if (end - p < 2) return false;
+        const unsigned b = (uint8_t)*p++;
+        const unsigned nexceptions = (uint8_t)*p++;
+        if (b > 16 || (size_t)(end - p) < 16*b) return false;
+        unpackers[b](p,z);
+        p += 16*b;
+        if (nexceptions) {
+            if (end - p < 1) return false;
+            const unsigned e = (uint8_t)*p++;
+            if (b + e > 16 || (size_t)(end - p) < nexceptions + (nexceptions*e+7)/8) return false;
+            const uint8_t *positions = (const uint8_t*)p;
+            const uint8_t *highs = positions + nexceptions;
+            const size_t nbytes = (nexceptions*e+7)/8;
+            const uint32_t mask = (1u << e) - 1;
+            for (unsigned i = 0, bit = 0; i < nexceptions; i++, bit += e) {
+                uint32_t word = 0;
+                if ((bit >> 3) + 4 <= (size_t)(end - (const char*)highs)) {
+                    memcpy(&word,highs + (bit >> 3),sizeof(word)); // little endian, like the writer
+                } else {
+                    for (unsigned byte = bit >> 3; byte < nbytes; byte++) word |= (uint32_t)highs[byte] << (8*(byte - (bit >> 3)));
+                }
+                z[positions[i] & (trace_block-1)] |= ((word >> (bit & 7)) & mask) << b;
+            }
+            p = (const char*)highs + nbytes;
+        }
+
+        // undo the zig-zag and take the running sum, 8 at a time
+        const size_t n = min(trace_block,nvalues-start);
+        uint16_t *out = n == trace_block ? samples + start : tail;
+        for (size_t i = 0; i < trace_block; i += 8) {
+            const __m128i v = _mm_loadu_si128((const __m128i*)(z+i));
+            __m128i d = _mm_xor_si128(_mm_srli_epi16(v,1),_mm_sub_epi16(_mm_setzero_si128(),_mm_and_si128(v,one)));
+            d = _mm_add_epi16(d,_mm_slli_si128(d,2));
+            d = _mm_add_epi16(d,_mm_slli_si128(d,4));
+            d = _mm_add_epi16(d,_mm_slli_si128(d,8));
+            d = _mm_add_epi16(d,carry);
+            _mm_storeu_si128((__m128i*)(out+i),d);
+            carry = _mm_shufflehi_epi16(d,0xFF);
+            carry = _mm_unpackhi_epi64(carry,carry);
+        }
+        if (out == tail) memcpy(samples+start,tail,n*sizeof(uint16_t));
+    }
+    return true;
+}
+
+static htri_t trace_can_apply(hid_t dcpl, hid_t type, hid_t space) {
+    return H5Tget_class(type) == H5T_INTEGER && H5Tget_size(type) == 2 ? 1 : 0;
+}
+
+static size_t trace_filter(unsigned int flags, size_t cd_nelmts, const unsigned int cd_values[], size_t nbytes, size_t *buf_size, void **buf) {
+    if (flags & H5Z_FLAG_REVERSE) {
+        const size_t nvalues = TraceDecodedValues((const char*)*buf,nbytes);
+        if (!nvalues) return 0;
+        uint16_t *out = (uint16_t*)H5allocate_memory(nvalues*sizeof(uint16_t),false);
+        if (!out) return 0;
+        if (!DecodeTraces((const char*)*buf,nbytes,out)) {
+            H5free_memory(out);
+            return 0;
+        }
+        H5free_memory(*buf);
+        *buf = out;
+        *buf_size = nvalues*sizeof(uint16_t);
+        return *buf_size;
+    } else {
+        const size_t nvalues = nbytes/sizeof(uint16_t);
+        char *out = (char*)H5allocate_memory(TraceEncodedBound(nvalues),false);
+        if (!out) return 0;
+        const size_t size = EncodeTraces((const uint16_t*)*buf,nvalues,out);
+        if (size >= nbytes) {
+            H5free_memory(out); // incompressible, so HDF5 stores it unfiltered
+            return 0;
+        }
+        H5free_memory(*buf);
+        *buf = out;
+        *buf_size = TraceEncodedBound(nvalues);
+        return size;
+    }
+}
+
+static const H5Z_class2_t trace_class = {
+    H5Z_CLASS_T_VERS,
+    H5Z_FILTER_TRACE,
+    1, 1,
+    "acquire trace codec",
+    trace_can_apply,
+    NULL,
+    trace_filter
+};
+
+void RegisterTraceFilter() {
+    if (H5Zregister(&trace_class) < 0) throw runtime_error("Could not register the trace codec with HDF5");
+}
+
+const void* TraceFilterClass() {
+    return &trace_class;
+}
@@ -0,0 +1,74 @@
+/**
+ *  Copyright 2014 by Benjamin Land (a.k.a. BenLand100)
+ *
+ *  acquire is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  acquire is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with acquire. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TRACECODEC__HH
+#define __TRACECODEC__HH
+
+#include <cstdint>
+#include <cstddef>
+
+#include <hdf5.h>
+
+/* Lossless codec for blocks of ADC traces stored back to back (a chunk of a
+ * samples dataset), native byte order
+ *
+ * TraceHeader, then the residuals in blocks of trace_block values (the last
+ * zero padded). Residuals are sample to sample differences, so a trace on a
+ * flat baseline is just its noise and the first sample of each trace follows
+ * the tail of the previous one, zig-zag encoded so small differences of either
+ * sign are small numbers.
+ *
+ * Each block is a uint8 bit width b and a uint8 exception count n, b*16 bytes
+ * of the low b bits of every residual packed vertically as 8 lanes of 16 bit
+ * words (value i in lane i%8), and if n is not 0 a uint8 width e, n uint8
+ * positions and the high parts (residual >> b) of the n residuals that did not
+ * fit in b bits, packed in e bits each from the lowest bit of the first byte.
+ */
+
+static const uint32_t trace_magic = 0x43415254; // "TRAC"
+static const size_t trace_block = 128;
+
+// HDF5 filter id, from the range The HDF Group leaves unassigned (32768-65535) so it
+// cannot collide with a registered filter (307 is BZIP2) loaded from HDF5_PLUGIN_PATH
+static const H5Z_filter_t H5Z_FILTER_TRACE = 47806;
+
+typedef struct {
+    uint32_t magic; // trace_magic
+    uint32_t version;
+    uint32_t nvalues; // samples in the chunk
+    uint32_t reserved;
+} TraceHeader;
+
+// Largest encoding of nvalues samples
+size_t TraceEncodedBound(size_t nvalues);
+
+// Encodes nvalues samples into out, which holds at least TraceEncodedBound(nvalues) bytes. Returns the encoded size.
+size_t EncodeTraces(const uint16_t *samples, size_t nvalues, char *out);
+
+// Number of samples in an encoded buffer, or 0 if it is not one
+size_t TraceDecodedValues(const char *in, size_t size);
+
+// Decodes into samples (TraceDecodedValues(in) of them). Returns false if the buffer is corrupt.
+bool DecodeTraces(const char *in, size_t size, uint16_t *samples);
+
+// Registers the codec with HDF5 as H5Z_FILTER_TRACE, replacing any other filter loaded with that id (safe to call repeatedly)
+void RegisterTraceFilter();
+
+// The H5Z_class2_t describing the filter, for the plugin library
+const void* TraceFilterClass();
+
+#endif
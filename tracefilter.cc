@@ -0,0 +1,31 @@
+/**
+ *  Copyright 2014 by Benjamin Land (a.k.a. BenLand100)
+ *
+ *  acquire is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  acquire is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with acquire. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Entry points that let any HDF5 reader (h5dump, h5py, ...) load the trace
+// codec from libh5trace.so found on HDF5_PLUGIN_PATH (filter id H5Z_FILTER_TRACE, 47806)
+
+#include "tracecodec.hh"
+
+#include <H5PLextern.h>
+
+extern "C" H5PL_type_t H5PLget_plugin_type() {
+    return H5PL_TYPE_FILTER;
+}
+
+extern "C" const void* H5PLget_plugin_info() {
+    return TraceFilterClass();
+}
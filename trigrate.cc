@@ -16,9 +16,13 @@
  */
  
 #include "digitizer.hh"
+#include "backend.hh"
+#include "dpppsd.hh"
+#include "metrics.hh"
 
 #include <iostream>
 #include <fstream>
+#include <memory>
 
 #include <unistd.h>
 #include <sys/time.h> 
@@ -27,6 +31,12 @@
 
 using namespace std;
 
+// Counts decoded events per channel
+struct CountSink {
+    uint32_t nevents[MAX_DPP_PSD_CHANNEL_SIZE];
+    inline void operator()(const PSDEvent &ev) { nevents[ev.ch]++; }
+};
+
 int main(int argc, char **argv) {
 
     if (argc < 2 || argc > 3) {
@@ -50,36 +60,30 @@ int main(int argc, char **argv) {
     
     const int transfer_wait = run["transfer_wait"].cast<int>();
     const int update_wait = run["update_wait"].cast<int>();
-    const int linknum = run["link_num"].cast<int>();
-    const int baseaddr = run["base_address"].cast<int>();
+    const string stats_file = run.isMember("stats_file") ? run["stats_file"].cast<string>() : "";
+
+    const int board = BoardsFromDB(db)[0]; // rates are shown for the first board
 
     cout << "Opening digitizer..." << endl;
 
-    int handle; // CAENDigitizerSDK digitizer identifier
-    SAFE(CAEN_DGTZ_OpenDigitizer(CAEN_DGTZ_USB, linknum, 0, baseaddr, &handle));
-    SAFE(CAEN_DGTZ_SWStopAcquisition(handle));
-    SAFE(CAEN_DGTZ_Reset(handle));
+    unique_ptr<Backend> dgtz(OpenBackend(db,board));
+    dgtz->open();
 
     Settings settings;
-    InitSettings(handle,settings);
-    SettingsFromDB(db,settings);
+    InitSettings(*dgtz,settings);
+    PrintInfo(settings);
+    SettingsFromDB(db,settings,board);
 
     cout << "Programming digitizer..." << endl;
 
-    ApplySettings(handle,settings);
+    dgtz->program(settings);
 
     cout << "Allocating readout buffers..." << endl;
 
     uint32_t size; 
-    char *readout = NULL; // readout buffer (must init to NULL)
-    uint32_t nevents[MAX_DPP_PSD_CHANNEL_SIZE]; // events read per channel
-    CAEN_DGTZ_DPP_PSD_Event_t *events[MAX_DPP_PSD_CHANNEL_SIZE]; // event buffer per channel
-    CAEN_DGTZ_DPP_PSD_Waveforms_t *waveform = NULL; // waveform buffer
-
-    // ugh this syntax
-    SAFE(CAEN_DGTZ_MallocReadoutBuffer(handle, &readout, &size));
-    SAFE(CAEN_DGTZ_MallocDPPEvents(handle, (void**)events, &size));
-    SAFE(CAEN_DGTZ_MallocDPPWaveforms(handle, (void**)&waveform, &size)); 
+    char *readout = dgtz->allocBuffer(size); // readout buffer
+    CountSink counts; // events read per channel
+    uint32_t *nevents = counts.nevents;
 
     cout << "Allocating temporary data storage..." << endl;
 
@@ -94,6 +98,13 @@ int main(int argc, char **argv) {
     }
     vector<size_t> sumevents(chan2idx.size(),0);
     if (saverates) fout << endl;
+    
+    // read and decode latencies, shown with the rates and saved to stats_file if given
+    Telemetry telemetry;
+    ThreadMetrics &metrics = *telemetry.thread();
+    Metrics shown;
+    StatusLine status(0, stats_file);
+    status.watch(&telemetry);
 
     cout << "Starting trigrate..." << endl;
     
@@ -106,8 +117,7 @@ int main(int argc, char **argv) {
     move(0,0);
     addstr("Press q to exit ");
 
-    SAFE(CAEN_DGTZ_ClearData(handle));
-    SAFE(CAEN_DGTZ_SWStartAcquisition(handle));
+    dgtz->start();
     
     struct timeval start, end;
     gettimeofday(&start, NULL);
@@ -119,13 +129,26 @@ int main(int argc, char **argv) {
             if (ch == 'q') break;
         }
 
-        SAFE(CAEN_DGTZ_ReadData(handle, CAEN_DGTZ_SLAVE_TERMINATED_READOUT_MBLT, readout, &size)); //read raw data from the digitizer
+        uint64_t begin = now_ns();
+        dgtz->read(readout, size); //read raw data from the digitizer
+        metrics.time(METRIC_READ,begin);
+        metrics.publish();
         
         usleep(transfer_wait*1000);
         
         if (!size) continue;
+        metrics.count(METRIC_TRANSFERS);
+        metrics.count(METRIC_BYTES,size);
+        metrics.local.transfer_bytes.record(size);
         
-        SAFE(CAEN_DGTZ_GetDPPEvents(handle, readout, size, (void **)events, nevents)); //parses the buffer and populates events and nevents
+        memset(nevents,0,sizeof(counts.nevents));
+        begin = now_ns();
+        DecodeAggregates(readout, size, 0xFFFF, counts); //parses the buffer and populates nevents
+        metrics.time(METRIC_DECODE,begin);
+        uint64_t decoded = 0;
+        for (uint32_t ch = 0; ch < settings.info.Channels; ch++) decoded += nevents[ch];
+        metrics.count(METRIC_EVENTS,decoded);
+        metrics.local.transfer_events.record(decoded);
         
         gettimeofday(&end, NULL);
         size_t ms_elapsed = ((end.tv_sec - start.tv_sec)*1000  + (end.tv_usec - start.tv_usec)/1000);
@@ -154,10 +177,23 @@ int main(int argc, char **argv) {
             }
         }
         if (ms_elapsed >= update_wait && saverates) fout << endl;
+        
+        if (ms_elapsed >= update_wait) {
+            Metrics window = metrics.local;
+            window.subtract(shown);
+            shown = metrics.local;
+            const LatencyHistogram &read = window.stages[METRIC_READ], &decode = window.stages[METRIC_DECODE];
+            string lat = "read p50/p99 " + to_string(read.percentile(0.5)/1e3) + "/" + to_string(read.percentile(0.99)/1e3) + " us, "
+                       + "decode p50/p99 " + to_string(decode.percentile(0.5)/1e3) + "/" + to_string(decode.percentile(0.99)/1e3) + " us, "
+                       + to_string(window.transfer_bytes.mean()) + " bytes/transfer       ";
+            move(chan2idx.size()*2+2,0);
+            addstr(lat.c_str());
+        }
     }
+    metrics.publish(true);
 
-    SAFE(CAEN_DGTZ_SWStopAcquisition(handle));
-    SAFE(CAEN_DGTZ_CloseDigitizer(handle));
+    dgtz->stop();
+    dgtz->freeBuffer(readout);
     
     if (saverates) fout.close();
     